@@ -13,6 +13,7 @@
 #include "emulator.h"
 #include "host.h"
 #include "options.h"
+#include "rom-cache.h"
 
 #define SAVE_EXTENSION ".sav"
 #define SAVE_STATE_EXTENSION ".state"
@@ -26,6 +27,10 @@
 #define STATUS_TEXT_RGBA MAKE_RGBA(255, 0, 0, 255)
 #define STATUS_TEXT_TIMEOUT 120 /* Frames */
 
+#define LATENCY_TEXT_X 2
+#define LATENCY_TEXT_Y 2
+#define LATENCY_TEXT_RGBA MAKE_RGBA(0, 0, 255, 255)
+
 typedef enum Layer {
   LAYER_BG,
   LAYER_WINDOW,
@@ -49,6 +54,9 @@ static struct Host* host;
 static const char* s_rom_filename;
 static const char* s_read_joypad_filename;
 static const char* s_write_joypad_filename;
+static const char* s_read_replay_filename;
+static const char* s_write_replay_filename;
+static u32 s_replay_keyframe;
 static const char* s_save_state_filename;
 static Bool s_running = TRUE;
 static Bool s_step_frame;
@@ -65,9 +73,16 @@ static u32 s_render_scale = 4;
 
 static u32 s_audio_frequency = 44100;
 static u32 s_audio_frames = 2048; /* ~46ms of latency at 44.1kHz */
+static f64 s_audio_latency_ms; /* 0 => pace by video refresh instead. */
+static Bool s_show_latency;
 static u32 s_rewind_frames_per_base_state = 45;
 static u32 s_rewind_buffer_capacity_megabytes = 32;
 static f32 s_rewind_scale = 1.5f;
+static RewindCodec s_rewind_codec = RewindCodec_Rle;
+static RewindTierInit s_rewind_tiers[REWIND_MAX_TIERS];
+static int s_rewind_tier_count; /* Keep every frame in a single ring. */
+static const char* s_link_socket_path;
+static Bool s_rtc_wall_clock;
 
 static Overlay s_overlay;
 static StatusText s_status_text;
@@ -145,15 +160,33 @@ static void set_status_text(const char* fmt, ...) {
   s_status_text.timeout = STATUS_TEXT_TIMEOUT;
 }
 
+static void draw_text_box(int x, int y, RGBA color, const char* s,
+                          size_t len) {
+  fill_rect(x - 1, y - 1, x + len * (GLYPH_WIDTH + 1) + 1, y + GLYPH_HEIGHT + 1,
+            MAKE_RGBA(224, 224, 224, 255));
+  draw_str(x, y, color, s);
+}
+
 static void update_overlay(void) {
+  Bool visible = FALSE;
   clear_overlay();
   if (s_status_text.timeout) {
     --s_status_text.timeout;
-    fill_rect(STATUS_TEXT_X - 1, STATUS_TEXT_Y - 1,
-              STATUS_TEXT_X + s_status_text.len * (GLYPH_WIDTH + 1) + 1,
-              STATUS_TEXT_Y + GLYPH_HEIGHT + 1, MAKE_RGBA(224, 224, 224, 255));
-    draw_str(STATUS_TEXT_X, STATUS_TEXT_Y, STATUS_TEXT_RGBA,
-             s_status_text.data);
+    draw_text_box(STATUS_TEXT_X, STATUS_TEXT_Y, STATUS_TEXT_RGBA,
+                  s_status_text.data, s_status_text.len);
+    visible = TRUE;
+  }
+  if (s_show_latency) {
+    HostLatencyStats stats = host_get_latency_stats(host);
+    char buffer[GLYPHS_PER_LINE + 1];
+    int len = snprintf(buffer, sizeof(buffer), "aud:%.1fms pho:%.1fms q:%.1fms",
+                       stats.input_to_audio_ms, stats.input_to_photon_ms,
+                       stats.audio_queued_ms);
+    draw_text_box(LATENCY_TEXT_X, LATENCY_TEXT_Y, LATENCY_TEXT_RGBA, buffer,
+                  MIN(len, GLYPHS_PER_LINE));
+    visible = TRUE;
+  }
+  if (visible) {
     host_upload_texture(host, s_overlay.texture, SCREEN_WIDTH, SCREEN_HEIGHT,
                         s_overlay.data);
     host_render_screen_overlay(host, s_overlay.texture);
@@ -218,7 +251,10 @@ static void save_state(void) {
 }
 
 static void load_state(void) {
-  if (SUCCESS(emulator_read_state_from_file(e, s_save_state_filename))) {
+  if (host_is_linked(host)) {
+    set_status_text("can't load state while linked");
+  } else if (SUCCESS(emulator_read_state_from_file(e, s_save_state_filename))) {
+    host_note_state_loaded(host);
     set_status_text("loaded state");
   } else {
     set_status_text("unable to load state");
@@ -226,7 +262,9 @@ static void load_state(void) {
 }
 
 static void begin_rewind(void) {
-  if (!s_rewinding) {
+  if (host_is_linked(host)) {
+    set_status_text("can't rewind while linked");
+  } else if (!s_rewinding) {
     host_begin_rewind(host);
     s_rewinding = TRUE;
     s_rewind_start = emulator_get_ticks(e);
@@ -267,8 +305,10 @@ static void rewind_by(Ticks delta) {
 }
 
 static void end_rewind(void) {
-  host_end_rewind(host);
-  s_rewinding = FALSE;
+  if (s_rewinding) {
+    host_end_rewind(host);
+    s_rewinding = FALSE;
+  }
 }
 
 static void key_down(HostHookContext* ctx, HostKeycode code) {
@@ -291,6 +331,7 @@ static void key_down(HostHookContext* ctx, HostKeycode code) {
     case HOST_KEYCODE_BACKSPACE: begin_rewind(); break;
     case HOST_KEYCODE_LEFTBRACKET: inc_palette(-1); break;
     case HOST_KEYCODE_RIGHTBRACKET: inc_palette(1); break;
+    case HOST_KEYCODE_L: s_show_latency ^= 1; break;
     default: break;
   }
 }
@@ -310,6 +351,9 @@ static void usage(int argc, char** argv) {
       "  -h,--help               help\n"
       "  -j,--read-joypad FILE   read joypad input from FILE\n"
       "  -J,--write-joypad FILE  write joypad input to FILE\n"
+      "  -r,--read-replay FILE   play back the replay in FILE\n"
+      "  -R,--write-replay FILE  record a replay to FILE while playing\n"
+      "     --replay-keyframe N  start the replay from keyframe N\n"
       "  -s,--seed SEED          random seed used for initializing RAM\n"
       "  -P,--palette PAL        use a builtin palette for DMG\n"
       "  -x,--scale SCALE        render scale\n"
@@ -317,6 +361,12 @@ static void usage(int argc, char** argv) {
       "                            0: none\n"
       "                            1: Sameboy (Emulate Hardware)\n"
       "                            2: Gambatte/Gameboy Online\n"
+      "  -L,--audio-latency MS   pace emulation by audio, targeting MS of\n"
+      "                          queued audio (0: pace by video refresh);\n"
+      "                          lower audio-frames to match\n"
+      "     --link-socket PATH   connect the link cable to another binjgb over\n"
+      "                          the Unix domain socket at PATH\n"
+      "     --rtc-wall-clock     run the cartridge clock from host time\n"
       "     --force-dmg          force running as a DMG (original gameboy)\n"
       "     --sgb-border         draw the super gameboy border\n",
       argv[0]);
@@ -327,12 +377,18 @@ void parse_arguments(int argc, char** argv) {
     {'h', "help", 0},
     {'j', "read-joypad", 1},
     {'J', "write-joypad", 1},
+    {'r', "read-replay", 1},
+    {'R', "write-replay", 1},
     {'s', "seed", 1},
     {'P', "palette", 1},
     {'x', "scale", 1},
     {'C', "cgb-color", 1},
+    {'L', "audio-latency", 1},
     {0, "force-dmg", 0},
     {0, "sgb-border", 0},
+    {0, "link-socket", 1},
+    {0, "rtc-wall-clock", 0},
+    {0, "replay-keyframe", 1},
   };
 
   struct OptionParser* parser = option_parser_new(
@@ -370,6 +426,14 @@ void parse_arguments(int argc, char** argv) {
             s_write_joypad_filename = result.value;
             break;
 
+          case 'r':
+            s_read_replay_filename = result.value;
+            break;
+
+          case 'R':
+            s_write_replay_filename = result.value;
+            break;
+
           case 's':
             s_random_seed = atoi(result.value);
             break;
@@ -386,11 +450,23 @@ void parse_arguments(int argc, char** argv) {
             s_cgb_color_curve = atoi(result.value);
             break;
 
+          case 'L':
+            s_audio_latency_ms = atof(result.value);
+            break;
+
           default:
             if (strcmp(result.option->long_name, "force-dmg") == 0) {
               s_force_dmg = TRUE;
             } else if (strcmp(result.option->long_name, "sgb-border") == 0) {
               s_use_sgb_border = TRUE;
+            } else if (strcmp(result.option->long_name, "link-socket") == 0) {
+              s_link_socket_path = result.value;
+            } else if (strcmp(result.option->long_name, "rtc-wall-clock") ==
+                       0) {
+              s_rtc_wall_clock = TRUE;
+            } else if (strcmp(result.option->long_name, "replay-keyframe") ==
+                       0) {
+              s_replay_keyframe = atoi(result.value);
             } else {
               abort();
             }
@@ -422,6 +498,33 @@ error:
   exit(1);
 }
 
+/* e.g. "1:40,10:30,60:30": keep every frame in 40% of the buffer, every 10th
+ * frame in 30%, and every 60th in the rest. */
+static Bool parse_rewind_tiers(const char* value) {
+  int count = 0;
+  u32 total_percent = 0;
+  while (*value) {
+    char* end;
+    if (count == REWIND_MAX_TIERS) {
+      return FALSE;
+    }
+    RewindTierInit* tier = &s_rewind_tiers[count++];
+    tier->frames_per_state = strtol(value, &end, 10);
+    if (end == value || *end != ':') {
+      return FALSE;
+    }
+    value = end + 1;
+    tier->capacity_percent = strtoul(value, &end, 10);
+    total_percent += tier->capacity_percent;
+    if (end == value || (*end && *end != ',') || total_percent > 100) {
+      return FALSE;
+    }
+    value = *end ? end + 1 : end;
+  }
+  s_rewind_tier_count = count;
+  return TRUE;
+}
+
 void read_ini_file(void) {
   FILE* file = fopen("binjgb.ini", "r");
   if (!file) {
@@ -456,6 +559,8 @@ void read_ini_file(void) {
       s_audio_frequency = atoi(value);
     } else if (strcmp(buffer, "audio-frames") == 0) {
       s_audio_frames = atoi(value);
+    } else if (strcmp(buffer, "audio-latency-ms") == 0) {
+      s_audio_latency_ms = atof(value);
     } else if (strcmp(buffer, "builtin-palette") == 0) {
       s_builtin_palette = atoi(value);
     } else if (strcmp(buffer, "force-dmg") == 0) {
@@ -466,6 +571,22 @@ void read_ini_file(void) {
       s_rewind_frames_per_base_state = atoi(value);
     } else if (strcmp(buffer, "rewind-buffer-capacity-megabytes") == 0) {
       s_rewind_buffer_capacity_megabytes = atoi(value);
+    } else if (strcmp(buffer, "rewind-codec") == 0) {
+      RewindCodec codec;
+      for (codec = 0; codec < RewindCodec_Count; ++codec) {
+        if (strcmp(value, rewind_get_codec_name(codec)) == 0) {
+          s_rewind_codec = codec;
+          break;
+        }
+      }
+      if (codec == RewindCodec_Count) {
+        fprintf(stderr, "warning: unknown rewind codec: %s\n", value);
+      }
+    } else if (strcmp(buffer, "rewind-tiers") == 0) {
+      if (!parse_rewind_tiers(value)) {
+        fprintf(stderr, "warning: bad rewind tiers: %s\n", value);
+        s_rewind_tier_count = 0;
+      }
     } else if (strcmp(buffer, "rewind-scale") == 0) {
       s_rewind_scale = atof(value);
     } else if (strcmp(buffer, "render-scale") == 0) {
@@ -488,12 +609,13 @@ int main(int argc, char** argv) {
 
   parse_arguments(argc, argv);
 
-  FileData rom;
-  CHECK(SUCCESS(file_read_aligned(s_rom_filename, MINIMUM_ROM_SIZE, &rom)));
+  /* Read, not mapped, so the ROM can be rebuilt while it is running. */
+  EmulatorRom* rom = rom_cache_load(s_rom_filename, FALSE);
+  CHECK(rom != NULL);
 
   EmulatorInit emulator_init;
   ZERO_MEMORY(emulator_init);
-  emulator_init.rom = rom;
+  emulator_init.shared_rom = rom;
   emulator_init.audio_frequency = s_audio_frequency;
   emulator_init.audio_frames = s_audio_frames;
   emulator_init.random_seed = s_random_seed;
@@ -501,8 +623,13 @@ int main(int argc, char** argv) {
   emulator_init.force_dmg = s_force_dmg;
   emulator_init.cgb_color_curve = s_cgb_color_curve;
   e = emulator_new(&emulator_init);
+  emulator_rom_unref(rom);
   CHECK(e != NULL);
 
+  EmulatorConfig emu_config = emulator_get_config(e);
+  emu_config.rtc_wall_clock = s_rtc_wall_clock;
+  emulator_set_config(e, &emu_config);
+
   HostInit host_init;
   ZERO_MEMORY(host_init);
   host_init.hooks.key_down = key_down;
@@ -513,15 +640,26 @@ int main(int argc, char** argv) {
   host_init.audio_volume = s_audio_volume;
   host_init.rewind.frames_per_base_state = s_rewind_frames_per_base_state;
   host_init.rewind.buffer_capacity = s_rewind_buffer_capacity_megabytes * MEGABYTES(1);
+  host_init.rewind.codec = s_rewind_codec;
+  memcpy(host_init.rewind.tiers, s_rewind_tiers, sizeof(s_rewind_tiers));
+  host_init.rewind.tier_count = s_rewind_tier_count;
   host_init.joypad_filename = s_read_joypad_filename;
+  host_init.read_replay_filename = s_read_replay_filename;
+  host_init.replay_keyframe = s_replay_keyframe;
+  host_init.write_replay_filename = s_write_replay_filename;
   host_init.use_sgb_border = s_use_sgb_border;
+  host_init.audio_latency_ms = s_audio_latency_ms;
+  host_init.link_socket_path = s_link_socket_path;
   host = host_new(&host_init, e);
   CHECK(host != NULL);
 
   const char* save_filename = replace_extension(s_rom_filename, SAVE_EXTENSION);
   s_save_state_filename =
       replace_extension(s_rom_filename, SAVE_STATE_EXTENSION);
-  emulator_read_ext_ram_from_file(e, save_filename);
+  /* A replay's keyframes already include the battery-backed RAM. */
+  if (!s_read_replay_filename) {
+    emulator_read_ext_ram_from_file(e, save_filename);
+  }
 
   s_overlay.texture = host_create_texture(host, SCREEN_WIDTH, SCREEN_HEIGHT,
                                           HOST_TEXTURE_FORMAT_RGBA);
@@ -531,7 +669,9 @@ int main(int argc, char** argv) {
     if (s_rewinding) {
       rewind_by((Ticks)(PPU_FRAME_TICKS * s_rewind_scale));
     } else if (!s_paused) {
-      EmulatorEvent event = host_run_ms(host, refresh_ms);
+      EmulatorEvent event = host_is_audio_paced(host)
+                                ? host_run_audio_paced(host, refresh_ms)
+                                : host_run_ms(host, refresh_ms);
       if (event & EMULATOR_EVENT_INVALID_OPCODE) {
         set_status_text("invalid opcode!");
         s_paused = TRUE;
@@ -550,7 +690,7 @@ int main(int argc, char** argv) {
 
   if (s_write_joypad_filename) {
     host_write_joypad_to_file(host, s_write_joypad_filename);
-  } else {
+  } else if (!s_read_replay_filename) {
     emulator_write_ext_ram_to_file(e, save_filename);
   }
 
@@ -37,6 +37,7 @@ extern "C" {
 #define INVALID_TICKS (~0ULL)
 #define ALIGN_UP(x, align) (((x) + (align) - 1) & ~((align) - 1))
 #define ALIGN_DOWN(x, align) ((x) & ~((align) - 1))
+#define DIV_CEIL(numer, denom) (((numer) + (denom) - 1) / (denom))
 #define IS_ALIGNED(x, align) (((x) & ((align) - 1)) == 0)
 
 #define SUCCESS(x) ((x) == OK)
@@ -115,7 +115,8 @@ Debugger::~Debugger() {
 bool Debugger::Init(const char* filename, int audio_frequency, int audio_frames,
                     int font_scale, bool paused_at_start, u32 random_seed,
                     u32 builtin_palette, bool force_dmg, bool use_sgb_border,
-                    CgbColorCurve cgb_color_curve) {
+                    CgbColorCurve cgb_color_curve,
+                    const char* replay_filename, u32 replay_keyframe) {
   FileData rom;
   if (!SUCCESS(file_read_aligned(filename, MINIMUM_ROM_SIZE, &rom))) {
     return false;
@@ -166,6 +167,8 @@ bool Debugger::Init(const char* filename, int audio_frequency, int audio_frames,
   host_init.rewind.frames_per_base_state = 45;
   host_init.rewind.buffer_capacity = MEGABYTES(32);
   host_init.use_sgb_border = use_sgb_border ? TRUE : FALSE;
+  host_init.read_replay_filename = replay_filename;
+  host_init.replay_keyframe = replay_keyframe;
   host = host_new(&host_init, e);
   if (host == nullptr) {
     return false;
@@ -187,7 +190,10 @@ bool Debugger::Init(const char* filename, int audio_frequency, int audio_frames,
 }
 
 void Debugger::Run() {
-  emulator_read_ext_ram_from_file(e, save_filename);
+  /* A replay's keyframes already include the battery-backed RAM. */
+  if (!host_init.read_replay_filename) {
+    emulator_read_ext_ram_from_file(e, save_filename);
+  }
 
   f64 refresh_ms = host_get_monitor_refresh_ms(host);
   while (run_state != Exiting && host_poll_events(host)) {
@@ -291,7 +297,9 @@ void Debugger::Run() {
     host_end_video(host);
   }
 
-  emulator_write_ext_ram_to_file(e, save_filename);
+  if (!host_init.read_replay_filename) {
+    emulator_write_ext_ram_to_file(e, save_filename);
+  }
 }
 
 void Debugger::OnAudioBufferFull() {
@@ -398,7 +406,9 @@ void Debugger::WriteStateToFile() {
 }
 
 void Debugger::ReadStateFromFile() {
-  emulator_read_state_from_file(e, save_state_filename);
+  if (SUCCESS(emulator_read_state_from_file(e, save_state_filename))) {
+    host_note_state_loaded(host);
+  }
 }
 
 void Debugger::SetAudioVolume(f32 volume) {
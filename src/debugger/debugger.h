@@ -33,7 +33,8 @@ class Debugger {
   bool Init(const char* filename, int audio_frequency, int audio_frames,
             int font_scale, bool paused_at_start, u32 random_seed,
             u32 builtin_palette, bool force_dmg, bool use_sgb_border,
-            CgbColorCurve cgb_color_curve);
+            CgbColorCurve cgb_color_curve, const char* replay_filename,
+            u32 replay_keyframe);
   void Run();
 
  private:
@@ -195,6 +196,7 @@ class Debugger {
     void Tick();
 
     FileData reverse_step_save_state;
+    RewindCodec codec = RewindCodec_Rle;
   };
 
   struct ROMWindow : Window {
@@ -121,42 +121,39 @@ void Debugger::DisassemblyWindow::Tick() {
 
     instr_count = 0;
 
-    for (int rom_region = 0; rom_region < 2; ++rom_region) {
-      Address region_addr = rom_region << 14;
-      int bank = emulator_get_rom_bank(d->e, region_addr);
-      u8* rom_usage = emulator_get_rom_usage() + (bank << 14);
-
-      for (Address rel_addr = 0; rel_addr < 0x4000;) {
-        Address addr = region_addr + rel_addr;
-        u8 usage = rom_usage[rel_addr];
-        bool is_data = usage == ROM_USAGE_DATA;
-        int len;
-        if (!is_data) {
-          // Code or unknown usage, disassemble either way.
-          u8 opcode = emulator_read_u8_raw(d->e, addr);
-          len = opcode_bytes(opcode);
-          assert(len <= 3);
-          if (len == 0) {
-            is_data = true;
-          } else if (!(usage & ROM_USAGE_CODE_START)) {
-            // Unknown, disassemble but be careful not to skip over a
-            // ROM_USAGE_CODE_START.
-            for (int i = 1; i < len; ++i) {
-              if (rom_usage[rel_addr + i] & ROM_USAGE_CODE_START) {
-                is_data = true;
-                break;
-              }
+    // Look up each address, since the banks mapped at 0x4000 and 0x6000
+    // needn't be next to each other in the ROM (e.g. MBC6).
+    u8* rom_usage = emulator_get_rom_usage();
+    for (Address addr = 0; addr < 0x8000;) {
+      u8 usage = rom_usage[emulator_get_rom_addr(d->e, addr)];
+      bool is_data = usage == ROM_USAGE_DATA;
+      int len;
+      if (!is_data) {
+        // Code or unknown usage, disassemble either way.
+        u8 opcode = emulator_read_u8_raw(d->e, addr);
+        len = opcode_bytes(opcode);
+        assert(len <= 3);
+        if (len == 0) {
+          is_data = true;
+        } else if (!(usage & ROM_USAGE_CODE_START)) {
+          // Unknown, disassemble but be careful not to skip over a
+          // ROM_USAGE_CODE_START.
+          for (int i = 1; i < len && addr + i < 0x8000; ++i) {
+            if (rom_usage[emulator_get_rom_addr(d->e, addr + i)] &
+                ROM_USAGE_CODE_START) {
+              is_data = true;
+              break;
             }
           }
         }
+      }
 
-        if (is_data) {
-          rel_addr++;
-        } else {
-          assert(instr_count < (int)instrs.size());
-          instrs[instr_count++] = addr;
-          rel_addr += len;
-        }
+      if (is_data) {
+        addr++;
+      } else {
+        assert(instr_count < (int)instrs.size());
+        instrs[instr_count++] = addr;
+        addr += len;
       }
     }
 
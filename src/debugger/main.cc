@@ -21,6 +21,8 @@ static u32 s_builtin_palette;
 static bool s_force_dmg;
 static u32 s_cgb_color_curve;
 static bool s_use_sgb_border;
+static const char* s_replay_filename;
+static u32 s_replay_keyframe;
 
 static void usage(int argc, char** argv) {
   PRINT_ERROR(
@@ -32,12 +34,14 @@ static void usage(int argc, char** argv) {
       "  -p,--pause         pause at start\n"
       "  -s,--seed=SEED     random seed used for initializing RAM\n"
       "  -P,--palette PAL   use a builtin palette for DMG\n"
+      "  -r,--replay FILE   play back the replay in FILE\n"
       "  -C,--cgb-color COLOR    cgb color curve to use\n"
       "                            0: none\n"
       "                            1: Sameboy (Emulate Hardware)\n"
       "                            2: Gambatte/Gameboy Online\n"
       "     --force-dmg     force running as a DMG (original gameboy)\n"
-      "     --sgb-border    draw the super gameboy border\n",
+      "     --sgb-border    draw the super gameboy border\n"
+      "     --replay-keyframe N  start the replay from keyframe N\n",
       argv[0]);
 
   emulator_print_log_systems();
@@ -53,6 +57,8 @@ void parse_arguments(int argc, char** argv) {
     {'s', "seed", 1},
     {'P', "palette", 1},
     {'C', "cgb-color", 1},
+    {0, "replay-keyframe", 1},
+    {'r', "replay", 1},
     {0, "force-dmg", 0},
     {0, "sgb-border", 0},
   };
@@ -127,11 +133,18 @@ void parse_arguments(int argc, char** argv) {
             s_cgb_color_curve = atoi(result.value);
             break;
 
+          case 'r':
+            s_replay_filename = result.value;
+            break;
+
           default:
             if (strcmp(result.option->long_name, "force-dmg") == 0) {
               s_force_dmg = TRUE;
             } else if (strcmp(result.option->long_name, "sgb-border") == 0) {
               s_use_sgb_border = TRUE;
+            } else if (strcmp(result.option->long_name, "replay-keyframe") ==
+                       0) {
+              s_replay_keyframe = atoi(result.value);
             } else {
               abort();
             }
@@ -174,7 +187,8 @@ int main(int argc, char** argv) {
   if (!debugger.Init(s_rom_filename, audio_frequency, audio_frames,
                      s_font_scale, s_paused_at_start, s_random_seed,
                      s_builtin_palette, s_force_dmg, s_use_sgb_border,
-                     static_cast<CgbColorCurve>(s_cgb_color_curve))) {
+                     static_cast<CgbColorCurve>(s_cgb_color_curve),
+                     s_replay_filename, s_replay_keyframe)) {
     return 1;
   }
   debugger.Run();
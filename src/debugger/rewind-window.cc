@@ -16,7 +16,8 @@
 const char Debugger::s_rewind_window_name[] = "Rewind";
 
 Debugger::RewindWindow::RewindWindow(Debugger* d) : Window(d) {
-  emulator_init_state_file_data(&reverse_step_save_state);
+  // Allocated on first use, since its size depends on the emulator.
+  ZERO_MEMORY(reverse_step_save_state);
 }
 
 Debugger::RewindWindow::~RewindWindow() {
@@ -88,6 +89,9 @@ void Debugger::RewindWindow::Tick() {
         // will take, it's easier to just save state, step forward one
         // instruction too far, then load state and step just before it.
         if (reverse_step) {
+          if (!reverse_step_save_state.data) {
+            emulator_init_state_file_data(d->e, &reverse_step_save_state);
+          }
           emulator_write_state(d->e, &reverse_step_save_state);
           int count = 0;
           for (; emulator_get_ticks(d->e) < cur_cy; ++count) {
@@ -127,6 +131,41 @@ void Debugger::RewindWindow::Tick() {
     ImGui::Text("rate: %s/sec %s/min %s/hr", d->PrettySize(total / sec).c_str(),
                 d->PrettySize(total / sec * 60).c_str(),
                 d->PrettySize(total / sec * 60 * 60).c_str());
+    if (rw_stats.tier_count > 1) {
+      for (int i = 0; i < rw_stats.tier_count; ++i) {
+        const RewindTierStats& ts = rw_stats.tiers[i];
+        f64 tier_sec = ts.oldest_ticks == INVALID_TICKS
+                           ? 0
+                           : (f64)(ts.newest_ticks - ts.oldest_ticks) /
+                                 CPU_TICKS_PER_SECOND;
+        ImGui::Text("tier %d (every %d): %.0f sec, %zu states, %s/%s", i,
+                    ts.frames_per_state, tier_sec, ts.state_count,
+                    d->PrettySize(ts.used_bytes).c_str(),
+                    d->PrettySize(ts.capacity_bytes).c_str());
+      }
+    }
+
+    const char* codec_names[RewindCodec_Count];
+    for (int i = 0; i < RewindCodec_Count; ++i) {
+      codec_names[i] = rewind_get_codec_name(static_cast<RewindCodec>(i));
+    }
+    if (ImGui::Combo("Codec", &codec, codec_names)) {
+      host_set_rewind_codec(d->host, codec);
+    }
+    // Only counts states written (or read) with each codec, so switch codecs
+    // for a while to compare them on the same game.
+    for (int i = 0; i < RewindCodec_Count; ++i) {
+      const RewindCodecStats& cs = rw_stats.codecs[i];
+      if (cs.encoded_frames == 0) {
+        continue;
+      }
+      f64 decode_ns =
+          cs.decoded_frames ? (f64)cs.decode_ns / cs.decoded_frames : 0;
+      ImGui::Text("%s: %.2f%% encode %.0f ns/frame decode %.0f ns/frame",
+                  codec_names[i],
+                  (f64)cs.compressed_bytes * 100 / cs.uncompressed_bytes,
+                  (f64)cs.encode_ns / cs.encoded_frames, decode_ns);
+    }
 
     Ticks oldest = host_get_rewind_oldest_ticks(d->host);
     Ticks newest = host_get_rewind_newest_ticks(d->host);
@@ -80,6 +80,7 @@ void emulator_set_bw_palette_simple(Emulator* e, u32 type, u32 white,
 RewindBuffer* rewind_new_simple(Emulator* e, int frames_per_base_state,
                                 size_t buffer_capacity) {
   RewindInit init;
+  ZERO_MEMORY(init);
   init.frames_per_base_state = frames_per_base_state;
   init.buffer_capacity = buffer_capacity;
   return rewind_new(&init, e);
@@ -337,6 +337,16 @@ static int disassemble_instr(u8 data[3], char* buffer, size_t size) {
   return num_bytes;
 }
 
+/* MBC6 switches 0x4000-0x5fff and 0x6000-0x7fff separately, so its banks are
+ * 8K. */
+static int get_rom_bank_shift(Emulator* e) {
+  return s_cart_type_info[e->cart_info->cart_type].mbc_type == MBC_TYPE_MBC6
+             ? ROM_REGION_SHIFT
+             : ROM_BANK_SHIFT;
+}
+
+static u32 get_rom_addr(Emulator* e, Address addr);
+
 int emulator_disassemble(Emulator* e, Address addr, char* buffer, size_t size) {
   char instr[120];
   char hex[][3] = {"  ", "  ", "  "};
@@ -346,10 +356,8 @@ int emulator_disassemble(Emulator* e, Address addr, char* buffer, size_t size) {
   int num_bytes = disassemble_instr(data, instr, sizeof(instr));
 
   char bank[3] = "??";
-  if (addr < 0x4000) {
-    sprint_hex(bank, e->state.memory_map_state.rom_base[0] >> ROM_BANK_SHIFT);
-  } else if (addr < 0x8000) {
-    sprint_hex(bank, e->state.memory_map_state.rom_base[1] >> ROM_BANK_SHIFT);
+  if (addr < 0x8000) {
+    sprint_hex(bank, emulator_get_rom_bank(e, addr));
   }
 
   snprintf(buffer, size, "[%s]%#06x: %s", bank, addr, instr);
@@ -368,10 +376,11 @@ void emulator_disassemble_rom(Emulator* e, u32 rom_addr, char* buffer,
   u8* rom = e->cart_info->data;
   u8 data[3] = {rom[rom_addr], rom[rom_addr + 1], rom[rom_addr + 2]};
   disassemble_instr(data, instr, sizeof(instr));
-  int bank = rom_addr >> ROM_BANK_SHIFT;
-  Address addr = rom_addr & 0x3fff;
-  if (bank > 0) {
-    addr += 0x4000;
+  int shift = get_rom_bank_shift(e);
+  int bank = rom_addr >> shift;
+  Address addr = rom_addr;
+  if (rom_addr >= 0x4000) {
+    addr = 0x4000 + (rom_addr & ((1 << shift) - 1));
   }
   snprintf(buffer, size, "[%02x]%#06x: %s", bank, addr, instr);
 }
@@ -484,14 +493,19 @@ void emulator_remove_breakpoint(int id) {
 }
 
 int emulator_get_rom_bank(Emulator* e, Address addr) {
-  int region = addr >> ROM_BANK_SHIFT;
-  if (region < 2) {
-    return MMAP_STATE.rom_base[region] >> ROM_BANK_SHIFT;
+  if (addr < 0x8000) {
+    return MMAP_STATE.rom_base[addr >> ROM_REGION_SHIFT] >>
+           get_rom_bank_shift(e);
   } else {
     return -1;
   }
 }
 
+u32 emulator_get_rom_addr(Emulator* e, Address addr) {
+  assert(addr < 0x8000);
+  return get_rom_addr(e, addr);
+}
+
 u8 emulator_read_u8_raw(Emulator* e, Address addr) {
   return read_u8_raw(e, addr);
 }
@@ -538,10 +552,9 @@ void HOOK_read_rom_ib(Emulator* e, const char* func_name, u32 rom_addr,
 #define INVALID_ROM_ADDR (~0u)
 
 static u32 get_rom_addr(Emulator* e, Address addr) {
-  if (addr < 0x4000) {
-    return e->state.memory_map_state.rom_base[0] | (addr & 0x3fff);
-  } else if (addr < 0x8000) {
-    return e->state.memory_map_state.rom_base[1] | (addr & 0x3fff);
+  if (addr < 0x8000) {
+    return e->state.memory_map_state.rom_base[addr >> ROM_REGION_SHIFT] |
+           (addr & ADDR_MASK_8K);
   } else {
     return INVALID_ROM_ADDR;
   }
@@ -746,7 +759,6 @@ void emulator_print_log_systems(void) {
   }
 }
 
-Bool emulator_is_cgb(Emulator* e) { return e->state.is_cgb; }
 Bool emulator_is_sgb(Emulator* e) { return e->state.is_sgb; }
 
 int emulator_get_rom_size(Emulator* e) {
@@ -101,7 +101,6 @@ const char* emulator_get_log_system_name(LogSystem);
 LogLevel emulator_get_log_level(LogSystem);
 void emulator_print_log_systems();
 
-Bool emulator_is_cgb(Emulator*);
 Bool emulator_is_sgb(Emulator*);
 
 int emulator_get_rom_size(Emulator*);
@@ -134,7 +133,10 @@ void emulator_set_breakpoint_address(Emulator*, int id, Address);
 void emulator_enable_breakpoint(int id, Bool enabled);
 void emulator_remove_breakpoint(int id);
 
+/* In the mapper's bank size: 16K, or 8K for MBC6. */
 int emulator_get_rom_bank(Emulator*, Address);
+/* The offset into the ROM that |addr| (below 0x8000) is mapped to. */
+u32 emulator_get_rom_addr(Emulator*, Address);
 
 u8 emulator_read_u8_raw(Emulator*, Address);
 void emulator_write_u8_raw(Emulator*, Address, u8);
@@ -5,9 +5,11 @@
  * of the MIT license.  See the LICENSE file for details.
  */
 #include <assert.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #if RGBDS_LIVE
 #include <emscripten.h>
 #endif
@@ -18,8 +20,12 @@
 #define VIDEO_RAM_SIZE KILOBYTES(16)
 #define WORK_RAM_SIZE KILOBYTES(32)
 #define EXT_RAM_MAX_SIZE KILOBYTES(128)
+#define ROM_REGION_COUNT 4 /* 8K regions, 0000-7fff. */
+#define HUC3_RTC_MEM_SIZE 256
+#define CAMERA_REG_COUNT 0x36
 #define WAVE_RAM_SIZE 16
 #define HIGH_RAM_SIZE 127
+#define TEST_SERIAL_TEXT_SIZE 6 /* strlen("Passed") */
 
 #define OBJ_PER_LINE_COUNT 10
 
@@ -109,8 +115,9 @@
   V(CART_TYPE_MMM01, 0xb, MMM01, NO_RAM, NO_BATTERY, NO_TIMER)                 \
   V(CART_TYPE_MMM01_RAM, 0xc, MMM01, WITH_RAM, NO_BATTERY, NO_TIMER)           \
   V(CART_TYPE_MMM01_RAM_BATTERY, 0xd, MMM01, WITH_RAM, WITH_BATTERY, NO_TIMER) \
-  V(CART_TYPE_MBC3_TIMER_BATTERY, 0xf, MBC3, NO_RAM, WITH_BATTERY, WITH_TIMER) \
-  V(CART_TYPE_MBC3_TIMER_RAM_BATTERY, 0x10, MBC3, WITH_RAM, WITH_BATTERY,      \
+  V(CART_TYPE_MBC3_TIMER_BATTERY, 0xf, MBC3_RTC, NO_RAM, WITH_BATTERY,         \
+    WITH_TIMER)                                                                \
+  V(CART_TYPE_MBC3_TIMER_RAM_BATTERY, 0x10, MBC3_RTC, WITH_RAM, WITH_BATTERY,  \
     WITH_TIMER)                                                                \
   V(CART_TYPE_MBC3, 0x11, MBC3, NO_RAM, NO_BATTERY, NO_TIMER)                  \
   V(CART_TYPE_MBC3_RAM, 0x12, MBC3, WITH_RAM, NO_BATTERY, NO_TIMER)            \
@@ -118,13 +125,18 @@
   V(CART_TYPE_MBC5, 0x19, MBC5, NO_RAM, NO_BATTERY, NO_TIMER)                  \
   V(CART_TYPE_MBC5_RAM, 0x1a, MBC5, WITH_RAM, NO_BATTERY, NO_TIMER)            \
   V(CART_TYPE_MBC5_RAM_BATTERY, 0x1b, MBC5, WITH_RAM, WITH_BATTERY, NO_TIMER)  \
-  V(CART_TYPE_MBC5_RUMBLE, 0x1c, MBC5, NO_RAM, NO_BATTERY, NO_TIMER)           \
-  V(CART_TYPE_MBC5_RUMBLE_RAM, 0x1d, MBC5, WITH_RAM, NO_BATTERY, NO_TIMER)     \
-  V(CART_TYPE_MBC5_RUMBLE_RAM_BATTERY, 0x1e, MBC5, WITH_RAM, WITH_BATTERY,     \
+  V(CART_TYPE_MBC5_RUMBLE, 0x1c, MBC5_RUMBLE, NO_RAM, NO_BATTERY, NO_TIMER)    \
+  V(CART_TYPE_MBC5_RUMBLE_RAM, 0x1d, MBC5_RUMBLE, WITH_RAM, NO_BATTERY,        \
+    NO_TIMER)                                                                  \
+  V(CART_TYPE_MBC5_RUMBLE_RAM_BATTERY, 0x1e, MBC5_RUMBLE, WITH_RAM,            \
+    WITH_BATTERY, NO_TIMER)                                                    \
+  V(CART_TYPE_MBC6, 0x20, MBC6, WITH_RAM, WITH_BATTERY, NO_TIMER)              \
+  V(CART_TYPE_MBC7_SENSOR_RUMBLE_RAM_BATTERY, 0x22, MBC7, NO_RAM,              \
+    WITH_BATTERY, NO_TIMER)                                                    \
+  V(CART_TYPE_POCKET_CAMERA, 0xfc, POCKET_CAMERA, WITH_RAM, WITH_BATTERY,      \
     NO_TIMER)                                                                  \
-  V(CART_TYPE_POCKET_CAMERA, 0xfc, NO_MBC, NO_RAM, NO_BATTERY, NO_TIMER)       \
   V(CART_TYPE_BANDAI_TAMA5, 0xfd, TAMA5, NO_RAM, NO_BATTERY, NO_TIMER)         \
-  V(CART_TYPE_HUC3, 0xfe, HUC3, NO_RAM, NO_BATTERY, NO_TIMER)                  \
+  V(CART_TYPE_HUC3, 0xfe, HUC3, WITH_RAM, WITH_BATTERY, NO_TIMER)              \
   V(CART_TYPE_HUC1_RAM_BATTERY, 0xff, HUC1, WITH_RAM, WITH_BATTERY, NO_TIMER)
 
 #define FOREACH_ROM_SIZE(V) \
@@ -204,13 +216,20 @@ DEFINE_NAMED_ENUM(PPU_STATE, PPUState, ppu_state, FOREACH_PPU_STATE,
 typedef enum {
   MBC_TYPE_NO_MBC,
   MBC_TYPE_MBC1,
+  MBC_TYPE_MBC1M, /* MBC1 multicart; not in the header, see init_memory_map. */
   MBC_TYPE_MBC2,
   MBC_TYPE_MBC3,
+  MBC_TYPE_MBC3_RTC,
   MBC_TYPE_MBC5,
+  MBC_TYPE_MBC5_RUMBLE,
+  MBC_TYPE_MBC6,
+  MBC_TYPE_MBC7,
   MBC_TYPE_MMM01,
   MBC_TYPE_TAMA5,
   MBC_TYPE_HUC3,
   MBC_TYPE_HUC1,
+  MBC_TYPE_POCKET_CAMERA,
+  MBC_TYPE_COUNT,
 } MbcType;
 
 typedef enum {
@@ -371,6 +390,15 @@ typedef struct {
   ExtRamSize ext_ram_size;
 } CartInfo;
 
+struct EmulatorRom {
+  FileData file_data;
+  EmulatorRomFreeCallback free_data; /* NULL: use file_data_delete. */
+  u32 ref_count;
+  CartInfo cart_infos[MAX_CART_INFOS];
+  u32 cart_info_count;
+  u32 cart_info_index; /* The cart to start with. */
+};
+
 typedef struct {
   u8 byte_2000_3fff;
   u8 byte_4000_5fff;
@@ -385,21 +413,76 @@ typedef struct {
   u8 rtc_reg;
   Bool rtc_halt;
   Bool latched;
+  Bool wall_clock; /* latch_ticks is host time, not emulated ticks. */
 } Mbc3;
 
 typedef struct {
   u8 byte_2000_2fff;
   u8 byte_3000_3fff;
+  Bool rumble;
 } Mbc5;
 
+typedef struct {
+  u8 ram_bank[2]; /* 4K banks at a000-afff and b000-bfff. */
+} Mbc6;
+
+typedef enum {
+  MBC7_EEPROM_IDLE,
+  MBC7_EEPROM_COMMAND,
+  MBC7_EEPROM_READ,
+  MBC7_EEPROM_WRITE,
+  MBC7_EEPROM_WRITE_ALL,
+} Mbc7EepromState;
+
+typedef struct {
+  Bool ram_enabled2; /* Both this and ext_ram_enabled must be set. */
+  Bool accel_erased; /* Must be erased before it can be latched again. */
+  u16 accel_x, accel_y;
+  u8 eeprom_pins; /* CS, CLK, DI and DO, in their MBC7_EEPROM_* bits. */
+  Mbc7EepromState eeprom_state;
+  u8 eeprom_bits; /* Bits shifted in or out in this state. */
+  u16 eeprom_shift;
+  u8 eeprom_addr; /* Word address. */
+  Bool eeprom_write_enabled;
+} Mbc7;
+
+typedef struct {
+  u8 mode;
+  u8 command;  /* Written in mode 0xb, run when the semaphore is cleared. */
+  u8 response; /* Read in mode 0xc. */
+  u8 rtc_addr;
+  u8 rtc_mem[HUC3_RTC_MEM_SIZE]; /* One nibble per byte. */
+  u16 minutes, days; /* Time at latch_ticks. */
+  Ticks latch_ticks;
+} Huc3;
+
+typedef struct {
+  u8 regs[CAMERA_REG_COUNT];
+  Bool regs_mapped; /* a000-bfff maps the registers instead of RAM. */
+  Ticks capture_ticks; /* When the capture in progress finishes. */
+} PocketCamera;
+
 typedef struct {
   u8 (*read_ext_ram)(Emulator*, MaskedAddress);
   void (*write_rom)(Emulator*, MaskedAddress, u8);
   void (*write_ext_ram)(Emulator*, MaskedAddress, u8);
 } MemoryMap;
 
+/* Each MbcType has a Mapper in s_mappers. Its state lives in the
+ * MemoryMapState union, so it is saved along with the rest of the state. */
+typedef struct {
+  void (*write_rom)(Emulator*, MaskedAddress, u8); /* NULL: not implemented. */
+  /* NULL to use the default for the cart's ExtRamType. */
+  u8 (*read_ext_ram)(Emulator*, MaskedAddress);
+  void (*write_ext_ram)(Emulator*, MaskedAddress, u8);
+  /* Size of RAM built into the mapper, instead of the header's ext RAM. */
+  u32 ext_ram_size;
+  /* Initializes the mapper's MemoryMapState at power on; may be NULL. */
+  void (*reset)(Emulator*);
+} Mapper;
+
 typedef struct {
-  u32 rom_base[2];
+  u32 rom_base[ROM_REGION_COUNT];
   u32 ext_ram_base;
   Bool ext_ram_enabled;
   union {
@@ -408,6 +491,10 @@ typedef struct {
     Mbc3 mbc3;
     Huc1 huc1;
     Mbc5 mbc5;
+    Mbc6 mbc6;
+    Mbc7 mbc7;
+    Huc3 huc3;
+    PocketCamera camera;
   };
 } MemoryMapState;
 
@@ -460,7 +547,6 @@ typedef struct {
 
 typedef struct {
   Ticks sync_ticks;        /* Current synchronization ticks. */
-  Ticks next_intr_ticks;   /* Tick when the next timer intr will occur. */
   TimerClock clock_select; /* Select the rate of TIMA */
   TimaState tima_state;    /* Used to implement TIMA overflow delay. */
   u16 div_counter; /* Internal clock counter, upper 8 bits are DIV. */
@@ -471,12 +557,14 @@ typedef struct {
 
 typedef struct {
   Ticks sync_ticks;       /* Current synchronization ticks. */
-  Ticks tick_count;       /* 0..SERIAL_TICKS */
-  Ticks next_intr_ticks;  /* Tick when the next intr will occur. */
+  Ticks tick_count;       /* 0..get_serial_bit_ticks() */
   SerialClock clock;
   Bool transferring;
   u8 sb; /* Serial transfer data. */
   u8 transferred_bits;
+  u8 in_byte;          /* Shifted in by an internal clock transfer. */
+  u8 receive_byte;     /* Shifted in by the other end of the link... */
+  Ticks receive_ticks; /* ...at this tick, or INVALID_TICKS. */
 } Serial;
 
 typedef struct {
@@ -600,7 +688,6 @@ typedef struct {
 
 typedef struct {
   Ticks sync_ticks;                 /* Current synchronization tick. */
-  Ticks next_intr_ticks;            /* Tick when the next intr will occur. */
   Lcdc lcdc;                        /* LCD control */
   Stat stat;                        /* LCD status */
   u8 scy;                           /* Screen Y */
@@ -660,8 +747,25 @@ typedef struct {
   u8 block_bytes;
 } Hdma;
 
+typedef enum {
+  SCHEDULER_EVENT_TIMER,  /* TIMA overflow. */
+  SCHEDULER_EVENT_SERIAL, /* Serial transfer complete. */
+  SCHEDULER_EVENT_PPU,    /* PPU state transition. */
+  SCHEDULER_EVENT_DMA,    /* OAM DMA complete. */
+  SCHEDULER_EVENT_APU,    /* APU frame sequencer step. */
+  SCHEDULER_EVENT_COUNT,
+} SchedulerEvent;
+
+/* Every event is always in the heap; unscheduled events use INVALID_TICKS so
+ * they sort last. */
+typedef struct {
+  Ticks ticks[SCHEDULER_EVENT_COUNT]; /* Tick when each event will occur. */
+  u8 heap[SCHEDULER_EVENT_COUNT];     /* Min-heap of events, keyed by ticks. */
+  u8 heap_index[SCHEDULER_EVENT_COUNT]; /* Position of each event in heap. */
+  Ticks next_ticks;                     /* Same as ticks[heap[0]]. */
+} Scheduler;
+
 typedef struct {
-  u32 header; /* Set to SAVE_STATE_HEADER; makes it easier to save state. */
   u32 random_seed;
   u8 cart_info_index;
   MemoryMapState memory_map_state;
@@ -684,20 +788,131 @@ typedef struct {
   u8 hram[HIGH_RAM_SIZE];
   Ticks ticks;
   Ticks cpu_tick;
-  Ticks next_intr_ticks; /* For Timer, Serial, or PPU interrupts. */
+  Scheduler scheduler;
   Bool is_cgb;
   Bool is_sgb;
   Bool ext_ram_updated;
   EmulatorEvent event;
 } EmulatorState;
 
+typedef struct {
+  ApuEvent events[APU_EVENT_CHUNK_SIZE];
+  size_t count;
+  ApuEventCallback callback;
+  void* user_data;
+} ApuEventLog;
+
+#define LFSR_15_PERIOD 32767
+#define LFSR_7_PERIOD 127
+/* Spans shorter than this many square/noise periods are stepped directly;
+ * longer ones are summed with the duty masks and LFSR tables. */
+#define APU_SPAN_MIN_STEPS 8
+
+/* The sequence of LFSR states for one width, starting from all ones. */
+typedef struct {
+  u32 period;
+  u16* state;
+  u16* index; /* Inverse of state, i.e. state[index[x]] == x. */
+  u16* ones;  /* ones[i] is the number of states in state[0..i) with sample 1. */
+} LfsrTable;
+
+static u16 s_lfsr15_state[LFSR_15_PERIOD];
+static u16 s_lfsr15_index[LFSR_15_PERIOD + 1];
+static u16 s_lfsr15_ones[LFSR_15_PERIOD + 1];
+static u16 s_lfsr7_state[LFSR_7_PERIOD];
+static u16 s_lfsr7_index[LFSR_7_PERIOD + 1];
+static u16 s_lfsr7_ones[LFSR_7_PERIOD + 1];
+static LfsrTable s_lfsr_table[] = {
+    [LFSR_WIDTH_15] = {LFSR_15_PERIOD, s_lfsr15_state, s_lfsr15_index,
+                       s_lfsr15_ones},
+    [LFSR_WIDTH_7] = {LFSR_7_PERIOD, s_lfsr7_state, s_lfsr7_index,
+                      s_lfsr7_ones},
+};
+
 const size_t s_emulator_state_size = sizeof(EmulatorState);
 
+/* A save state is a header (magic, version, flags) followed by sections, each
+ * a tag, a size and then the bytes of one EmulatorState member. Fields may be
+ * appended to a member's struct without breaking old states, since a section
+ * that is shorter than its member is zero-extended; unknown sections are
+ * skipped. Ext RAM is saved only up to the cart's RAM size. */
+#define STATE_TAG(a, b, c, d) \
+  ((u32)(a) | ((u32)(b) << 8) | ((u32)(c) << 16) | ((u32)(d) << 24))
+#define STATE_MEMBER_SIZE(member) sizeof(((EmulatorState*)0)->member)
+
+#define FOREACH_STATE_SECTION(V)                     \
+  V(CART, cart_info_index, 'C', 'A', 'R', 'T')       \
+  V(SEED, random_seed, 'S', 'E', 'E', 'D')           \
+  V(MMAP, memory_map_state, 'M', 'M', 'A', 'P')      \
+  V(REGS, reg, 'R', 'E', 'G', 'S')                   \
+  V(VRAM, vram, 'V', 'R', 'A', 'M')                  \
+  V(XRAM, ext_ram.data, 'X', 'R', 'A', 'M')          \
+  V(WRAM, wram, 'W', 'R', 'A', 'M')                  \
+  V(INTR, interrupt, 'I', 'N', 'T', 'R')             \
+  V(OAM, oam, 'O', 'A', 'M', ' ')                    \
+  V(JOYP, joyp, 'J', 'O', 'Y', 'P')                  \
+  V(SGB, sgb, 'S', 'G', 'B', ' ')                    \
+  V(SERIAL, serial, 'S', 'E', 'R', 'L')              \
+  V(INFRARED, infrared, 'I', 'R', 'D', 'A')          \
+  V(TIMER, timer, 'T', 'I', 'M', 'R')                \
+  V(APU, apu, 'A', 'P', 'U', ' ')                    \
+  V(PPU, ppu, 'P', 'P', 'U', ' ')                    \
+  V(DMA, dma, 'D', 'M', 'A', ' ')                    \
+  V(HDMA, hdma, 'H', 'D', 'M', 'A')                  \
+  V(CPU_SPEED, cpu_speed, 'S', 'P', 'E', 'D')        \
+  V(HRAM, hram, 'H', 'R', 'A', 'M')                  \
+  V(TICKS, ticks, 'T', 'I', 'C', 'K')                \
+  V(CPU_TICK, cpu_tick, 'C', 'T', 'I', 'K')          \
+  V(SCHEDULER, scheduler, 'S', 'C', 'H', 'D')        \
+  V(IS_CGB, is_cgb, 'I', 'C', 'G', 'B')              \
+  V(IS_SGB, is_sgb, 'I', 'S', 'G', 'B')              \
+  V(EXT_RAM_UPDATED, ext_ram_updated, 'X', 'U', 'P', 'D') \
+  V(EVENT, event, 'E', 'V', 'N', 'T')
+
+typedef enum {
+#define V(name, member, a, b, c, d) STATE_SECTION_##name,
+  FOREACH_STATE_SECTION(V)
+#undef V
+  STATE_SECTION_COUNT, /* At most 32, so a u32 can hold a set of them. */
+} StateSection;
+
+#define STATE_SECTIONS_ALL ((u32)((1ull << STATE_SECTION_COUNT) - 1))
+/* Only these sections are marked dirty when written; the rest are small and
+ * change nearly every frame, so they are always considered dirty. */
+#define STATE_SECTIONS_TRACKED                                             \
+  ((1u << STATE_SECTION_VRAM) | (1u << STATE_SECTION_XRAM) |               \
+   (1u << STATE_SECTION_WRAM) | (1u << STATE_SECTION_OAM) |                \
+   (1u << STATE_SECTION_SGB) | (1u << STATE_SECTION_HRAM))
+
+/* VRAM, WRAM and ext RAM data are also tracked in pages, so rewind only has
+ * to copy the pages that were written. */
+#define STATE_PAGE_SHIFT 8
+#define STATE_PAGE_SIZE (1 << STATE_PAGE_SHIFT)
+#define STATE_VRAM_FIRST_PAGE 0
+#define STATE_WRAM_FIRST_PAGE \
+  (STATE_VRAM_FIRST_PAGE + (VIDEO_RAM_SIZE >> STATE_PAGE_SHIFT))
+#define STATE_XRAM_FIRST_PAGE \
+  (STATE_WRAM_FIRST_PAGE + (WORK_RAM_SIZE >> STATE_PAGE_SHIFT))
+#define STATE_PAGE_COUNT \
+  (STATE_XRAM_FIRST_PAGE + (EXT_RAM_MAX_SIZE >> STATE_PAGE_SHIFT))
+
+typedef struct {
+  u32 tag;
+  size_t offset;
+  size_t size;
+} StateSectionInfo;
+
+static const StateSectionInfo s_state_sections[] = {
+#define V(name, member, a, b, c, d) \
+  {STATE_TAG(a, b, c, d), offsetof(EmulatorState, member), \
+   STATE_MEMBER_SIZE(member)},
+    FOREACH_STATE_SECTION(V)
+#undef V
+};
+
 struct Emulator {
   EmulatorConfig config;
-  FileData file_data;
-  CartInfo cart_infos[MAX_CART_INFOS];
-  u32 cart_info_count;
+  EmulatorRom* rom;
   CartInfo* cart_info; /* Cached for convenience. */
   MemoryMap memory_map;
   EmulatorState state;
@@ -705,6 +920,12 @@ struct Emulator {
   SgbFrameBuffer sgb_frame_buffer;
   AudioBuffer audio_buffer;
   JoypadCallbackInfo joypad_info;
+  SerialCallbackInfo serial_info;
+  SensorCallbackInfo sensor_info;
+  CameraCallbackInfo camera_info;
+  TestResult test_result;
+  char test_serial_text[TEST_SERIAL_TEXT_SIZE]; /* Last bytes sent. */
+  Bool test_ext_ram_running; /* Saw a test's "running" status in ext RAM. */
   /* color_to_rgba stores mappings from 4 DMG colors to RGBA colors. pal is a
    * cached copy of the current DMG palette (e.g. could be all COLOR_WHITE). */
   PaletteRGBA color_to_rgba[PALETTE_TYPE_COUNT];
@@ -712,6 +933,15 @@ struct Emulator {
   PaletteRGBA sgb_pal[4];
   CgbColorCurve cgb_color_curve;
   ApuLog apu_log;
+  ApuEventLog apu_event_log;
+  u32 dirty_state_sections; /* Tracked sections written since last cleared. */
+  u32 dirty_state_pages[STATE_PAGE_COUNT / 32];
+  /* Tracked sections and pages whose cached hash is out of date; the dirty
+   * bits above are added in whenever they are cleared. */
+  u32 hash_stale_sections;
+  u32 hash_stale_pages[STATE_PAGE_COUNT / 32];
+  u64 section_hashes[STATE_SECTION_COUNT];
+  u64 page_hashes[STATE_PAGE_COUNT];
 #ifdef RGBDS_LIVE
   Bool breakpoint[0x10000];
 #endif
@@ -743,6 +973,7 @@ struct Emulator {
 #define OAM (e->state.oam)
 #define PPU (e->state.ppu)
 #define REG (e->state.reg)
+#define SCHEDULER (e->state.scheduler)
 #define SERIAL (e->state.serial)
 #define STAT (PPU.stat)
 #define SWEEP (APU.sweep)
@@ -752,12 +983,20 @@ struct Emulator {
 #define WRAM (e->state.wram)
 
 
-#define DIV_CEIL(numer, denom) (((numer) + (denom) - 1) / (denom))
 #define VALUE_WRAPPED(X, MAX) \
   (UNLIKELY((X) >= (MAX) ? ((X) -= (MAX), TRUE) : FALSE))
 
-#define SAVE_STATE_VERSION (2)
-#define SAVE_STATE_HEADER (u32)(0x6b57a7e0 + SAVE_STATE_VERSION)
+#define MARK_STATE_DIRTY(name) \
+  (e->dirty_state_sections |= 1u << STATE_SECTION_##name)
+/* Only for VRAM, WRAM and XRAM; |offset| is into the section's data. */
+#define MARK_STATE_BYTES_DIRTY(name, offset, size)                \
+  mark_state_pages_dirty(e, STATE_SECTION_##name,               \
+                         STATE_##name##_FIRST_PAGE, (offset), (size))
+
+#define SAVE_STATE_VERSION (7)
+#define SAVE_STATE_MAGIC 0x74736a62 /* "bjst" */
+#define SAVE_STATE_HEADER_SIZE 12
+#define SAVE_STATE_SECTION_HEADER_SIZE 8
 
 #ifndef HOOK0
 #define HOOK0(name)
@@ -811,6 +1050,50 @@ struct Emulator {
 #define HUC1_ROM_BANK_LO_SELECT_MASK 0x3f
 #define HUC1_BANK_HI_SELECT_MASK 0x3
 #define HUC1_BANK_HI_SHIFT 6
+#define MBC5_RUMBLE_RAM_BANK_SELECT_MASK 0x7
+#define MBC6_ROM_BANK_SELECT_MASK 0x7f
+#define MBC6_RAM_BANK_SELECT_MASK 0x7
+#define MBC7_ROM_BANK_SELECT_MASK 0x7f
+#define MBC7_RAM_ENABLED2_VALUE 0x40
+#define MBC7_ACCEL_ERASE_VALUE 0x55
+#define MBC7_ACCEL_LATCH_VALUE 0xaa
+#define MBC7_ACCEL_ERASED 0x8000
+#define MBC7_ACCEL_CENTER 0x81d0
+#define MBC7_ACCEL_PER_G 0x70
+/* 93LC56 EEPROM, 128 16-bit words. */
+#define MBC7_EEPROM_SIZE 256
+#define MBC7_EEPROM_WORD_MASK 0x7f
+#define MBC7_EEPROM_COMMAND_BITS 10 /* 2-bit opcode, 8-bit address. */
+#define HUC3_ROM_BANK_SELECT_MASK 0x7f
+#define HUC3_RAM_BANK_SELECT_MASK 0x3
+#define HUC3_MODE_MASK 0xf
+#define HUC3_MODE_RAM_READ 0x0
+#define HUC3_MODE_RAM 0xa
+#define HUC3_MODE_COMMAND 0xb
+#define HUC3_MODE_RESPONSE 0xc
+#define HUC3_MODE_SEMAPHORE 0xd
+#define HUC3_MODE_IR 0xe
+#define HUC3_COMMAND_READ 0x1
+#define HUC3_COMMAND_WRITE 0x3
+#define HUC3_COMMAND_ADDR_LO 0x4
+#define HUC3_COMMAND_ADDR_HI 0x5
+#define HUC3_COMMAND_EXTENDED 0x6
+#define HUC3_EXTENDED_GET_TIME 0x0
+#define HUC3_EXTENDED_SET_TIME 0x1
+#define HUC3_EXTENDED_STATUS 0x2
+#define HUC3_IR_NO_LIGHT 0xc0
+#define HUC3_MINUTES_PER_DAY (24 * 60)
+#define HUC3_MINUTE_TICKS ((Ticks)CPU_TICKS_PER_SECOND * 60)
+#define HUC3_DAY_MASK 0xfff
+#define CAMERA_ROM_BANK_SELECT_MASK 0x3f
+#define CAMERA_RAM_BANK_SELECT_MASK 0xf
+#define CAMERA_REG_ADDR_MASK 0x7f
+#define CAMERA_DITHER_REG 0x6 /* 4x4 matrix of 3 thresholds each. */
+#define CAMERA_IMAGE_ADDR 0x100 /* In RAM bank 0, as 16x14 tiles. */
+#define CAMERA_CAPTURE_REG_MASK 0x7
+/* Approximate; the real time also depends on the sensor's edge settings. */
+#define CAMERA_CAPTURE_TICKS 129792
+#define CAMERA_EXPOSURE_TICKS 64
 
 #define OAM_START_ADDR 0xfe00
 #define OAM_END_ADDR 0xfe9f
@@ -824,6 +1107,7 @@ struct Emulator {
 
 #define CART_INFO_SHIFT 15
 #define ROM_BANK_SHIFT 14
+#define ROM_REGION_SHIFT 13
 #define EXT_RAM_BANK_SHIFT 13
 
 /* Tick counts */
@@ -1000,6 +1284,15 @@ struct Emulator {
 #define MBC3_RTC_DAY_CARRY(X) BIT(X, 7)
 #define MBC3_RTC_HALT(X) BIT(X, 6)
 #define MBC3_RTC_DAY_HI(X) BIT(X, 0)
+#define MBC5_RUMBLE_MOTOR(X) BIT(X, 3)
+#define MBC7_EEPROM_CS(X) BIT(X, 7)
+#define MBC7_EEPROM_CLK(X) BIT(X, 6)
+#define MBC7_EEPROM_DI(X) BIT(X, 1)
+#define MBC7_EEPROM_DO(X) BIT(X, 0)
+#define CAMERA_REGS_SELECT(X) BIT(X, 4)
+#define CAMERA_CAPTURE(X) BIT(X, 0)
+#define RTC_FOOTER_SIZE 48
+#define RTC_FOOTER_SIZE_32BIT_TIME 44
 
 static u32 s_rom_bank_count[] = {
 #define V(name, code, bank_count) [code] = bank_count,
@@ -1031,6 +1324,7 @@ static u8 s_wave_volume_shift[WAVE_VOLUME_COUNT] = {4, 0, 1, 2};
 static u8 s_obj_size_to_height[] = {[OBJ_SIZE_8X8] = 8, [OBJ_SIZE_8X16] = 16};
 
 static Result init_memory_map(Emulator*);
+static void reset_mapper(Emulator*);
 static void apu_synchronize(Emulator*);
 static void dma_synchronize(Emulator*);
 static void intr_synchronize(Emulator*);
@@ -1040,6 +1334,8 @@ static void serial_synchronize(Emulator*);
 static void timer_synchronize(Emulator*);
 static void calculate_next_ppu_intr(Emulator*);
 static void calculate_next_serial_intr(Emulator*);
+static Ticks get_serial_transfer_ticks(Emulator*);
+static void calculate_next_dma_event(Emulator*);
 
 static MemoryTypeAddressPair make_pair(MemoryMapType type, Address addr) {
   MemoryTypeAddressPair result;
@@ -1111,9 +1407,28 @@ static MemoryTypeAddressPair map_hdma_source_address(Address addr) {
   }
 }
 
+static inline void mark_state_pages_dirty(Emulator* e, StateSection section,
+                                          u32 first_page, u32 offset,
+                                          u32 size) {
+  e->dirty_state_sections |= 1u << section;
+  if (size == 0) {
+    return;
+  }
+  u32 page = first_page + (offset >> STATE_PAGE_SHIFT);
+  u32 last_page = first_page + ((offset + size - 1) >> STATE_PAGE_SHIFT);
+  for (; page <= last_page; ++page) {
+    e->dirty_state_pages[page >> 5] |= 1u << (page & 31);
+  }
+}
+
+static void mark_all_state_dirty(Emulator* e) {
+  e->dirty_state_sections = STATE_SECTIONS_ALL;
+  memset(e->dirty_state_pages, 0xff, sizeof(e->dirty_state_pages));
+}
+
 static void set_cart_info(Emulator* e, u8 index) {
   e->state.cart_info_index = index;
-  e->cart_info = &e->cart_infos[index];
+  e->cart_info = &e->rom->cart_infos[index];
   if (!(e->cart_info->data && SUCCESS(init_memory_map(e)))) {
     UNREACHABLE("Unable to switch cart (%d).\n", index);
   }
@@ -1166,40 +1481,53 @@ static Result get_cart_info(FileData* file_data, size_t offset,
   ON_ERROR_RETURN;
 }
 
-static Result get_cart_infos(Emulator* e) {
-  size_t file_size = e->file_data.size;
+static Result get_cart_infos(EmulatorRom* rom) {
+  size_t file_size = rom->file_data.size;
   size_t max_file_size = file_size;
   u32 i;
   for (i = 0; i < MAX_CART_INFOS; ++i) {
     size_t offset = i << CART_INFO_SHIFT;
-    if (offset + MINIMUM_ROM_SIZE > e->file_data.size) break;
-    if (SUCCESS(get_cart_info(&e->file_data, offset, &e->cart_infos[i], TRUE,
-                              &max_file_size))) {
-      if (s_cart_type_info[e->cart_infos[i].cart_type].mbc_type ==
+    if (offset + MINIMUM_ROM_SIZE > rom->file_data.size) break;
+    if (SUCCESS(get_cart_info(&rom->file_data, offset, &rom->cart_infos[i],
+                              TRUE, &max_file_size))) {
+      if (s_cart_type_info[rom->cart_infos[i].cart_type].mbc_type ==
           MBC_TYPE_MMM01) {
         /* MMM01 has the cart header at the end. */
         goto done;
       }
-      e->cart_info_count++;
+      rom->cart_info_count++;
     }
   }
   // Maybe the logo checksum failed; try again without it required.
-  if (e->cart_info_count == 0 &&
-      SUCCESS(get_cart_info(&e->file_data, 0, &e->cart_infos[0], FALSE,
+  if (rom->cart_info_count == 0 &&
+      SUCCESS(get_cart_info(&rom->file_data, 0, &rom->cart_infos[0], FALSE,
                             &max_file_size))) {
-    e->cart_info_count++;
+    rom->cart_info_count++;
   }
-  CHECK_MSG(e->cart_info_count != 0, "Invalid ROM.\n");
+  CHECK_MSG(rom->cart_info_count != 0, "Invalid ROM.\n");
   i = 0;
 done:
   if (max_file_size > file_size) {
-    file_data_resize(&e->file_data, max_file_size);
+    if (rom->free_data) {
+      /* The data can't be resized in place, so make an owned copy. */
+      FileData copy;
+      copy.size = file_size;
+      copy.data = xmalloc(file_size);
+      memcpy(copy.data, rom->file_data.data, file_size);
+      rom->free_data(&rom->file_data);
+      rom->file_data = copy;
+      rom->free_data = NULL;
+    }
+    file_data_resize(&rom->file_data, max_file_size);
     // Fix cart_info data pointers.
-    for (u32 j = 0; j < e->cart_info_count; ++j) {
-      e->cart_infos[j].data = e->file_data.data + e->cart_infos[j].offset;
+    for (u32 j = 0; j < MAX_CART_INFOS; ++j) {
+      if (rom->cart_infos[j].data) {
+        rom->cart_infos[j].data =
+            rom->file_data.data + rom->cart_infos[j].offset;
+      }
     }
   }
-  set_cart_info(e, i);
+  rom->cart_info_index = i;
   return OK;
   ON_ERROR_RETURN;
 }
@@ -1210,13 +1538,21 @@ static u8 dummy_read(Emulator* e, MaskedAddress addr) {
   return INVALID_READ_BYTE;
 }
 
+/* Maps 16K |bank| at 0000-3fff (index 0) or 4000-7fff (index 1). */
 static void set_rom_bank(Emulator* e, int index, u16 bank) {
   u32 new_base = (bank & ROM_BANK_MASK(e)) << ROM_BANK_SHIFT;
-  u32* base = &MMAP_STATE.rom_base[index];
+  u32* base = &MMAP_STATE.rom_base[index * 2];
   if (new_base != *base) {
     HOOK(set_rom_bank_ihi, index, bank, new_base);
   }
-  *base = new_base;
+  base[0] = new_base;
+  base[1] = new_base | (1 << ROM_REGION_SHIFT);
+}
+
+/* Maps 8K |bank| at one of the 8K regions; only MBC6 banks ROM this way. */
+static void set_rom_region_bank(Emulator* e, int region, u16 bank) {
+  u32 region_mask = ROM_BANK_COUNT(e) * 2 - 1;
+  MMAP_STATE.rom_base[region] = (bank & region_mask) << ROM_REGION_SHIFT;
 }
 
 static void set_ext_ram_bank(Emulator* e, u8 bank) {
@@ -1243,6 +1579,7 @@ static void gb_write_ext_ram(Emulator* e, MaskedAddress addr, u8 value) {
     assert(addr <= ADDR_MASK_8K);
     EXT_RAM.data[MMAP_STATE.ext_ram_base | addr] = value;
     e->state.ext_ram_updated = TRUE;
+    MARK_STATE_BYTES_DIRTY(XRAM, MMAP_STATE.ext_ram_base | addr, 1);
   } else {
     HOOK(write_ram_disabled_ab, addr, value);
   }
@@ -1325,11 +1662,94 @@ static u8 mbc2_read_ram(Emulator* e, MaskedAddress addr) {
 static void mbc2_write_ram(Emulator* e, MaskedAddress addr, u8 value) {
   if (MMAP_STATE.ext_ram_enabled) {
     EXT_RAM.data[addr & MBC2_RAM_ADDR_MASK] = value & MBC2_RAM_VALUE_MASK;
+    MARK_STATE_BYTES_DIRTY(XRAM, addr & MBC2_RAM_ADDR_MASK, 1);
   } else {
     HOOK(write_ram_disabled_ab, addr, value);
   }
 }
 
+static Bool has_rtc(Emulator* e) {
+  return s_cart_type_info[e->cart_info->cart_type].timer_type ==
+         TIMER_TYPE_WITH_TIMER;
+}
+
+static Ticks get_rtc_ticks(Emulator* e, Bool wall_clock) {
+  return wall_clock ? (Ticks)time(NULL) * CPU_TICKS_PER_SECOND : TICKS;
+}
+
+/* Returns the current time of the clock the RTC follows: emulated ticks, or
+ * host time if config.rtc_wall_clock is set. If that changed since
+ * latch_ticks was set, latch_ticks is moved to the new clock, keeping the
+ * time that has passed since the last latch. */
+static Ticks mbc3_rtc_ticks(Emulator* e) {
+  Mbc3* mbc3 = &MMAP_STATE.mbc3;
+  Bool wall_clock = e->config.rtc_wall_clock;
+  Ticks now = get_rtc_ticks(e, wall_clock);
+  if (mbc3->wall_clock != wall_clock) {
+    if (!mbc3->rtc_halt) {
+      Ticks old_now = get_rtc_ticks(e, mbc3->wall_clock);
+      Ticks delta =
+          old_now > mbc3->latch_ticks ? old_now - mbc3->latch_ticks : 0;
+      mbc3->latch_ticks = now - MIN(delta, now);
+    }
+    mbc3->wall_clock = wall_clock;
+  }
+  return now;
+}
+
+/* Advances the RTC registers by |delta| ticks, rounded down to seconds. */
+static void mbc3_rtc_add(Mbc3* mbc3, Ticks delta) {
+  u32 ms, sec, min, hour, day;
+  emulator_ticks_to_time(delta, &day, &hour, &min, &sec, &ms);
+
+  Bool secovf = FALSE;
+  if (mbc3->sec >= 60) {
+    mbc3->sec += sec;
+    if (mbc3->sec >= 64) {
+      mbc3->sec -= 64;
+      if (mbc3->sec >= 60) { mbc3->sec -= 60; ++min; secovf = TRUE; }
+    }
+  } else {
+    mbc3->sec += sec;
+    if (mbc3->sec >= 60) { mbc3->sec -= 60; ++min; secovf = TRUE; }
+  }
+
+  Bool minovf = FALSE;
+  if (min > 0 || secovf) {
+    if (mbc3->min >= 60) {
+      mbc3->min += min;
+      if (mbc3->min >= 64) {
+        mbc3->min -= 64;
+        if (mbc3->min >= 60) { mbc3->min -= 60; ++hour; minovf = TRUE; }
+      }
+    } else {
+      mbc3->min += min;
+      if (mbc3->min >= 60) { mbc3->min -= 60; ++hour; minovf = TRUE; }
+    }
+  }
+
+  Bool hourovf = FALSE;
+  if (hour > 0 || minovf) {
+    if (mbc3->hour >= 24) {
+      mbc3->hour += hour;
+      if (mbc3->hour >= 32) {
+        mbc3->hour -= 32;
+        if (mbc3->hour >= 24) { mbc3->hour -= 24; ++day; hourovf = TRUE; }
+      }
+    } else {
+      mbc3->hour += hour;
+      if (mbc3->hour >= 24) { mbc3->hour -= 24; ++day; hourovf = TRUE; }
+    }
+  }
+
+  if (day > 0 || hourovf) {
+    mbc3->day += day;
+    if (mbc3->day >= 512) {
+      mbc3->day_carry = TRUE;
+    }
+  }
+}
+
 static void mbc3_write_rom(Emulator* e, MaskedAddress addr, u8 value) {
   switch (addr >> 13) {
     case 0: /* 0000-1fff */
@@ -1357,61 +1777,13 @@ static void mbc3_write_rom(Emulator* e, MaskedAddress addr, u8 value) {
       if (!was_latched && latched && !mbc3->rtc_halt) {
         // Update the clock by how much time has passed since it was last
         // latched.
-        Ticks delta = TICKS - mbc3->latch_ticks;
+        Ticks now = mbc3_rtc_ticks(e);
+        Ticks delta = now - mbc3->latch_ticks;
         // RTC ticks every second, so don't update unless at least a second
         // has passed.
         if (delta >= CPU_TICKS_PER_SECOND) {
-          u32 ms, sec, min, hour, day;
-          emulator_ticks_to_time(delta, &day, &hour, &min, &sec, &ms);
-
-          Bool secovf = FALSE;
-          if (mbc3->sec >= 60) {
-            mbc3->sec += sec;
-            if (mbc3->sec >= 64) {
-              mbc3->sec -= 64;
-              if (mbc3->sec >= 60) { mbc3->sec -= 60; ++min; secovf = TRUE; }
-            }
-          } else {
-            mbc3->sec += sec;
-            if (mbc3->sec >= 60) { mbc3->sec -= 60; ++min; secovf = TRUE; }
-          }
-
-          Bool minovf = FALSE;
-          if (min > 0 || secovf) {
-            if (mbc3->min >= 60) {
-              mbc3->min += min;
-              if (mbc3->min >= 64) {
-                mbc3->min -= 64;
-                if (mbc3->min >= 60) { mbc3->min -= 60; ++hour; minovf = TRUE; }
-              }
-            } else {
-              mbc3->min += min;
-              if (mbc3->min >= 60) { mbc3->min -= 60; ++hour; minovf = TRUE; }
-            }
-          }
-
-          Bool hourovf = FALSE;
-          if (hour > 0 || minovf) {
-            if (mbc3->hour >= 24) {
-              mbc3->hour += hour;
-              if (mbc3->hour >= 32) {
-                mbc3->hour -= 32;
-                if (mbc3->hour >= 24) { mbc3->hour -= 24; ++day; hourovf = TRUE; }
-              }
-            } else {
-              mbc3->hour += hour;
-              if (mbc3->hour >= 24) { mbc3->hour -= 24; ++day; hourovf = TRUE; }
-            }
-          }
-
-          if (day > 0 || hourovf) {
-            mbc3->day += day;
-            if (mbc3->day >= 512) {
-              mbc3->day_carry = TRUE;
-            }
-          }
-
-          mbc3->latch_ticks = TICKS;
+          mbc3_rtc_add(mbc3, delta);
+          mbc3->latch_ticks = now;
         }
       }
       mbc3->latched = latched;
@@ -1474,12 +1846,13 @@ static void mbc3_write_ext_ram(Emulator* e, MaskedAddress addr, u8 value) {
        * latch_ticks is a previously stored delta, not an absolute tick timer.
        * Once the timer is restarted then latch_ticks is an absolute timer
        * again. */
-      mbc3->latch_ticks = mbc3->rtc_halt ? 0 : TICKS;
+      mbc3->latch_ticks = mbc3->rtc_halt ? 0 : mbc3_rtc_ticks(e);
       break;
     case 9: mbc3->min = value & 63; break;
     case 10: mbc3->hour = value & 31; break;
     case 11: mbc3->day = (mbc3->day & 0x100) | value; break;
     case 12: {
+      Ticks now = mbc3_rtc_ticks(e);
       mbc3->day = (UNPACK(value, MBC3_RTC_DAY_HI) << 8) | (mbc3->day & 0xff);
       mbc3->day_carry = UNPACK(value, MBC3_RTC_DAY_CARRY);
       Bool old_rtc_halt = mbc3->rtc_halt;
@@ -1490,7 +1863,7 @@ static void mbc3_write_ext_ram(Emulator* e, MaskedAddress addr, u8 value) {
         // restarted, then subtract that delta from the current tick timer to
         // "add" in the delta that is not yet accounted for in the RTC
         // registers.
-        mbc3->latch_ticks = TICKS - mbc3->latch_ticks;
+        mbc3->latch_ticks = now - mbc3->latch_ticks;
       }
       break;
     }
@@ -1567,6 +1940,7 @@ static void mmm01_write_rom(Emulator* e, MaskedAddress addr, u8 value) {
       u32 rom_offset =
           (mmm01->byte_2000_3fff << ROM_BANK_SHIFT) & (e->cart_info->size - 1);
       set_cart_info(e, rom_offset >> CART_INFO_SHIFT);
+      reset_mapper(e);
       break;
     }
     case 1: /* 2000-3fff */
@@ -1575,167 +1949,661 @@ static void mmm01_write_rom(Emulator* e, MaskedAddress addr, u8 value) {
   }
 }
 
-static Result init_memory_map(Emulator* e) {
-  CartTypeInfo* cart_type_info = &s_cart_type_info[e->cart_info->cart_type];
-  MemoryMap* memory_map = &e->memory_map;
-
-  switch (cart_type_info->ext_ram_type) {
-    case EXT_RAM_TYPE_WITH_RAM:
-      assert(is_ext_ram_size_valid(e->cart_info->ext_ram_size));
-      memory_map->read_ext_ram = gb_read_ext_ram;
-      memory_map->write_ext_ram = gb_write_ext_ram;
-      EXT_RAM.size = EXT_RAM_BYTE_SIZE(e);
-      break;
-    default:
-    case EXT_RAM_TYPE_NO_RAM:
-      memory_map->read_ext_ram = dummy_read;
-      memory_map->write_ext_ram = dummy_write;
-      EXT_RAM.size = 0;
-      break;
+static void mbc5_rumble_write_rom(Emulator* e, MaskedAddress addr, u8 value) {
+  if ((addr >> 13) == 2) { /* 4000-5fff */
+    MMAP_STATE.mbc5.rumble = UNPACK(value, MBC5_RUMBLE_MOTOR);
+    value &= MBC5_RUMBLE_RAM_BANK_SELECT_MASK;
   }
+  mbc5_write_rom(e, addr, value);
+}
+
+static void mbc5_reset(Emulator* e) {
+  MMAP_STATE.mbc5.byte_2000_2fff = 1;
+}
 
-  switch (cart_type_info->mbc_type) {
-    case MBC_TYPE_NO_MBC:
-      memory_map->write_rom = dummy_write;
+static void mbc6_write_rom(Emulator* e, MaskedAddress addr, u8 value) {
+  Mbc6* mbc6 = &MMAP_STATE.mbc6;
+  switch (addr >> 10) {
+    case 0: /* 0000-03ff */
+      MMAP_STATE.ext_ram_enabled =
+          (value & MBC_RAM_ENABLED_MASK) == MBC_RAM_ENABLED_VALUE;
       break;
-    case MBC_TYPE_MBC1: {
-      Bool is_mbc1m = e->cart_info_count > 1;
-      memory_map->write_rom = is_mbc1m ? mbc1m_write_rom : mbc1_write_rom;
+    case 1: /* 0400-07ff */
+      mbc6->ram_bank[0] = value & MBC6_RAM_BANK_SELECT_MASK;
       break;
-    }
-    case MBC_TYPE_MBC2:
-      memory_map->write_rom = mbc2_write_rom;
-      memory_map->read_ext_ram = mbc2_read_ram;
-      memory_map->write_ext_ram = mbc2_write_ram;
-      EXT_RAM.size = MBC2_RAM_SIZE;
-      break;
-    case MBC_TYPE_MMM01:
-      memory_map->write_rom = mmm01_write_rom;
-      break;
-    case MBC_TYPE_MBC3: {
-      memory_map->write_rom = mbc3_write_rom;
-      if (cart_type_info->timer_type == TIMER_TYPE_WITH_TIMER) {
-        memory_map->read_ext_ram = mbc3_read_ext_ram;
-        memory_map->write_ext_ram = mbc3_write_ext_ram;
-      }
+    case 2: /* 0800-0bff */
+      mbc6->ram_bank[1] = value & MBC6_RAM_BANK_SELECT_MASK;
       break;
-    }
-    case MBC_TYPE_MBC5:
-      memory_map->write_rom = mbc5_write_rom;
-      MMAP_STATE.mbc5.byte_2000_2fff = 1;
+    case 8: case 9: /* 2000-27ff */
+      set_rom_region_bank(e, 2, value & MBC6_ROM_BANK_SELECT_MASK);
       break;
-    case MBC_TYPE_HUC1:
-      memory_map->write_rom = huc1_write_rom;
+    case 12: case 13: /* 3000-37ff */
+      set_rom_region_bank(e, 3, value & MBC6_ROM_BANK_SELECT_MASK);
       break;
     default:
-      PRINT_ERROR("memory map for %s not implemented.\n",
-                  get_cart_type_string(e->cart_info->cart_type));
-      return ERROR;
+      /* Flash isn't emulated; ROM stays mapped if flash is selected. */
+      break;
   }
-
-  EXT_RAM.battery_type = cart_type_info->battery_type;
-  return OK;
 }
 
-static Bool is_almost_mode3(Emulator* e) {
-  return PPU.state_ticks == CPU_TICK && STAT.mode == PPU_MODE_MODE2;
+static u32 get_mbc6_ext_ram_addr(Emulator* e, MaskedAddress addr) {
+  u8 bank = MMAP_STATE.mbc6.ram_bank[addr >> 12];
+  return ((bank << 12) | (addr & ADDR_MASK_4K)) & (EXT_RAM.size - 1);
 }
 
-static Bool is_using_vram(Emulator* e, Bool write) {
-  if (write) {
-    return STAT.mode == PPU_MODE_MODE3;
-  } else {
-    return STAT.mode == PPU_MODE_MODE3 || is_almost_mode3(e);
+static u8 mbc6_read_ext_ram(Emulator* e, MaskedAddress addr) {
+  if (!MMAP_STATE.ext_ram_enabled || EXT_RAM.size == 0) {
+    HOOK(read_ram_disabled_a, addr);
+    return INVALID_READ_BYTE;
   }
+  return EXT_RAM.data[get_mbc6_ext_ram_addr(e, addr)];
 }
 
-static Bool is_using_oam(Emulator* e, Bool write) {
-  if (write) {
-    return (STAT.mode == PPU_MODE_MODE2 && !is_almost_mode3(e)) ||
-           STAT.mode == PPU_MODE_MODE3;
-  } else {
-    return STAT.mode2.trigger || STAT.mode == PPU_MODE_MODE2 ||
-           STAT.mode == PPU_MODE_MODE3;
+static void mbc6_write_ext_ram(Emulator* e, MaskedAddress addr, u8 value) {
+  if (!MMAP_STATE.ext_ram_enabled || EXT_RAM.size == 0) {
+    HOOK(write_ram_disabled_ab, addr, value);
+    return;
   }
+  u32 ram_addr = get_mbc6_ext_ram_addr(e, addr);
+  EXT_RAM.data[ram_addr] = value;
+  e->state.ext_ram_updated = TRUE;
+  MARK_STATE_BYTES_DIRTY(XRAM, ram_addr, 1);
 }
 
-static u8 read_vram(Emulator* e, MaskedAddress addr) {
-  ppu_synchronize(e);
-  if (is_using_vram(e, FALSE)) {
-    HOOK(read_vram_in_use_a, addr);
-    return INVALID_READ_BYTE;
-  } else {
-    assert(addr <= ADDR_MASK_8K);
-    return VRAM.data[VRAM.offset + addr];
+static void mbc7_write_rom(Emulator* e, MaskedAddress addr, u8 value) {
+  switch (addr >> 13) {
+    case 0: /* 0000-1fff */
+      MMAP_STATE.ext_ram_enabled =
+          (value & MBC_RAM_ENABLED_MASK) == MBC_RAM_ENABLED_VALUE;
+      break;
+    case 1: /* 2000-3fff */
+      set_rom_bank(e, 1, value & MBC7_ROM_BANK_SELECT_MASK);
+      break;
+    case 2: /* 4000-5fff */
+      MMAP_STATE.mbc7.ram_enabled2 = value == MBC7_RAM_ENABLED2_VALUE;
+      break;
+    default:
+      break;
   }
 }
 
-static u8 read_oam(Emulator* e, MaskedAddress addr) {
-  ppu_synchronize(e);
-  if (is_using_oam(e, FALSE)) {
-    HOOK(read_oam_in_use_a, addr);
-    return INVALID_READ_BYTE;
-  }
+static Bool is_mbc7_ram_enabled(Emulator* e, MaskedAddress addr) {
+  /* Only a000-afff is mapped. */
+  return MMAP_STATE.ext_ram_enabled && MMAP_STATE.mbc7.ram_enabled2 &&
+         addr <= ADDR_MASK_4K;
+}
 
-  u8 obj_index = addr >> 2;
-  Obj* obj = &OAM[obj_index];
-  switch (addr & 3) {
-    case 0: return obj->y + OBJ_Y_OFFSET;
-    case 1: return obj->x + OBJ_X_OFFSET;
-    case 2: return obj->tile;
-    case 3: return obj->byte3;
-  }
-  UNREACHABLE("invalid OAM address: 0x%04x\n", addr);
+static u16 read_mbc7_eeprom_word(Emulator* e, u8 addr) {
+  u8* data = EXT_RAM.data + (addr & MBC7_EEPROM_WORD_MASK) * 2;
+  return data[0] | (data[1] << 8);
 }
 
-static u8 read_joyp_p10_p13(Emulator* e) {
-  if (JOYP.joypad_select == JOYPAD_SELECT_NONE) {
-    return ~(SGB.current_player & 3);
-  }
-  if (SGB.current_player != 0) { return ~0; }  // Ignore other controllers.
+static void write_mbc7_eeprom_word(Emulator* e, u8 addr, u16 value) {
+  u8* data = EXT_RAM.data + (addr & MBC7_EEPROM_WORD_MASK) * 2;
+  data[0] = value;
+  data[1] = value >> 8;
+  e->state.ext_ram_updated = TRUE;
+  MARK_STATE_BYTES_DIRTY(XRAM, data - EXT_RAM.data, 2);
+}
 
-  u8 result = 0;
-  if (JOYP.joypad_select == JOYPAD_SELECT_BUTTONS ||
-      JOYP.joypad_select == JOYPAD_SELECT_BOTH) {
-    result |= PACK(JOYP.buttons.start, JOYP_BUTTON_START) |
-              PACK(JOYP.buttons.select, JOYP_BUTTON_SELECT) |
-              PACK(JOYP.buttons.B, JOYP_BUTTON_B) |
-              PACK(JOYP.buttons.A, JOYP_BUTTON_A);
+/* Runs the command that was just shifted in, returning the new value of DO.
+ * Writes finish immediately, so DO always reads as ready afterward. */
+static Bool run_mbc7_eeprom_command(Emulator* e) {
+  Mbc7* mbc7 = &MMAP_STATE.mbc7;
+  u8 opcode = (mbc7->eeprom_shift >> 8) & 3;
+  u8 addr = mbc7->eeprom_shift & 0xff;
+  int i;
+  mbc7->eeprom_addr = addr & MBC7_EEPROM_WORD_MASK;
+  mbc7->eeprom_shift = 0;
+  mbc7->eeprom_bits = 0;
+  mbc7->eeprom_state = MBC7_EEPROM_IDLE;
+  switch (opcode) {
+    case 0: /* The top two address bits select EWDS, WRAL, ERAL or EWEN. */
+      switch (addr >> 6) {
+        case 0:
+          mbc7->eeprom_write_enabled = FALSE;
+          break;
+        case 1:
+          mbc7->eeprom_state = MBC7_EEPROM_WRITE_ALL;
+          break;
+        case 2:
+          if (mbc7->eeprom_write_enabled) {
+            for (i = 0; i < MBC7_EEPROM_SIZE / 2; ++i) {
+              write_mbc7_eeprom_word(e, i, 0xffff);
+            }
+          }
+          break;
+        case 3:
+          mbc7->eeprom_write_enabled = TRUE;
+          break;
+      }
+      break;
+    case 1: /* WRITE */
+      mbc7->eeprom_state = MBC7_EEPROM_WRITE;
+      break;
+    case 2: /* READ; a 0 bit is shifted out before the data. */
+      mbc7->eeprom_state = MBC7_EEPROM_READ;
+      mbc7->eeprom_shift = read_mbc7_eeprom_word(e, mbc7->eeprom_addr);
+      return FALSE;
+    case 3: /* ERASE */
+      if (mbc7->eeprom_write_enabled) {
+        write_mbc7_eeprom_word(e, mbc7->eeprom_addr, 0xffff);
+      }
+      break;
   }
+  return TRUE;
+}
 
-  Bool left = JOYP.buttons.left;
-  Bool right = JOYP.buttons.right;
-  Bool up = JOYP.buttons.up;
-  Bool down = JOYP.buttons.down;
-  if (!e->config.allow_simulataneous_dpad_opposites) {
-    if (left && right) {
-      left = FALSE;
-    } else if (up && down) {
-      up = FALSE;
-    }
+/* Handles a rising edge of CLK, returning the new value of DO. */
+static Bool clock_mbc7_eeprom(Emulator* e, Bool di, Bool out) {
+  Mbc7* mbc7 = &MMAP_STATE.mbc7;
+  int i;
+  switch (mbc7->eeprom_state) {
+    case MBC7_EEPROM_IDLE:
+      if (di) { /* Start bit. */
+        mbc7->eeprom_state = MBC7_EEPROM_COMMAND;
+        mbc7->eeprom_shift = 0;
+        mbc7->eeprom_bits = 0;
+      }
+      break;
+
+    case MBC7_EEPROM_COMMAND:
+      mbc7->eeprom_shift = (mbc7->eeprom_shift << 1) | di;
+      if (++mbc7->eeprom_bits == MBC7_EEPROM_COMMAND_BITS) {
+        out = run_mbc7_eeprom_command(e);
+      }
+      break;
+
+    case MBC7_EEPROM_READ:
+      out = mbc7->eeprom_shift >> 15;
+      mbc7->eeprom_shift <<= 1;
+      if (++mbc7->eeprom_bits == 16) {
+        /* Keep reading from the next word. */
+        mbc7->eeprom_addr = (mbc7->eeprom_addr + 1) & MBC7_EEPROM_WORD_MASK;
+        mbc7->eeprom_shift = read_mbc7_eeprom_word(e, mbc7->eeprom_addr);
+        mbc7->eeprom_bits = 0;
+      }
+      break;
+
+    case MBC7_EEPROM_WRITE:
+    case MBC7_EEPROM_WRITE_ALL:
+      mbc7->eeprom_shift = (mbc7->eeprom_shift << 1) | di;
+      if (++mbc7->eeprom_bits == 16) {
+        if (mbc7->eeprom_write_enabled) {
+          if (mbc7->eeprom_state == MBC7_EEPROM_WRITE_ALL) {
+            for (i = 0; i < MBC7_EEPROM_SIZE / 2; ++i) {
+              write_mbc7_eeprom_word(e, i, mbc7->eeprom_shift);
+            }
+          } else {
+            write_mbc7_eeprom_word(e, mbc7->eeprom_addr, mbc7->eeprom_shift);
+          }
+        }
+        mbc7->eeprom_state = MBC7_EEPROM_IDLE;
+        out = TRUE;
+      }
+      break;
   }
+  return out;
+}
 
-  if (JOYP.joypad_select == JOYPAD_SELECT_DPAD ||
-      JOYP.joypad_select == JOYPAD_SELECT_BOTH) {
-    result |= PACK(down, JOYP_DPAD_DOWN) | PACK(up, JOYP_DPAD_UP) |
-              PACK(left, JOYP_DPAD_LEFT) | PACK(right, JOYP_DPAD_RIGHT);
+static void write_mbc7_eeprom(Emulator* e, u8 value) {
+  Mbc7* mbc7 = &MMAP_STATE.mbc7;
+  Bool cs = UNPACK(value, MBC7_EEPROM_CS);
+  Bool clk = UNPACK(value, MBC7_EEPROM_CLK);
+  Bool di = UNPACK(value, MBC7_EEPROM_DI);
+  Bool out = UNPACK(mbc7->eeprom_pins, MBC7_EEPROM_DO);
+  if (!cs) {
+    mbc7->eeprom_state = MBC7_EEPROM_IDLE;
+    out = TRUE;
+  } else if (clk && !UNPACK(mbc7->eeprom_pins, MBC7_EEPROM_CLK)) {
+    out = clock_mbc7_eeprom(e, di, out);
   }
-  /* The bits are low when the buttons are pressed. */
-  return ~result;
+  mbc7->eeprom_pins = PACK(cs, MBC7_EEPROM_CS) | PACK(clk, MBC7_EEPROM_CLK) |
+                      PACK(di, MBC7_EEPROM_DI) | PACK(out, MBC7_EEPROM_DO);
 }
 
-static void call_joyp_callback(Emulator* e, Bool wait) {
-  if (e->joypad_info.callback &&
-      (!wait || TICKS - JOYP.last_callback >= JOYP_INTERRUPT_WAIT_TICKS)) {
-    e->joypad_info.callback(&JOYP.buttons, e->joypad_info.user_data);
-    JOYP.last_callback = TICKS;
+static u16 get_mbc7_accel_value(f32 g) {
+  return (u16)CLAMP(MBC7_ACCEL_CENTER + g * MBC7_ACCEL_PER_G, 0, 0xffff);
+}
+
+static u8 mbc7_read_ext_ram(Emulator* e, MaskedAddress addr) {
+  Mbc7* mbc7 = &MMAP_STATE.mbc7;
+  if (!is_mbc7_ram_enabled(e, addr)) {
+    HOOK(read_ram_disabled_a, addr);
+    return INVALID_READ_BYTE;
+  }
+  switch ((addr >> 4) & 0xf) {
+    case 2: return mbc7->accel_x & 0xff;
+    case 3: return mbc7->accel_x >> 8;
+    case 4: return mbc7->accel_y & 0xff;
+    case 5: return mbc7->accel_y >> 8;
+    case 6: return 0;
+    case 8: return mbc7->eeprom_pins;
+    default: return INVALID_READ_BYTE;
   }
 }
 
-static u8 read_io(Emulator* e, MaskedAddress addr) {
-  switch (addr) {
-    case IO_JOYP_ADDR:
-      call_joyp_callback(e, FALSE);
+static void mbc7_write_ext_ram(Emulator* e, MaskedAddress addr, u8 value) {
+  Mbc7* mbc7 = &MMAP_STATE.mbc7;
+  if (!is_mbc7_ram_enabled(e, addr)) {
+    HOOK(write_ram_disabled_ab, addr, value);
+    return;
+  }
+  switch ((addr >> 4) & 0xf) {
+    case 0:
+      if (value == MBC7_ACCEL_ERASE_VALUE) {
+        mbc7->accel_x = mbc7->accel_y = MBC7_ACCEL_ERASED;
+        mbc7->accel_erased = TRUE;
+      }
+      break;
+    case 1:
+      if (value == MBC7_ACCEL_LATCH_VALUE && mbc7->accel_erased) {
+        f32 x = 0, y = 0;
+        if (e->sensor_info.callback) {
+          e->sensor_info.callback(&x, &y, e->sensor_info.user_data);
+        }
+        mbc7->accel_x = get_mbc7_accel_value(x);
+        mbc7->accel_y = get_mbc7_accel_value(y);
+        mbc7->accel_erased = FALSE;
+      }
+      break;
+    case 8:
+      write_mbc7_eeprom(e, value);
+      break;
+    default:
+      break;
+  }
+}
+
+static void mbc7_reset(Emulator* e) {
+  Mbc7* mbc7 = &MMAP_STATE.mbc7;
+  mbc7->accel_x = mbc7->accel_y = MBC7_ACCEL_ERASED;
+  mbc7->eeprom_pins = PACK(1, MBC7_EEPROM_DO);
+  memset(EXT_RAM.data, 0xff, MBC7_EEPROM_SIZE); /* Erased. */
+}
+
+static void huc3_write_rom(Emulator* e, MaskedAddress addr, u8 value) {
+  switch (addr >> 13) {
+    case 0: /* 0000-1fff */
+      MMAP_STATE.huc3.mode = value & HUC3_MODE_MASK;
+      break;
+    case 1: /* 2000-3fff */
+      set_rom_bank(e, 1, value & HUC3_ROM_BANK_SELECT_MASK);
+      break;
+    case 2: /* 4000-5fff */
+      set_ext_ram_bank(e, value & HUC3_RAM_BANK_SELECT_MASK);
+      break;
+    default:
+      break;
+  }
+}
+
+/* Adds the whole minutes that have passed since latch_ticks. */
+static void huc3_synchronize_time(Emulator* e) {
+  Huc3* huc3 = &MMAP_STATE.huc3;
+  Ticks minutes = (TICKS - huc3->latch_ticks) / HUC3_MINUTE_TICKS;
+  u32 total = huc3->minutes + (u32)minutes;
+  huc3->days = (huc3->days + total / HUC3_MINUTES_PER_DAY) & HUC3_DAY_MASK;
+  huc3->minutes = total % HUC3_MINUTES_PER_DAY;
+  huc3->latch_ticks += minutes * HUC3_MINUTE_TICKS;
+}
+
+static void run_huc3_command(Emulator* e) {
+  Huc3* huc3 = &MMAP_STATE.huc3;
+  u8 value = huc3->command & 0xf;
+  int i;
+  switch (huc3->command >> 4) {
+    case HUC3_COMMAND_READ:
+      value = huc3->rtc_mem[huc3->rtc_addr++];
+      break;
+    case HUC3_COMMAND_WRITE:
+      huc3->rtc_mem[huc3->rtc_addr++] = value;
+      break;
+    case HUC3_COMMAND_ADDR_LO:
+      huc3->rtc_addr = (huc3->rtc_addr & 0xf0) | value;
+      break;
+    case HUC3_COMMAND_ADDR_HI:
+      huc3->rtc_addr = (huc3->rtc_addr & 0x0f) | (value << 4);
+      break;
+    case HUC3_COMMAND_EXTENDED:
+      switch (value) {
+        case HUC3_EXTENDED_GET_TIME:
+          /* Minutes, then days, as 12-bit values, low nibble first. */
+          huc3_synchronize_time(e);
+          for (i = 0; i < 3; ++i) {
+            huc3->rtc_mem[i] = (huc3->minutes >> (i * 4)) & 0xf;
+            huc3->rtc_mem[i + 3] = (huc3->days >> (i * 4)) & 0xf;
+          }
+          break;
+        case HUC3_EXTENDED_SET_TIME:
+          huc3->minutes = huc3->days = 0;
+          for (i = 0; i < 3; ++i) {
+            huc3->minutes |= huc3->rtc_mem[i] << (i * 4);
+            huc3->days |= huc3->rtc_mem[i + 3] << (i * 4);
+          }
+          huc3->minutes %= HUC3_MINUTES_PER_DAY;
+          huc3->latch_ticks = TICKS;
+          break;
+        case HUC3_EXTENDED_STATUS:
+          value = 1;
+          break;
+        default: /* Tone generator, etc. */
+          break;
+      }
+      break;
+    default:
+      break;
+  }
+  huc3->response = (huc3->command & 0xf0) | (value & 0xf);
+}
+
+static u8 huc3_read_ext_ram(Emulator* e, MaskedAddress addr) {
+  Huc3* huc3 = &MMAP_STATE.huc3;
+  switch (huc3->mode) {
+    case HUC3_MODE_RAM_READ:
+    case HUC3_MODE_RAM:
+      return EXT_RAM.data[MMAP_STATE.ext_ram_base | addr];
+    case HUC3_MODE_RESPONSE:
+      return huc3->response;
+    case HUC3_MODE_SEMAPHORE:
+      return 0xff; /* Bit 0 set: ready for a command. */
+    case HUC3_MODE_IR:
+      return HUC3_IR_NO_LIGHT;
+    default:
+      return INVALID_READ_BYTE;
+  }
+}
+
+static void huc3_write_ext_ram(Emulator* e, MaskedAddress addr, u8 value) {
+  Huc3* huc3 = &MMAP_STATE.huc3;
+  switch (huc3->mode) {
+    case HUC3_MODE_RAM:
+      EXT_RAM.data[MMAP_STATE.ext_ram_base | addr] = value;
+      e->state.ext_ram_updated = TRUE;
+      MARK_STATE_BYTES_DIRTY(XRAM, MMAP_STATE.ext_ram_base | addr, 1);
+      break;
+    case HUC3_MODE_COMMAND:
+      huc3->command = value;
+      break;
+    case HUC3_MODE_SEMAPHORE:
+      if ((value & 1) == 0) {
+        run_huc3_command(e);
+      }
+      break;
+    default: /* The IR LED isn't emulated. */
+      break;
+  }
+}
+
+static void camera_write_rom(Emulator* e, MaskedAddress addr, u8 value) {
+  PocketCamera* camera = &MMAP_STATE.camera;
+  switch (addr >> 13) {
+    case 0: /* 0000-1fff */
+      MMAP_STATE.ext_ram_enabled =
+          (value & MBC_RAM_ENABLED_MASK) == MBC_RAM_ENABLED_VALUE;
+      break;
+    case 1: /* 2000-3fff */
+      set_rom_bank(e, 1, value & CAMERA_ROM_BANK_SELECT_MASK);
+      break;
+    case 2: /* 4000-5fff */
+      camera->regs_mapped = UNPACK(value, CAMERA_REGS_SELECT);
+      if (!camera->regs_mapped) {
+        set_ext_ram_bank(e, value & CAMERA_RAM_BANK_SELECT_MASK);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/* Writes the picture to RAM bank 0 as tiles, dithered to 2 bits per pixel by
+ * the threshold matrix in the registers. The sensor's edge enhancement and
+ * gain aren't emulated. */
+static void camera_capture(Emulator* e) {
+  PocketCamera* camera = &MMAP_STATE.camera;
+  u8 image[CAMERA_IMAGE_WIDTH * CAMERA_IMAGE_HEIGHT];
+  memset(image, 0xff, sizeof(image));
+  if (e->camera_info.callback) {
+    e->camera_info.callback(image, e->camera_info.user_data);
+  }
+  u8* tiles = EXT_RAM.data + CAMERA_IMAGE_ADDR;
+  memset(tiles, 0, sizeof(image) / 4);
+  int x, y;
+  for (y = 0; y < CAMERA_IMAGE_HEIGHT; ++y) {
+    for (x = 0; x < CAMERA_IMAGE_WIDTH; ++x) {
+      const u8* thresholds =
+          &camera->regs[CAMERA_DITHER_REG + ((y & 3) * 4 + (x & 3)) * 3];
+      u8 pixel = image[y * CAMERA_IMAGE_WIDTH + x];
+      u8 color = pixel < thresholds[0]   ? 3
+                 : pixel < thresholds[1] ? 2
+                 : pixel < thresholds[2] ? 1
+                                         : 0;
+      u8* row = tiles + ((y >> 3) * (CAMERA_IMAGE_WIDTH / 8) + (x >> 3)) * 16 +
+                (y & 7) * 2;
+      u8 mask = 0x80 >> (x & 7);
+      if (color & 1) { row[0] |= mask; }
+      if (color & 2) { row[1] |= mask; }
+    }
+  }
+  e->state.ext_ram_updated = TRUE;
+  MARK_STATE_BYTES_DIRTY(XRAM, CAMERA_IMAGE_ADDR, sizeof(image) / 4);
+}
+
+/* Finishes the capture in progress, if it is done by now. */
+static void camera_synchronize(Emulator* e) {
+  PocketCamera* camera = &MMAP_STATE.camera;
+  if (UNPACK(camera->regs[0], CAMERA_CAPTURE) &&
+      TICKS >= camera->capture_ticks) {
+    camera_capture(e);
+    camera->regs[0] &= ~PACK(1, CAMERA_CAPTURE);
+  }
+}
+
+static u8 camera_read_ext_ram(Emulator* e, MaskedAddress addr) {
+  PocketCamera* camera = &MMAP_STATE.camera;
+  camera_synchronize(e);
+  if (camera->regs_mapped) {
+    /* Only the capture register can be read. */
+    return (addr & CAMERA_REG_ADDR_MASK) == 0 ? camera->regs[0] : 0;
+  }
+  /* RAM can be read even when it isn't enabled. */
+  return EXT_RAM.data[MMAP_STATE.ext_ram_base | addr];
+}
+
+static void camera_write_ext_ram(Emulator* e, MaskedAddress addr, u8 value) {
+  PocketCamera* camera = &MMAP_STATE.camera;
+  camera_synchronize(e);
+  if (!camera->regs_mapped) {
+    gb_write_ext_ram(e, addr, value);
+    return;
+  }
+  MaskedAddress reg = addr & CAMERA_REG_ADDR_MASK;
+  if (reg == 0) {
+    Bool was_capturing = UNPACK(camera->regs[0], CAMERA_CAPTURE);
+    camera->regs[0] = value & CAMERA_CAPTURE_REG_MASK;
+    if (!was_capturing && UNPACK(value, CAMERA_CAPTURE)) {
+      u16 exposure = (camera->regs[2] << 8) | camera->regs[3];
+      camera->capture_ticks =
+          TICKS + CAMERA_CAPTURE_TICKS + exposure * CAMERA_EXPOSURE_TICKS;
+    }
+  } else if (reg < CAMERA_REG_COUNT) {
+    camera->regs[reg] = value;
+  }
+}
+
+static const Mapper s_mappers[MBC_TYPE_COUNT] = {
+  [MBC_TYPE_NO_MBC] = {dummy_write},
+  [MBC_TYPE_MBC1] = {mbc1_write_rom},
+  [MBC_TYPE_MBC1M] = {mbc1m_write_rom},
+  [MBC_TYPE_MBC2] = {mbc2_write_rom, mbc2_read_ram, mbc2_write_ram,
+                     MBC2_RAM_SIZE},
+  [MBC_TYPE_MBC3] = {mbc3_write_rom},
+  [MBC_TYPE_MBC3_RTC] = {mbc3_write_rom, mbc3_read_ext_ram,
+                         mbc3_write_ext_ram},
+  [MBC_TYPE_MBC5] = {mbc5_write_rom, .reset = mbc5_reset},
+  [MBC_TYPE_MBC5_RUMBLE] = {mbc5_rumble_write_rom, .reset = mbc5_reset},
+  [MBC_TYPE_MBC6] = {mbc6_write_rom, mbc6_read_ext_ram, mbc6_write_ext_ram},
+  [MBC_TYPE_MBC7] = {mbc7_write_rom, mbc7_read_ext_ram, mbc7_write_ext_ram,
+                     MBC7_EEPROM_SIZE, mbc7_reset},
+  [MBC_TYPE_MMM01] = {mmm01_write_rom},
+  [MBC_TYPE_HUC1] = {huc1_write_rom},
+  [MBC_TYPE_HUC3] = {huc3_write_rom, huc3_read_ext_ram, huc3_write_ext_ram},
+  [MBC_TYPE_POCKET_CAMERA] = {camera_write_rom, camera_read_ext_ram,
+                              camera_write_ext_ram},
+};
+
+static const Mapper* get_mapper(Emulator* e) {
+  MbcType mbc_type = s_cart_type_info[e->cart_info->cart_type].mbc_type;
+  if (mbc_type == MBC_TYPE_MBC1 && e->rom->cart_info_count > 1) {
+    mbc_type = MBC_TYPE_MBC1M;
+  }
+  return &s_mappers[mbc_type];
+}
+
+static void reset_mapper(Emulator* e) {
+  const Mapper* mapper = get_mapper(e);
+  if (mapper->reset) {
+    mapper->reset(e);
+  }
+}
+
+static Result init_memory_map(Emulator* e) {
+  CartTypeInfo* cart_type_info = &s_cart_type_info[e->cart_info->cart_type];
+  const Mapper* mapper = get_mapper(e);
+  MemoryMap* memory_map = &e->memory_map;
+
+  if (!mapper->write_rom) {
+    PRINT_ERROR("memory map for %s not implemented.\n",
+                get_cart_type_string(e->cart_info->cart_type));
+    return ERROR;
+  }
+
+  switch (cart_type_info->ext_ram_type) {
+    case EXT_RAM_TYPE_WITH_RAM:
+      assert(is_ext_ram_size_valid(e->cart_info->ext_ram_size));
+      memory_map->read_ext_ram = gb_read_ext_ram;
+      memory_map->write_ext_ram = gb_write_ext_ram;
+      EXT_RAM.size = EXT_RAM_BYTE_SIZE(e);
+      break;
+    default:
+    case EXT_RAM_TYPE_NO_RAM:
+      memory_map->read_ext_ram = dummy_read;
+      memory_map->write_ext_ram = dummy_write;
+      EXT_RAM.size = 0;
+      break;
+  }
+
+  memory_map->write_rom = mapper->write_rom;
+  if (mapper->read_ext_ram) {
+    memory_map->read_ext_ram = mapper->read_ext_ram;
+    memory_map->write_ext_ram = mapper->write_ext_ram;
+  }
+  if (mapper->ext_ram_size) {
+    EXT_RAM.size = mapper->ext_ram_size;
+  }
+  EXT_RAM.battery_type = cart_type_info->battery_type;
+  return OK;
+}
+
+static Bool is_almost_mode3(Emulator* e) {
+  return PPU.state_ticks == CPU_TICK && STAT.mode == PPU_MODE_MODE2;
+}
+
+static Bool is_using_vram(Emulator* e, Bool write) {
+  if (write) {
+    return STAT.mode == PPU_MODE_MODE3;
+  } else {
+    return STAT.mode == PPU_MODE_MODE3 || is_almost_mode3(e);
+  }
+}
+
+static Bool is_using_oam(Emulator* e, Bool write) {
+  if (write) {
+    return (STAT.mode == PPU_MODE_MODE2 && !is_almost_mode3(e)) ||
+           STAT.mode == PPU_MODE_MODE3;
+  } else {
+    return STAT.mode2.trigger || STAT.mode == PPU_MODE_MODE2 ||
+           STAT.mode == PPU_MODE_MODE3;
+  }
+}
+
+static u8 read_vram(Emulator* e, MaskedAddress addr) {
+  ppu_synchronize(e);
+  if (is_using_vram(e, FALSE)) {
+    HOOK(read_vram_in_use_a, addr);
+    return INVALID_READ_BYTE;
+  } else {
+    assert(addr <= ADDR_MASK_8K);
+    return VRAM.data[VRAM.offset + addr];
+  }
+}
+
+static u8 read_oam(Emulator* e, MaskedAddress addr) {
+  ppu_synchronize(e);
+  if (is_using_oam(e, FALSE)) {
+    HOOK(read_oam_in_use_a, addr);
+    return INVALID_READ_BYTE;
+  }
+
+  u8 obj_index = addr >> 2;
+  Obj* obj = &OAM[obj_index];
+  switch (addr & 3) {
+    case 0: return obj->y + OBJ_Y_OFFSET;
+    case 1: return obj->x + OBJ_X_OFFSET;
+    case 2: return obj->tile;
+    case 3: return obj->byte3;
+  }
+  UNREACHABLE("invalid OAM address: 0x%04x\n", addr);
+}
+
+static u8 read_joyp_p10_p13(Emulator* e) {
+  if (JOYP.joypad_select == JOYPAD_SELECT_NONE) {
+    return ~(SGB.current_player & 3);
+  }
+  if (SGB.current_player != 0) { return ~0; }  // Ignore other controllers.
+
+  u8 result = 0;
+  if (JOYP.joypad_select == JOYPAD_SELECT_BUTTONS ||
+      JOYP.joypad_select == JOYPAD_SELECT_BOTH) {
+    result |= PACK(JOYP.buttons.start, JOYP_BUTTON_START) |
+              PACK(JOYP.buttons.select, JOYP_BUTTON_SELECT) |
+              PACK(JOYP.buttons.B, JOYP_BUTTON_B) |
+              PACK(JOYP.buttons.A, JOYP_BUTTON_A);
+  }
+
+  Bool left = JOYP.buttons.left;
+  Bool right = JOYP.buttons.right;
+  Bool up = JOYP.buttons.up;
+  Bool down = JOYP.buttons.down;
+  if (!e->config.allow_simulataneous_dpad_opposites) {
+    if (left && right) {
+      left = FALSE;
+    } else if (up && down) {
+      up = FALSE;
+    }
+  }
+
+  if (JOYP.joypad_select == JOYPAD_SELECT_DPAD ||
+      JOYP.joypad_select == JOYPAD_SELECT_BOTH) {
+    result |= PACK(down, JOYP_DPAD_DOWN) | PACK(up, JOYP_DPAD_UP) |
+              PACK(left, JOYP_DPAD_LEFT) | PACK(right, JOYP_DPAD_RIGHT);
+  }
+  /* The bits are low when the buttons are pressed. */
+  return ~result;
+}
+
+static void call_joyp_callback(Emulator* e, Bool wait) {
+  if (e->joypad_info.callback &&
+      (!wait || TICKS - JOYP.last_callback >= JOYP_INTERRUPT_WAIT_TICKS)) {
+    e->joypad_info.callback(&JOYP.buttons, e->joypad_info.user_data);
+    JOYP.last_callback = TICKS;
+  }
+}
+
+static u8 read_io(Emulator* e, MaskedAddress addr) {
+  switch (addr) {
+    case IO_JOYP_ADDR:
+      call_joyp_callback(e, FALSE);
       return JOYP_UNUSED | PACK(JOYP.joypad_select, JOYP_JOYPAD_SELECT) |
              (read_joyp_p10_p13(e) & JOYP_RESULT_MASK);
     case IO_SB_ADDR:
@@ -1942,13 +2810,18 @@ static Bool is_dma_access_ok(Emulator* e, Address addr) {
   return DMA.state != DMA_ACTIVE || (addr & 0xff00) != 0xfe00;
 }
 
+/* Take advantage of the fact that MEMORY_MAP_ROM0 is 0, and ROM1 is 1 when
+ * indexing into rom_base; each has two 8K regions. */
+static u32 get_rom_pair_addr(Emulator* e, MemoryTypeAddressPair pair) {
+  return MMAP_STATE.rom_base[(pair.type << 1) | (pair.addr >> ROM_REGION_SHIFT)] |
+         (pair.addr & ADDR_MASK_8K);
+}
+
 static u8 read_u8_pair(Emulator* e, MemoryTypeAddressPair pair, Bool raw) {
   switch (pair.type) {
-    /* Take advantage of the fact that MEMORY_MAP_ROM9 is 0, and ROM1 is 1 when
-     * indexing into rom_base. */
     case MEMORY_MAP_ROM0:
     case MEMORY_MAP_ROM1: {
-      u32 rom_addr = MMAP_STATE.rom_base[pair.type] | pair.addr;
+      u32 rom_addr = get_rom_pair_addr(e, pair);
       assert(rom_addr < e->cart_info->size);
       u8 value = e->cart_info->data[rom_addr];
       if (!raw) {
@@ -1988,15 +2861,32 @@ static u8 read_u8_raw(Emulator* e, Address addr) {
   return read_u8_pair(e, map_address(addr), TRUE);
 }
 
+/* While OAM DMA copies from ROM or WRAM, reading ROM or HRAM (or writing HRAM)
+ * can neither observe nor change the transfer, so it can be left to catch up
+ * in bulk later (e.g. when the PPU reads OAM, or when it finishes). The
+ * standard DMA routine runs from HRAM, so this is the usual case. */
+static Bool can_defer_dma(Emulator* e, Address addr, Bool write) {
+  Bool source_ok = DMA.source < 0x8000 ||
+                   (DMA.source >= 0xc000 && DMA.source < 0xfe00);
+  Bool addr_ok = (addr >= 0xff80 && addr != 0xffff) || (!write && addr < 0x8000);
+  return source_ok && addr_ok;
+}
+
+static void dma_synchronize_access(Emulator* e, Address addr, Bool write) {
+  if (UNLIKELY(DMA.state != DMA_INACTIVE) && !can_defer_dma(e, addr, write)) {
+    dma_synchronize(e);
+  }
+}
+
 static u8 read_u8(Emulator* e, Address addr) {
-  dma_synchronize(e);
+  dma_synchronize_access(e, addr, FALSE);
   if (UNLIKELY(!is_dma_access_ok(e, addr))) {
     HOOK(read_during_dma_a, addr);
     return INVALID_READ_BYTE;
   }
   if (LIKELY(addr < 0x8000)) {
-    u32 bank = addr >> ROM_BANK_SHIFT;
-    u32 rom_addr = MMAP_STATE.rom_base[bank] | (addr & ADDR_MASK_16K);
+    u32 rom_addr =
+        MMAP_STATE.rom_base[addr >> ROM_REGION_SHIFT] | (addr & ADDR_MASK_8K);
     u8 value = e->cart_info->data[rom_addr];
     HOOK(read_rom_ib, rom_addr, value);
     return value;
@@ -2014,10 +2904,12 @@ static void write_vram(Emulator* e, MaskedAddress addr, u8 value) {
 
   assert(addr <= ADDR_MASK_8K);
   VRAM.data[VRAM.offset + addr] = value;
+  MARK_STATE_BYTES_DIRTY(VRAM, VRAM.offset + addr, 1);
 }
 
 static void write_oam_no_mode_check(Emulator* e, MaskedAddress addr, u8 value) {
   Obj* obj = &OAM[addr >> 2];
+  MARK_STATE_DIRTY(OAM);
   switch (addr & 3) {
     case 0: obj->y = value - OBJ_Y_OFFSET; break;
     case 1: obj->x = value - OBJ_X_OFFSET; break;
@@ -2044,9 +2936,55 @@ static void write_oam(Emulator* e, MaskedAddress addr, u8 value) {
   write_oam_no_mode_check(e, addr, value);
 }
 
-static void calculate_next_intr(Emulator* e) {
-  e->state.next_intr_ticks = MIN(
-      MIN(SERIAL.next_intr_ticks, TIMER.next_intr_ticks), PPU.next_intr_ticks);
+static Bool scheduler_less(Scheduler* scheduler, u32 i, u32 j) {
+  u8 a = scheduler->heap[i], b = scheduler->heap[j];
+  /* Ties are broken by event order, so simultaneous events run in a fixed
+   * order. */
+  return scheduler->ticks[a] < scheduler->ticks[b] ||
+         (scheduler->ticks[a] == scheduler->ticks[b] && a < b);
+}
+
+static void scheduler_swap(Scheduler* scheduler, u32 i, u32 j) {
+  u8 a = scheduler->heap[i], b = scheduler->heap[j];
+  scheduler->heap[i] = b;
+  scheduler->heap[j] = a;
+  scheduler->heap_index[b] = i;
+  scheduler->heap_index[a] = j;
+}
+
+static void scheduler_init(Emulator* e) {
+  u32 i;
+  for (i = 0; i < SCHEDULER_EVENT_COUNT; ++i) {
+    SCHEDULER.ticks[i] = INVALID_TICKS;
+    SCHEDULER.heap[i] = SCHEDULER.heap_index[i] = i;
+  }
+  SCHEDULER.next_ticks = INVALID_TICKS;
+}
+
+static void scheduler_set(Emulator* e, SchedulerEvent event, Ticks ticks) {
+  Scheduler* scheduler = &SCHEDULER;
+  scheduler->ticks[event] = ticks;
+  u32 i = scheduler->heap_index[event];
+  while (i > 0 && scheduler_less(scheduler, i, (i - 1) / 2)) {
+    scheduler_swap(scheduler, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  while (TRUE) {
+    u32 least = i, left = i * 2 + 1, right = i * 2 + 2;
+    if (left < SCHEDULER_EVENT_COUNT && scheduler_less(scheduler, left, least)) {
+      least = left;
+    }
+    if (right < SCHEDULER_EVENT_COUNT &&
+        scheduler_less(scheduler, right, least)) {
+      least = right;
+    }
+    if (least == i) {
+      break;
+    }
+    scheduler_swap(scheduler, i, least);
+    i = least;
+  }
+  scheduler->next_ticks = scheduler->ticks[scheduler->heap[0]];
 }
 
 static Bool is_div_falling_edge(Emulator* e, u16 old_div_counter,
@@ -2055,6 +2993,18 @@ static Bool is_div_falling_edge(Emulator* e, u16 old_div_counter,
   return falling_edge & s_tima_mask[TIMER.clock_select];
 }
 
+/* The number of CPU_TICK increments of |div_counter| until the first falling
+ * edge of the bit selected by TAC. Later edges follow every
+ * get_div_falling_edge_period() increments. */
+static u32 get_div_falling_edge_steps(Emulator* e, u16 div_counter) {
+  u32 period = s_tima_mask[TIMER.clock_select] << 1;
+  return DIV_CEIL(period - (div_counter & (period - 1)), CPU_TICK);
+}
+
+static u32 get_div_falling_edge_period(Emulator* e) {
+  return (s_tima_mask[TIMER.clock_select] << 1) / CPU_TICK;
+}
+
 static void increment_tima(Emulator*);
 
 static void timer_synchronize(Emulator* e) {
@@ -2063,19 +3013,42 @@ static void timer_synchronize(Emulator* e) {
     TIMER.sync_ticks = TICKS;
 
     if (TIMER.on) {
-      Ticks cpu_tick = e->state.cpu_tick;
-      for (; delta_ticks > 0; delta_ticks -= cpu_tick) {
-        if (TIMER.tima_state == TIMA_STATE_OVERFLOW) {
-          INTR.if_ |= (INTR.new_if & IF_TIMER);
-          TIMER.tima = TIMER.tma;
-          TIMER.tima_state = TIMA_STATE_RESET;
-        } else if (TIMER.tima_state == TIMA_STATE_RESET) {
-          TIMER.tima_state = TIMA_STATE_NORMAL;
+      Ticks steps = delta_ticks / e->state.cpu_tick;
+      while (steps > 0) {
+        if (UNLIKELY(TIMER.tima_state != TIMA_STATE_NORMAL)) {
+          /* Step through the overflow delay one tick at a time. */
+          if (TIMER.tima_state == TIMA_STATE_OVERFLOW) {
+            INTR.if_ |= (INTR.new_if & IF_TIMER);
+            TIMER.tima = TIMER.tma;
+            TIMER.tima_state = TIMA_STATE_RESET;
+          } else {
+            TIMER.tima_state = TIMA_STATE_NORMAL;
+          }
+          u16 old_div_counter = TIMER.div_counter;
+          TIMER.div_counter += CPU_TICK;
+          if (is_div_falling_edge(e, old_div_counter, TIMER.div_counter)) {
+            increment_tima(e);
+          }
+          steps--;
+          continue;
         }
-        u16 old_div_counter = TIMER.div_counter;
-        TIMER.div_counter += CPU_TICK;
-        if (is_div_falling_edge(e, old_div_counter, TIMER.div_counter)) {
+
+        /* Count the falling edges over the remaining steps, stopping early if
+         * TIMA overflows. */
+        u32 first = get_div_falling_edge_steps(e, TIMER.div_counter);
+        u32 period = get_div_falling_edge_period(e);
+        Ticks overflow_steps = first + (Ticks)(0xff - TIMER.tima) * period;
+        if (overflow_steps <= steps) {
+          TIMER.div_counter += overflow_steps * CPU_TICK;
+          TIMER.tima = 0xff;
           increment_tima(e);
+          steps -= overflow_steps;
+        } else {
+          if (steps >= first) {
+            TIMER.tima += 1 + (steps - first) / period;
+          }
+          TIMER.div_counter += steps * CPU_TICK;
+          steps = 0;
         }
       }
     } else {
@@ -2096,19 +3069,14 @@ static void calculate_next_timer_intr(Emulator* e) {
       ticks += cpu_tick;
     }
 
-    while (1) {
-      u16 old_div_counter = div_counter;
-      div_counter += CPU_TICK;
-      if (is_div_falling_edge(e, old_div_counter, div_counter) && ++tima == 0) {
-        break;
-      }
-      ticks += cpu_tick;
-    }
-    TIMER.next_intr_ticks = ticks;
+    /* TIMA overflows on the (256 - tima)th falling edge. */
+    u32 steps = get_div_falling_edge_steps(e, div_counter) +
+                (0xff - tima) * get_div_falling_edge_period(e);
+    ticks += (steps - 1) * cpu_tick;
+    scheduler_set(e, SCHEDULER_EVENT_TIMER, ticks);
   } else {
-    TIMER.next_intr_ticks = INVALID_TICKS;
+    scheduler_set(e, SCHEDULER_EVENT_TIMER, INVALID_TICKS);
   }
-  calculate_next_intr(e);
 }
 
 static void do_timer_interrupt(Emulator* e) {
@@ -2328,6 +3296,7 @@ static u16 map_select_to_address(TileMapSelect map_select) {
 
 static void do_sgb(Emulator* e) {
   if (!IS_SGB) { return; }
+  MARK_STATE_DIRTY(SGB);
 
   Bool do_command = FALSE;
 
@@ -2590,6 +3559,42 @@ static void do_sgb(Emulator* e) {
   }
 }
 
+static void set_test_result(Emulator* e, TestResult result) {
+  if (e->test_result == TEST_RESULT_NONE) {
+    e->test_result = result;
+    e->state.event |= EMULATOR_EVENT_TEST_FINISHED;
+  }
+}
+
+/* The test result isn't part of the state, so forget it when a state is
+ * loaded; otherwise the previous run's result would stick. */
+static void reset_test_result(Emulator* e) {
+  e->test_result = TEST_RESULT_NONE;
+  ZERO_MEMORY(e->test_serial_text);
+  e->test_ext_ram_running = FALSE;
+}
+
+static void detect_serial_test_result(Emulator* e, u8 value) {
+  char* text = e->test_serial_text;
+  memmove(text, text + 1, TEST_SERIAL_TEXT_SIZE - 1);
+  text[TEST_SERIAL_TEXT_SIZE - 1] = value;
+  if (memcmp(text, "Passed", TEST_SERIAL_TEXT_SIZE) == 0) {
+    set_test_result(e, TEST_RESULT_PASSED);
+  } else if (memcmp(text, "Failed", TEST_SERIAL_TEXT_SIZE) == 0) {
+    set_test_result(e, TEST_RESULT_FAILED);
+  }
+}
+
+static void detect_ld_b_b_test_result(Emulator* e) {
+  if (REG.B == 3 && REG.C == 5 && REG.D == 8 && REG.E == 13 && REG.H == 21 &&
+      REG.L == 34) {
+    set_test_result(e, TEST_RESULT_PASSED);
+  } else if (REG.B == 0x42 && REG.C == 0x42 && REG.D == 0x42 &&
+             REG.E == 0x42 && REG.H == 0x42 && REG.L == 0x42) {
+    set_test_result(e, TEST_RESULT_FAILED);
+  }
+}
+
 static void write_io(Emulator* e, MaskedAddress addr, u8 value) {
   HOOK(write_io_asb, addr, get_io_reg_string(addr), value);
   switch (addr) {
@@ -2612,8 +3617,19 @@ static void write_io(Emulator* e, MaskedAddress addr, u8 value) {
       if (SERIAL.transferring) {
         SERIAL.tick_count = 0;
         SERIAL.transferred_bits = 0;
+        SERIAL.in_byte = 0xff;
       }
       calculate_next_serial_intr(e);
+      if (SERIAL.transferring && SERIAL.clock == SERIAL_CLOCK_INTERNAL) {
+        if (UNLIKELY(e->config.detect_test_result)) {
+          detect_serial_test_result(e, SERIAL.sb);
+        }
+        if (e->serial_info.callback) {
+          SERIAL.in_byte = e->serial_info.callback(
+              SERIAL.sb, SERIAL.sync_ticks + get_serial_transfer_ticks(e),
+              e->serial_info.user_data);
+        }
+      }
       break;
     case IO_DIV_ADDR:
       timer_synchronize(e);
@@ -2769,6 +3785,7 @@ static void write_io(Emulator* e, MaskedAddress addr, u8 value) {
       DMA.tick_count = 0;
       DMA.state = (DMA.state != DMA_INACTIVE ? DMA.state : DMA_TRIGGERED);
       DMA.source = value << 8;
+      calculate_next_dma_event(e);
       break;
     case IO_BGP_ADDR:
     case IO_OBP0_ADDR:
@@ -2801,6 +3818,7 @@ static void write_io(Emulator* e, MaskedAddress addr, u8 value) {
       if (IS_CGB) {
         VRAM.bank = UNPACK(value, VBK_VRAM_BANK);
         VRAM.offset = VRAM.bank << 13;
+        MARK_STATE_DIRTY(VRAM);
       }
       break;
     case IO_HDMA1_ADDR:
@@ -2880,6 +3898,7 @@ static void write_io(Emulator* e, MaskedAddress addr, u8 value) {
       if (IS_CGB) {
         WRAM.bank = UNPACK(value, SVBK_WRAM_BANK);
         WRAM.offset = WRAM.bank == 0 ? 0x1000 : (WRAM.bank << 12);
+        MARK_STATE_DIRTY(WRAM);
       }
       break;
     case IO_IE_ADDR:
@@ -3046,6 +4065,25 @@ static void write_noise_period(Emulator* e) {
   HOOK(write_noise_period_info_iii, divisor, NOISE.clock_shift, NOISE.period);
 }
 
+static void log_apu_event(Emulator* e, u8 addr, u8 value) {
+  ApuEventLog* log = &e->apu_event_log;
+  /* Writes made while initializing are kept so they can be passed to the
+   * callback once it is set. */
+  if (log->callback || !APU.initialized) {
+    if (log->count == APU_EVENT_CHUNK_SIZE) {
+      if (!log->callback) {
+        return;
+      }
+      emulator_flush_apu_events(e);
+    }
+    ApuEvent* event = &log->events[log->count++];
+    event->ticks = TICKS;
+    event->addr = addr;
+    event->value = value;
+    event->boot = !APU.initialized;
+  }
+}
+
 static void write_apu(Emulator* e, MaskedAddress addr, u8 value) {
   if (e->config.log_apu_writes || !APU.initialized) {
     if (e->apu_log.write_count < MAX_APU_LOG_FRAME_WRITES) {
@@ -3236,7 +4274,15 @@ static void write_apu(Emulator* e, MaskedAddress addr, u8 value) {
   }
 }
 
+/* Only writes from the CPU are logged, not the ones write_apu makes itself
+ * when powering down. */
+static void write_apu_logged(Emulator* e, MaskedAddress addr, u8 value) {
+  log_apu_event(e, addr, value);
+  write_apu(e, addr, value);
+}
+
 static void write_wave_ram(Emulator* e, MaskedAddress addr, u8 value) {
+  log_apu_event(e, APU_EVENT_WAVE_RAM_ADDR + addr, value);
   apu_synchronize(e);
   if (CHANNEL3.status) {
     /* If the wave channel is playing, the byte is written to the sample
@@ -3268,9 +4314,11 @@ static void write_u8_pair(Emulator* e, MemoryTypeAddressPair pair, u8 value) {
       break;
     case MEMORY_MAP_WORK_RAM0:
       WRAM.data[pair.addr] = value;
+      MARK_STATE_BYTES_DIRTY(WRAM, pair.addr, 1);
       break;
     case MEMORY_MAP_WORK_RAM1:
       WRAM.data[WRAM.offset + pair.addr] = value;
+      MARK_STATE_BYTES_DIRTY(WRAM, WRAM.offset + pair.addr, 1);
       break;
     case MEMORY_MAP_OAM:
       write_oam(e, pair.addr, value);
@@ -3281,13 +4329,14 @@ static void write_u8_pair(Emulator* e, MemoryTypeAddressPair pair, u8 value) {
       write_io(e, pair.addr, value);
       break;
     case MEMORY_MAP_APU:
-      write_apu(e, pair.addr, value);
+      write_apu_logged(e, pair.addr, value);
       break;
     case MEMORY_MAP_WAVE_RAM:
       write_wave_ram(e, pair.addr, value);
       break;
     case MEMORY_MAP_HIGH_RAM:
       HRAM[pair.addr] = value;
+      MARK_STATE_DIRTY(HRAM);
       break;
   }
 }
@@ -3297,7 +4346,7 @@ static void write_u8_raw(Emulator* e, Address addr, u8 value) {
 }
 
 static void write_u8(Emulator* e, Address addr, u8 value) {
-  dma_synchronize(e);
+  dma_synchronize_access(e, addr, TRUE);
   if (UNLIKELY(!is_dma_access_ok(e, addr))) {
     HOOK(write_during_dma_ab, addr, value);
     return;
@@ -3701,11 +4750,10 @@ static void calculate_next_ppu_intr(Emulator* e) {
   if (LCDC.display) {
     /* TODO: Looser bounds on sync points. This syncs at every state
      * transition, even though we often won't need to sync that often. */
-    PPU.next_intr_ticks = PPU.sync_ticks + PPU.state_ticks;
+    scheduler_set(e, SCHEDULER_EVENT_PPU, PPU.sync_ticks + PPU.state_ticks);
   } else {
-    PPU.next_intr_ticks = INVALID_TICKS;
+    scheduler_set(e, SCHEDULER_EVENT_PPU, INVALID_TICKS);
   }
-  calculate_next_intr(e);
 }
 
 static void update_sweep(Emulator* e) {
@@ -3777,21 +4825,56 @@ static void update_envelopes(Emulator* e) {
 #define CHANNELX_SAMPLE(channel, sample) \
   (-(sample) & (channel)->envelope.volume)
 
+static u32 popcount_u8(u8 x) {
+  x = x - ((x >> 1) & 0x55);
+  x = (x & 0x33) + ((x >> 2) & 0x33);
+  return (x + (x >> 4)) & 0x0f;
+}
+
+/* Bit N is the sample at duty position N. */
+static const u8 s_duty_mask[WAVE_DUTY_COUNT] = {[WAVE_DUTY_12_5] = 0x80,
+                                                [WAVE_DUTY_25] = 0x81,
+                                                [WAVE_DUTY_50] = 0xe1,
+                                                [WAVE_DUTY_75] = 0x7e};
+
+/* Sums all whole periods at once using the duty mask, then steps into the
+ * final partial period. */
+static void update_square_wave_span(Channel* channel, u32 total_frames) {
+  SquareWave* square = &channel->square_wave;
+  u32 frames = square->ticks / APU_TICKS;
+  channel->accumulator += CHANNELX_SAMPLE(channel, square->sample) * frames;
+  total_frames -= frames;
+
+  u8 mask = s_duty_mask[square->duty];
+  u32 period_frames = MAX(square->period / APU_TICKS, 1);
+  u32 steps = total_frames / period_frames;
+  u32 rest = total_frames % period_frames;
+  u32 start = (square->position + 1) % DUTY_CYCLE_COUNT;
+  u8 rotated = (u8)((mask >> start) | (mask << (DUTY_CYCLE_COUNT - start)));
+  u32 ones = (steps / DUTY_CYCLE_COUNT) * popcount_u8(mask) +
+             popcount_u8(rotated & ((1 << (steps % DUTY_CYCLE_COUNT)) - 1));
+  channel->accumulator += channel->envelope.volume * period_frames * ones;
+  square->position = (square->position + steps + 1) % DUTY_CYCLE_COUNT;
+  square->sample = (mask >> square->position) & 1;
+  square->ticks = square->period - rest * APU_TICKS;
+  channel->accumulator += CHANNELX_SAMPLE(channel, square->sample) * rest;
+}
+
 static void update_square_wave(Channel* channel, u32 total_frames) {
-  static u8 duty[WAVE_DUTY_COUNT][DUTY_CYCLE_COUNT] =
-      {[WAVE_DUTY_12_5] = {0, 0, 0, 0, 0, 0, 0, 1},
-       [WAVE_DUTY_25] = {1, 0, 0, 0, 0, 0, 0, 1},
-       [WAVE_DUTY_50] = {1, 0, 0, 0, 0, 1, 1, 1},
-       [WAVE_DUTY_75] = {0, 1, 1, 1, 1, 1, 1, 0}};
   SquareWave* square = &channel->square_wave;
   if (channel->status) {
+    if (total_frames >= APU_SPAN_MIN_STEPS * (square->ticks / APU_TICKS +
+                                              square->period / APU_TICKS)) {
+      update_square_wave_span(channel, total_frames);
+      return;
+    }
     while (total_frames) {
       u32 frames = square->ticks / APU_TICKS;
       u8 sample = CHANNELX_SAMPLE(channel, square->sample);
       if (frames <= total_frames) {
         square->ticks = square->period;
         square->position = (square->position + 1) % DUTY_CYCLE_COUNT;
-        square->sample = duty[square->duty][square->position];
+        square->sample = (s_duty_mask[square->duty] >> square->position) & 1;
       } else {
         frames = total_frames;
         square->ticks -= frames * APU_TICKS;
@@ -3831,19 +4914,111 @@ static void update_wave(Emulator* e, u32 apu_ticks, u32 total_frames) {
   }
 }
 
+static u16 lfsr_step(u16 lfsr, LfsrWidth width) {
+  u16 bit = (lfsr ^ (lfsr >> 1)) & 1;
+  if (width == LFSR_WIDTH_7) {
+    return ((lfsr >> 1) & ~0x40) | (bit << 6);
+  } else {
+    return ((lfsr >> 1) & ~0x4000) | (bit << 14);
+  }
+}
+
+static void init_lfsr_table(LfsrTable* table, LfsrWidth width, u16 start) {
+  u16 lfsr = start;
+  u32 i;
+  table->ones[0] = 0;
+  for (i = 0; i < table->period; ++i) {
+    table->state[i] = lfsr;
+    table->index[lfsr] = i;
+    table->ones[i + 1] = table->ones[i] + (~lfsr & 1);
+    lfsr = lfsr_step(lfsr, width);
+  }
+  assert(lfsr == start);
+}
+
+/* The tables are shared by every emulator. They are filled by the first
+ * emulator_new or apu_player_new, on the thread that creates emulators, and
+ * only read after that. */
+static void init_lfsr_tables(void) {
+  static Bool s_initialized;
+  if (!s_initialized) {
+    init_lfsr_table(&s_lfsr_table[LFSR_WIDTH_15], LFSR_WIDTH_15, 0x7fff);
+    init_lfsr_table(&s_lfsr_table[LFSR_WIDTH_7], LFSR_WIDTH_7, 0x7f);
+    s_initialized = TRUE;
+  }
+}
+
+/* Steps the LFSR |steps| times, and returns how many of the new states have a
+ * sample of 1. */
+static u32 advance_lfsr(u16* lfsr, LfsrWidth width, u32 steps) {
+  u32 ones = 0;
+  /* In 7-bit mode, the bits above bit 6 are shifted out in the first few
+   * steps; only after that is the LFSR in the 127-step sequence. */
+  if (width == LFSR_WIDTH_7) {
+    while (steps > 0 && (*lfsr & ~0x7f)) {
+      *lfsr = lfsr_step(*lfsr, width);
+      ones += ~*lfsr & 1;
+      steps--;
+    }
+  }
+  if (steps == 0) {
+    return ones;
+  }
+  if (*lfsr == 0) {
+    /* An all-zero LFSR stays that way, always producing a sample of 1. */
+    return ones + steps;
+  }
+  LfsrTable* table = &s_lfsr_table[width];
+  u32 period = table->period;
+  if (steps >= period) {
+    ones += (steps / period) * table->ones[period];
+    steps %= period;
+  }
+  /* Count the states in (index, index + steps], wrapping at the period. */
+  u32 index = table->index[*lfsr];
+  u32 end = index + steps;
+  if (end < period) {
+    ones += table->ones[end + 1] - table->ones[index + 1];
+  } else {
+    end -= period;
+    ones += table->ones[period] - table->ones[index + 1] + table->ones[end + 1];
+  }
+  *lfsr = table->state[end];
+  return ones;
+}
+
+/* Sums all whole periods at once using the LFSR tables, then steps into the
+ * final partial period. */
+static void update_noise_span(Emulator* e, u32 total_frames) {
+  u32 frames = NOISE.ticks / APU_TICKS;
+  CHANNEL4.accumulator += CHANNELX_SAMPLE(&CHANNEL4, NOISE.sample) * frames;
+  total_frames -= frames;
+
+  u32 period_frames = MAX(NOISE.period / APU_TICKS, 1);
+  u32 steps = total_frames / period_frames;
+  u32 rest = total_frames % period_frames;
+  u32 ones = advance_lfsr(&NOISE.lfsr, NOISE.lfsr_width, steps);
+  CHANNEL4.accumulator += CHANNEL4.envelope.volume * period_frames * ones;
+  NOISE.lfsr = lfsr_step(NOISE.lfsr, NOISE.lfsr_width);
+  NOISE.sample = ~NOISE.lfsr & 1;
+  NOISE.ticks = NOISE.period - rest * APU_TICKS;
+  CHANNEL4.accumulator += CHANNELX_SAMPLE(&CHANNEL4, NOISE.sample) * rest;
+}
+
 static void update_noise(Emulator* e, u32 total_frames) {
   if (CHANNEL4.status) {
+    if (NOISE.clock_shift <= NOISE_MAX_CLOCK_SHIFT &&
+        total_frames >= APU_SPAN_MIN_STEPS * (NOISE.ticks / APU_TICKS +
+                                              NOISE.period / APU_TICKS)) {
+      update_noise_span(e, total_frames);
+      return;
+    }
     while (total_frames) {
       u32 frames = NOISE.ticks / APU_TICKS;
       u8 sample = CHANNELX_SAMPLE(&CHANNEL4, NOISE.sample);
       if (NOISE.clock_shift <= NOISE_MAX_CLOCK_SHIFT) {
         if (frames <= total_frames) {
-          u16 bit = (NOISE.lfsr ^ (NOISE.lfsr >> 1)) & 1;
-          if (NOISE.lfsr_width == LFSR_WIDTH_7) {
-            NOISE.lfsr = ((NOISE.lfsr >> 1) & ~0x40) | (bit << 6);
-          } else {
-            NOISE.lfsr = ((NOISE.lfsr >> 1) & ~0x4000) | (bit << 14);
-          }
+          NOISE.lfsr = lfsr_step(NOISE.lfsr, NOISE.lfsr_width);
           NOISE.sample = ~NOISE.lfsr & 1;
           NOISE.ticks = NOISE.period;
         } else {
@@ -3895,6 +5070,20 @@ static void write_audio_frame(Emulator* e, u32 gb_frames) {
 }
 
 static void apu_update_channels(Emulator* e, u32 total_frames) {
+  if (e->config.disable_audio) {
+    /* The channels are still updated, since e.g. the wave position is visible
+     * to the CPU, but there is no need to split at each resampled frame. */
+    update_square_wave(&CHANNEL1, total_frames);
+    update_square_wave(&CHANNEL2, total_frames);
+    update_wave(e, APU.sync_ticks, total_frames);
+    update_noise(e, total_frames);
+    APU.sync_ticks += total_frames * APU_TICKS;
+    int i;
+    for (i = 0; i < APU_CHANNEL_COUNT; ++i) {
+      APU.channel[i].accumulator = 0;
+    }
+    return;
+  }
   while (total_frames) {
     u32 frames = get_gb_frames_until_next_resampled_frame(e);
     frames = MIN(frames, total_frames);
@@ -3939,40 +5128,77 @@ static void apu_synchronize(Emulator* e) {
       apu_update(e, ticks);
       assert(APU.sync_ticks == TICKS);
     } else {
-      for (; ticks; ticks -= APU_TICKS) {
-        write_audio_frame(e, 1);
+      if (!e->config.disable_audio) {
+        for (; ticks; ticks -= APU_TICKS) {
+          write_audio_frame(e, 1);
+        }
       }
       APU.sync_ticks = TICKS;
     }
   }
 }
 
+/* Copies |count| bytes to OAM, starting at |addr_offset|. */
+static void dma_copy(Emulator* e, u8 addr_offset, u8 count) {
+  Address source = DMA.source + addr_offset;
+  MemoryTypeAddressPair pair = map_address(source);
+  const u8* data;
+  u8 i;
+  /* The source never crosses a bank, so ROM and WRAM can be copied directly
+   * from a resolved pointer. */
+  switch (pair.type) {
+    case MEMORY_MAP_ROM0:
+    case MEMORY_MAP_ROM1: {
+      u32 rom_addr = get_rom_pair_addr(e, pair);
+      assert(rom_addr + count <= e->cart_info->size);
+      data = e->cart_info->data + rom_addr;
+      for (i = 0; i < count; ++i) {
+        HOOK(read_rom_ib, rom_addr + i, data[i]);
+      }
+      break;
+    }
+    case MEMORY_MAP_WORK_RAM0:
+      data = WRAM.data + pair.addr;
+      break;
+    case MEMORY_MAP_WORK_RAM1:
+      data = WRAM.data + WRAM.offset + pair.addr;
+      break;
+    default:
+      for (i = 0; i < count; ++i) {
+        u8 value = read_u8_pair(e, map_address(source + i), FALSE);
+        write_oam_no_mode_check(e, addr_offset + i, value);
+      }
+      return;
+  }
+
+  for (i = 0; i < count; ++i) {
+    write_oam_no_mode_check(e, addr_offset + i, data[i]);
+  }
+}
+
 static void dma_synchronize(Emulator* e) {
   if (UNLIKELY(DMA.state != DMA_INACTIVE)) {
     if (TICKS > DMA.sync_ticks) {
       Ticks delta_ticks = TICKS - DMA.sync_ticks;
       DMA.sync_ticks = TICKS;
 
-      Ticks cpu_tick = e->state.cpu_tick;
-      for (; delta_ticks > 0; delta_ticks -= cpu_tick) {
-        if (DMA.tick_count < DMA_DELAY_TICKS) {
-          DMA.tick_count += CPU_TICK;
-          if (DMA.tick_count >= DMA_DELAY_TICKS) {
-            DMA.tick_count = DMA_DELAY_TICKS;
-            DMA.state = DMA_ACTIVE;
-          }
-          continue;
+      Ticks steps = delta_ticks / e->state.cpu_tick;
+      for (; steps > 0 && DMA.tick_count < DMA_DELAY_TICKS; --steps) {
+        DMA.tick_count += CPU_TICK;
+        if (DMA.tick_count >= DMA_DELAY_TICKS) {
+          DMA.tick_count = DMA_DELAY_TICKS;
+          DMA.state = DMA_ACTIVE;
         }
+      }
 
+      if (steps > 0) {
         u8 addr_offset = (DMA.tick_count - DMA_DELAY_TICKS) >> 2;
         assert(addr_offset < OAM_TRANSFER_SIZE);
-        u8 value =
-            read_u8_pair(e, map_address(DMA.source + addr_offset), FALSE);
-        write_oam_no_mode_check(e, addr_offset, value);
-        DMA.tick_count += CPU_TICK;
+        u8 count = (u8)MIN(steps, (Ticks)(OAM_TRANSFER_SIZE - addr_offset));
+        dma_copy(e, addr_offset, count);
+        DMA.tick_count += count * CPU_TICK;
         if (VALUE_WRAPPED(DMA.tick_count, DMA_TICKS)) {
           DMA.state = DMA_INACTIVE;
-          break;
         }
       }
     }
@@ -4003,35 +5229,120 @@ static void hdma_copy_byte(Emulator* e) {
   }
 }
 
+/* Updates the block count after copying |bytes| bytes, as hdma_copy_byte
+ * does one byte at a time. */
+static void hdma_finish_bytes(Emulator* e, u32 bytes) {
+  bytes += HDMA.block_bytes;
+  HDMA.blocks -= bytes / 16;
+  HDMA.block_bytes = bytes % 16;
+  if (bytes >= 16 &&
+      (HDMA.mode == HDMA_TRANSFER_MODE_HDMA || HDMA.blocks == 0xff)) {
+    HDMA.state = DMA_INACTIVE;
+  }
+}
+
+/* Copies |bytes| bytes to VRAM, a run at a time; a run never crosses a 4K
+ * source boundary (so the source is in one bank) or the end of VRAM. */
+static void hdma_copy_bytes(Emulator* e, u32 bytes) {
+  while (bytes > 0) {
+    MemoryTypeAddressPair source_pair = map_hdma_source_address(HDMA.source);
+    MaskedAddress dest = HDMA.dest & ADDR_MASK_8K;
+    u32 count = MIN(bytes, 0x1000u - (HDMA.source & ADDR_MASK_4K));
+    count = MIN(count, (u32)ADDR_MASK_8K + 1 - dest);
+    u8* dest_data = VRAM.data + VRAM.offset + dest;
+    MARK_STATE_BYTES_DIRTY(VRAM, VRAM.offset + dest, count);
+    const u8* source_data = NULL;
+    u32 i;
+    switch (source_pair.type) {
+      case MEMORY_MAP_ROM0:
+      case MEMORY_MAP_ROM1: {
+        u32 rom_addr = get_rom_pair_addr(e, source_pair);
+        source_data = e->cart_info->data + rom_addr;
+        for (i = 0; i < count; ++i) {
+          HOOK(read_rom_ib, rom_addr + i, source_data[i]);
+        }
+        break;
+      }
+      case MEMORY_MAP_WORK_RAM0:
+        source_data = WRAM.data + source_pair.addr;
+        break;
+      case MEMORY_MAP_WORK_RAM1:
+        source_data = WRAM.data + WRAM.offset + source_pair.addr;
+        break;
+      case MEMORY_MAP_VRAM:
+        /* See hdma_copy_byte. */
+        memset(dest_data, INVALID_READ_BYTE, count);
+        break;
+      default:
+        for (i = 0; i < count; ++i) {
+          dest_data[i] = read_u8_pair(
+              e, map_hdma_source_address(HDMA.source + i), FALSE);
+        }
+        break;
+    }
+    if (source_data) {
+      memcpy(dest_data, source_data, count);
+    }
+    HDMA.source += count;
+    HDMA.dest += count;
+    bytes -= count;
+  }
+}
+
+/* The internal clock runs twice as fast in CGB double speed mode. */
+static Ticks get_serial_bit_ticks(Emulator* e) {
+  return CPU_SPEED.speed == SPEED_NORMAL ? SERIAL_TICKS : SERIAL_TICKS / 2;
+}
+
+static Ticks get_serial_transfer_ticks(Emulator* e) {
+  return get_serial_bit_ticks(e) * 8;
+}
+
 static void calculate_next_serial_intr(Emulator* e) {
-  if (!SERIAL.transferring || SERIAL.clock != SERIAL_CLOCK_INTERNAL) {
-    SERIAL.next_intr_ticks = INVALID_TICKS;
-    calculate_next_intr(e);
+  if (!SERIAL.transferring) {
+    scheduler_set(e, SCHEDULER_EVENT_SERIAL, INVALID_TICKS);
+    return;
+  }
+  if (SERIAL.clock == SERIAL_CLOCK_EXTERNAL) {
+    /* Only the other end of the link can complete this transfer. */
+    scheduler_set(e, SCHEDULER_EVENT_SERIAL, SERIAL.receive_ticks);
     return;
   }
 
   /* Should only be called when receiving a new byte. */
   assert(SERIAL.tick_count == 0);
   assert(SERIAL.transferred_bits == 0);
-  SERIAL.next_intr_ticks =
-      SERIAL.sync_ticks +
-      SERIAL_TICKS * (CPU_SPEED.speed == SPEED_NORMAL ? 8 : 4);
-  calculate_next_intr(e);
+  scheduler_set(e, SCHEDULER_EVENT_SERIAL,
+                SERIAL.sync_ticks + get_serial_transfer_ticks(e));
 }
 
 static void serial_synchronize(Emulator* e) {
+  if (UNLIKELY(TICKS >= SERIAL.receive_ticks)) {
+    if (SERIAL.transferring && SERIAL.clock == SERIAL_CLOCK_EXTERNAL) {
+      SERIAL.sb = SERIAL.receive_byte;
+      SERIAL.transferring = 0;
+      INTR.new_if |= IF_SERIAL;
+      if (TICKS > SERIAL.receive_ticks) {
+        INTR.if_ |= IF_SERIAL;
+      }
+      calculate_next_serial_intr(e);
+    }
+    SERIAL.receive_ticks = INVALID_TICKS;
+  }
   if (TICKS > SERIAL.sync_ticks) {
     Ticks delta_ticks = TICKS - SERIAL.sync_ticks;
 
     if (UNLIKELY(SERIAL.transferring &&
                  SERIAL.clock == SERIAL_CLOCK_INTERNAL)) {
       Ticks cpu_tick = e->state.cpu_tick;
+      Ticks bit_ticks = get_serial_bit_ticks(e);
       for (; delta_ticks > 0; delta_ticks -= cpu_tick) {
         SERIAL.tick_count += cpu_tick;
-        if (VALUE_WRAPPED(SERIAL.tick_count, SERIAL_TICKS)) {
-          /* Since we're never connected to another device, always shift in
-           * 0xff. */
-          SERIAL.sb = (SERIAL.sb << 1) | 1;
+        if (VALUE_WRAPPED(SERIAL.tick_count, bit_ticks)) {
+          /* in_byte is 0xff unless something is on the other end of the
+           * link. */
+          SERIAL.sb = (SERIAL.sb << 1) |
+                      ((SERIAL.in_byte >> (7 - SERIAL.transferred_bits)) & 1);
           SERIAL.transferred_bits++;
           if (VALUE_WRAPPED(SERIAL.transferred_bits, 8)) {
             SERIAL.transferring = 0;
@@ -4049,6 +5360,63 @@ static void serial_synchronize(Emulator* e) {
   }
 }
 
+/* Blargg's newer tests also report through ext RAM: the signature DE B0 61 at
+ * $A001, and a status at $A000 that is $80 while running and then the result
+ * code, 0 for success. */
+static void detect_ext_ram_test_result(Emulator* e) {
+  u8* data = EXT_RAM.data;
+  if (EXT_RAM.size < 4 || data[1] != 0xde || data[2] != 0xb0 ||
+      data[3] != 0x61) {
+    return;
+  }
+  if (data[0] == 0x80) {
+    e->test_ext_ram_running = TRUE;
+  } else if (e->test_ext_ram_running) {
+    set_test_result(e, data[0] == 0 ? TEST_RESULT_PASSED : TEST_RESULT_FAILED);
+  }
+}
+
+static void calculate_next_dma_event(Emulator* e) {
+  if (DMA.state != DMA_INACTIVE) {
+    scheduler_set(e, SCHEDULER_EVENT_DMA,
+                  DMA.sync_ticks + (DMA_TICKS - DMA.tick_count) / CPU_TICK *
+                                       e->state.cpu_tick);
+  } else {
+    scheduler_set(e, SCHEDULER_EVENT_DMA, INVALID_TICKS);
+  }
+}
+
+static void calculate_next_apu_event(Emulator* e) {
+  scheduler_set(e, SCHEDULER_EVENT_APU,
+                APU.sync_ticks +
+                    NEXT_MODULO(APU.sync_ticks, FRAME_SEQUENCER_TICKS));
+}
+
+static void scheduler_dispatch(Emulator* e) {
+  while (TICKS >= SCHEDULER.next_ticks) {
+    SchedulerEvent event = SCHEDULER.heap[0];
+    switch (event) {
+      case SCHEDULER_EVENT_TIMER: timer_synchronize(e); break;
+      case SCHEDULER_EVENT_SERIAL: serial_synchronize(e); break;
+      case SCHEDULER_EVENT_PPU: ppu_synchronize(e); break;
+      case SCHEDULER_EVENT_DMA:
+        dma_synchronize(e);
+        calculate_next_dma_event(e);
+        break;
+      case SCHEDULER_EVENT_APU:
+        apu_synchronize(e);
+        calculate_next_apu_event(e);
+        break;
+      default: assert(0); break;
+    }
+    /* An event that hasn't happened yet (e.g. the TIMA overflow is still one
+     * tick away) is checked again before the next instruction. */
+    if (SCHEDULER.ticks[event] <= TICKS) {
+      scheduler_set(e, event, TICKS + 1);
+    }
+  }
+}
+
 static void tick(Emulator* e) {
   INTR.if_ = INTR.new_if;
   TICKS += e->state.cpu_tick;
@@ -4336,16 +5704,8 @@ static void execute_instruction(Emulator* e) {
   u16 u16;
   Address new_pc;
 
-  if (UNLIKELY(TICKS >= e->state.next_intr_ticks)) {
-    if (TICKS >= TIMER.next_intr_ticks) {
-      timer_synchronize(e);
-    }
-    if (TICKS >= SERIAL.next_intr_ticks) {
-      serial_synchronize(e);
-    }
-    if (TICKS >= PPU.next_intr_ticks) {
-      ppu_synchronize(e);
-    }
+  if (UNLIKELY(TICKS >= SCHEDULER.next_ticks)) {
+    scheduler_dispatch(e);
   }
 
   Bool should_dispatch = FALSE;
@@ -4514,7 +5874,18 @@ static void execute_instruction(Emulator* e) {
     case 0x3d: DEC_R(A); break;
     case 0x3e: LD_R_N(A); break;
     case 0x3f: CCF; break;
-    LD_R_OPS(0x40, B)
+    case 0x40:
+      if (UNLIKELY(e->config.detect_test_result)) {
+        detect_ld_b_b_test_result(e);
+      }
+      break;
+    case 0x41: LD_R_R(B, C); break;
+    case 0x42: LD_R_R(B, D); break;
+    case 0x43: LD_R_R(B, E); break;
+    case 0x44: LD_R_R(B, H); break;
+    case 0x45: LD_R_R(B, L); break;
+    case 0x46: LD_R_MR(B, HL); break;
+    case 0x47: LD_R_R(B, A); break;
     LD_R_OPS(0x48, C)
     LD_R_OPS(0x50, D)
     LD_R_OPS(0x58, E)
@@ -4636,7 +6007,51 @@ static void execute_instruction(Emulator* e) {
   REG.PC = new_pc;
 }
 
-static void emulator_step_internal(Emulator* e) {
+/* Runs HDMA until it finishes, |until_ticks| is reached, or the PPU changes
+ * state, whichever is first. The CPU is stalled, and the PPU mode can't
+ * change within that span, so either every write to VRAM lands (and nothing
+ * reads VRAM), or every write is dropped in mode 3. Either way the bytes can
+ * be handled in bulk, with the same result as calling hdma_copy_byte twice
+ * per tick. */
+static void hdma_run(Emulator* e, Ticks until_ticks) {
+  Ticks cpu_tick = e->state.cpu_tick;
+  u32 bytes = 16 - HDMA.block_bytes;
+  if (HDMA.mode == HDMA_TRANSFER_MODE_GDMA) {
+    bytes += HDMA.blocks * 16;
+  }
+  u32 steps = bytes / 2;
+  ppu_synchronize(e);
+  /* Stop before the step that reaches the next PPU state change. */
+  Ticks ppu_ticks = SCHEDULER.ticks[SCHEDULER_EVENT_PPU];
+  if (ppu_ticks != INVALID_TICKS) {
+    steps = ppu_ticks > TICKS + cpu_tick
+                ? MIN(steps, (ppu_ticks - TICKS - 1) / cpu_tick)
+                : 0;
+  }
+  if (until_ticks > TICKS) {
+    steps = MIN(steps, DIV_CEIL(until_ticks - TICKS, cpu_tick));
+  }
+
+  if (steps == 0) {
+    tick(e);
+    hdma_copy_byte(e);
+    hdma_copy_byte(e);
+    return;
+  }
+
+  TICKS += steps * cpu_tick;
+  INTR.if_ = INTR.new_if;
+  if (LIKELY(!is_using_vram(e, TRUE))) {
+    hdma_copy_bytes(e, steps * 2);
+  } else {
+    HDMA.source += steps * 2;
+    HDMA.dest += steps * 2;
+  }
+  hdma_finish_bytes(e, steps * 2);
+  ppu_synchronize(e);
+}
+
+static void emulator_step_internal(Emulator* e, Ticks until_ticks) {
   if (HDMA.state == DMA_INACTIVE) {
     if (HOOK0_FALSE(emulator_step)) {
       return;
@@ -4648,27 +6063,28 @@ static void emulator_step_internal(Emulator* e) {
     }
 #endif
   } else {
-    tick(e);
-    hdma_copy_byte(e);
-    hdma_copy_byte(e);
+    hdma_run(e, until_ticks);
   }
 }
 
 EmulatorEvent emulator_run_until(Emulator* e, Ticks until_ticks) {
   AudioBuffer* ab = &e->audio_buffer;
   if (e->state.event & EMULATOR_EVENT_AUDIO_BUFFER_FULL) {
-    ab->position = ab->data;
+    emulator_reset_audio_buffer(e);
   }
   check_joyp_intr(e);
   e->state.event = 0;
 
-  u64 frames_left = ab->frames - audio_buffer_get_frames(ab);
-  Ticks max_audio_ticks =
-      APU.sync_ticks +
-      (u32)DIV_CEIL(frames_left * CPU_TICKS_PER_SECOND, ab->frequency);
+  Ticks max_audio_ticks = INVALID_TICKS;
+  if (!e->config.disable_audio) {
+    u64 frames_left = ab->frames - audio_buffer_get_frames(ab);
+    max_audio_ticks =
+        APU.sync_ticks +
+        (u32)DIV_CEIL(frames_left * CPU_TICKS_PER_SECOND, ab->frequency);
+  }
   Ticks check_ticks = MIN(until_ticks, max_audio_ticks);
   while (e->state.event == 0 && TICKS < check_ticks) {
-    emulator_step_internal(e);
+    emulator_step_internal(e, check_ticks);
   }
   if (TICKS >= max_audio_ticks) {
     e->state.event |= EMULATOR_EVENT_AUDIO_BUFFER_FULL;
@@ -4676,6 +6092,10 @@ EmulatorEvent emulator_run_until(Emulator* e, Ticks until_ticks) {
   if (TICKS >= until_ticks) {
     e->state.event |= EMULATOR_EVENT_UNTIL_TICKS;
   }
+  if (UNLIKELY(e->config.detect_test_result) &&
+      (e->state.event & EMULATOR_EVENT_NEW_FRAME)) {
+    detect_ext_ram_test_result(e);
+  }
   apu_synchronize(e);
   return e->state.event;
 }
@@ -4763,15 +6183,39 @@ static void randomize_buffer(u32* seed, u8* buffer, u32 size) {
   }
 }
 
-Result init_emulator(Emulator* e, const EmulatorInit* init) {
+/* Sets up the APU as the boot ROM leaves it. Shared with ApuPlayer, so it
+ * starts from the same state. */
+static void init_apu(Emulator* e) {
   static u8 s_initial_wave_ram[WAVE_RAM_SIZE] = {
       0x60, 0x0d, 0xda, 0xdd, 0x50, 0x0f, 0xad, 0xed,
       0xc0, 0xde, 0xf0, 0x0d, 0xbe, 0xef, 0xfe, 0xed,
   };
-  CHECK(SUCCESS(get_cart_infos(e)));
+  /* Enable apu first, so subsequent writes succeed. */
+  write_apu_logged(e, APU_NR52_ADDR, 0xf1);
+  write_apu_logged(e, APU_NR11_ADDR, 0x80);
+  write_apu_logged(e, APU_NR12_ADDR, 0xf3);
+  write_apu_logged(e, APU_NR14_ADDR, 0x80);
+  write_apu_logged(e, APU_NR50_ADDR, 0x77);
+  write_apu_logged(e, APU_NR51_ADDR, 0xf3);
+  memcpy(&WAVE.ram, s_initial_wave_ram, WAVE_RAM_SIZE);
+  int i;
+  for (i = 0; i < WAVE_RAM_SIZE; ++i) {
+    log_apu_event(e, APU_EVENT_WAVE_RAM_ADDR + i, s_initial_wave_ram[i]);
+  }
+  APU.initialized = TRUE;
+  /* Turn down the volume on channel1, it is playing by default (because of the
+   * GB startup sound), but we don't want to hear it when starting the
+   * emulator. */
+  CHANNEL1.envelope.volume = 0;
+}
+
+Result init_emulator(Emulator* e, const EmulatorInit* init) {
+  set_cart_info(e, e->rom->cart_info_index);
   log_cart_info(e->cart_info);
-  MMAP_STATE.rom_base[0] = 0;
-  MMAP_STATE.rom_base[1] = 1 << ROM_BANK_SHIFT;
+  int i;
+  for (i = 0; i < ROM_REGION_COUNT; ++i) {
+    MMAP_STATE.rom_base[i] = i << ROM_REGION_SHIFT;
+  }
   IS_CGB = !init->force_dmg && (e->cart_info->cgb_flag == CGB_FLAG_SUPPORTED ||
                                 e->cart_info->cgb_flag == CGB_FLAG_REQUIRED);
   IS_SGB = !init->force_dmg && !IS_CGB &&
@@ -4785,22 +6229,11 @@ Result init_emulator(Emulator* e, const EmulatorInit* init) {
   REG.PC = 0x0100;
   INTR.ime = FALSE;
   TIMER.div_counter = 0xAC00;
-  TIMER.next_intr_ticks = SERIAL.next_intr_ticks = e->state.next_intr_ticks =
-      INVALID_TICKS;
+  scheduler_init(e);
+  SERIAL.in_byte = 0xff;
+  SERIAL.receive_ticks = INVALID_TICKS;
   WRAM.offset = 0x1000;
-  /* Enable apu first, so subsequent writes succeed. */
-  write_apu(e, APU_NR52_ADDR, 0xf1);
-  write_apu(e, APU_NR11_ADDR, 0x80);
-  write_apu(e, APU_NR12_ADDR, 0xf3);
-  write_apu(e, APU_NR14_ADDR, 0x80);
-  write_apu(e, APU_NR50_ADDR, 0x77);
-  write_apu(e, APU_NR51_ADDR, 0xf3);
-  APU.initialized = TRUE;
-  memcpy(&WAVE.ram, s_initial_wave_ram, WAVE_RAM_SIZE);
-  /* Turn down the volume on channel1, it is playing by default (because of the
-   * GB startup sound), but we don't want to hear it when starting the
-   * emulator. */
-  CHANNEL1.envelope.volume = 0;
+  init_apu(e);
   write_io(e, IO_LCDC_ADDR, 0x91);
   write_io(e, IO_SCY_ADDR, 0x00);
   write_io(e, IO_SCX_ADDR, 0x00);
@@ -4838,9 +6271,11 @@ Result init_emulator(Emulator* e, const EmulatorInit* init) {
   randomize_buffer(&random_seed, e->state.hram, HIGH_RAM_SIZE);
 
   e->state.cpu_tick = CPU_TICK;
+  mark_all_state_dirty(e);
+  reset_mapper(e);
   calculate_next_ppu_intr(e);
+  calculate_next_apu_event(e);
   return OK;
-  ON_ERROR_RETURN;
 }
 
 void emulator_set_joypad_buttons(Emulator* e, JoypadButtons* buttons) {
@@ -4865,6 +6300,10 @@ EmulatorConfig emulator_get_config(Emulator* e) {
   return e->config;
 }
 
+TestResult emulator_get_test_result(Emulator* e) {
+  return e->test_result;
+}
+
 FrameBuffer* emulator_get_frame_buffer(Emulator* e) {
   return &e->frame_buffer;
 }
@@ -4877,10 +6316,18 @@ AudioBuffer* emulator_get_audio_buffer(Emulator* e) {
   return &e->audio_buffer;
 }
 
+void emulator_reset_audio_buffer(Emulator* e) {
+  e->audio_buffer.position = e->audio_buffer.data;
+}
+
 Ticks emulator_get_ticks(Emulator* e) {
   return TICKS;
 }
 
+Bool emulator_is_cgb(Emulator* e) {
+  return IS_CGB;
+}
+
 u32 emulator_get_ppu_frame(Emulator* e) {
   return PPU.frame;
 }
@@ -4901,14 +6348,46 @@ void emulator_set_all_bw_palettes(Emulator* e, const PaletteRGBA* palette) {
   e->color_to_rgba[PALETTE_TYPE_OBP1] = *palette;
 }
 
-static Result set_rom_file_data(Emulator* e, const FileData* file_data) {
+EmulatorRom* emulator_rom_new(const FileData* file_data,
+                              EmulatorRomFreeCallback free_data) {
+  EmulatorRom* rom = xcalloc(1, sizeof(EmulatorRom));
+  rom->file_data = *file_data;
+  rom->free_data = free_data;
+  rom->ref_count = 1;
   CHECK_MSG(file_data->size > 0, "File is empty.\n");
   CHECK_MSG((file_data->size & (MINIMUM_ROM_SIZE - 1)) == 0,
             "File size (%ld) should be a multiple of minimum rom size (%ld).\n",
             (long)file_data->size, (long)MINIMUM_ROM_SIZE);
-  e->file_data = *file_data;
-  return OK;
-  ON_ERROR_RETURN;
+  CHECK(SUCCESS(get_cart_infos(rom)));
+  return rom;
+error:
+  emulator_rom_unref(rom);
+  return NULL;
+}
+
+EmulatorRom* emulator_rom_ref(EmulatorRom* rom) {
+  rom->ref_count++;
+  return rom;
+}
+
+void emulator_rom_unref(EmulatorRom* rom) {
+  if (!rom || --rom->ref_count > 0) {
+    return;
+  }
+  if (rom->free_data) {
+    rom->free_data(&rom->file_data);
+  } else {
+    file_data_delete(&rom->file_data);
+  }
+  xfree(rom);
+}
+
+const FileData* emulator_rom_get_file_data(EmulatorRom* rom) {
+  return &rom->file_data;
+}
+
+EmulatorRom* emulator_get_rom(Emulator* e) {
+  return e->rom;
 }
 
 Bool emulator_was_ext_ram_updated(Emulator* e) {
@@ -4917,27 +6396,290 @@ Bool emulator_was_ext_ram_updated(Emulator* e) {
   return result;
 }
 
-void emulator_init_state_file_data(FileData* file_data) {
-  file_data->size = sizeof(EmulatorState);
+static u32 read_u32_le(const u8* src) {
+  return src[0] | (src[1] << 8) | (src[2] << 16) | ((u32)src[3] << 24);
+}
+
+static void write_u32_le(u8* dst, u32 value) {
+  dst[0] = value;
+  dst[1] = value >> 8;
+  dst[2] = value >> 16;
+  dst[3] = value >> 24;
+}
+
+/* MMM01 can switch to a cart with a different ext RAM size, so always save
+ * all of it; that way the state size never changes while running. */
+static size_t get_state_ext_ram_size(Emulator* e) {
+  CartInfo* first = &e->rom->cart_infos[e->rom->cart_info_index];
+  if (s_cart_type_info[first->cart_type].mbc_type == MBC_TYPE_MMM01) {
+    return EXT_RAM_MAX_SIZE;
+  }
+  return EXT_RAM.size;
+}
+
+static size_t get_state_section_size(Emulator* e, StateSection section) {
+  if (section == STATE_SECTION_XRAM) {
+    return get_state_ext_ram_size(e);
+  }
+  return s_state_sections[section].size;
+}
+
+static int find_state_section(u32 tag) {
+  int i;
+  for (i = 0; i < STATE_SECTION_COUNT; ++i) {
+    if (s_state_sections[i].tag == tag) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+size_t emulator_get_state_size(Emulator* e) {
+  size_t size = SAVE_STATE_HEADER_SIZE;
+  int i;
+  for (i = 0; i < STATE_SECTION_COUNT; ++i) {
+    size += SAVE_STATE_SECTION_HEADER_SIZE + get_state_section_size(e, i);
+  }
+  return size;
+}
+
+void emulator_init_state_file_data(Emulator* e, FileData* file_data) {
+  file_data->size = emulator_get_state_size(e);
   file_data->data = xmalloc(file_data->size);
 }
 
 void emulator_init_ext_ram_file_data(Emulator* e, FileData* file_data) {
-  file_data->size = EXT_RAM.size;
+  file_data->size = EXT_RAM.size + (has_rtc(e) ? RTC_FOOTER_SIZE : 0);
   file_data->data = xmalloc(file_data->size);
 }
 
-Result emulator_read_state(Emulator* e, const FileData* file_data) {
-  CHECK_MSG(file_data->size == sizeof(EmulatorState),
-            "save state file is wrong size: %ld, expected %ld.\n",
-            (long)file_data->size, (long)sizeof(EmulatorState));
-  EmulatorState* new_state = (EmulatorState*)file_data->data;
-  CHECK_MSG(new_state->header == SAVE_STATE_HEADER,
-            "header mismatch: %u, expected %u.\n", new_state->header,
-            SAVE_STATE_HEADER);
-  memcpy(&e->state, new_state, sizeof(EmulatorState));
-  set_cart_info(e, e->state.cart_info_index);
+u32 emulator_get_dirty_state_sections(Emulator* e) {
+  return (e->dirty_state_sections | ~STATE_SECTIONS_TRACKED) &
+         STATE_SECTIONS_ALL;
+}
+
+void emulator_clear_dirty_state_sections(Emulator* e) {
+  size_t i;
+  for (i = 0; i < ARRAY_SIZE(e->hash_stale_pages); ++i) {
+    e->hash_stale_pages[i] |= e->dirty_state_pages[i];
+  }
+  e->hash_stale_sections |= e->dirty_state_sections;
+  e->dirty_state_sections = 0;
+  ZERO_MEMORY(e->dirty_state_pages);
+}
+
+static void mark_file_pages_dirty(u32* dirty_pages, size_t offset,
+                                  size_t size) {
+  size_t page = offset >> STATE_PAGE_SHIFT;
+  size_t last_page = (offset + size - 1) >> STATE_PAGE_SHIFT;
+  for (; page <= last_page; ++page) {
+    dirty_pages[page >> 5] |= 1u << (page & 31);
+  }
+}
+
+/* Copies |size| bytes of the current state at |state_offset| to
+ * |file_offset|. */
+static void update_state_bytes(Emulator* e, FileData* file_data,
+                               u32* dirty_pages, size_t file_offset,
+                               size_t state_offset, size_t size) {
+  if (size > 0) {
+    memcpy(file_data->data + file_offset, (u8*)&e->state + state_offset, size);
+    mark_file_pages_dirty(dirty_pages, file_offset, size);
+  }
+}
+
+static u32 get_state_first_page(StateSection section) {
+  switch (section) {
+    case STATE_SECTION_VRAM: return STATE_VRAM_FIRST_PAGE;
+    case STATE_SECTION_WRAM: return STATE_WRAM_FIRST_PAGE;
+    case STATE_SECTION_XRAM: return STATE_XRAM_FIRST_PAGE;
+    default: return STATE_PAGE_COUNT;
+  }
+}
+
+static size_t get_state_page_data_size(StateSection section) {
+  switch (section) {
+    case STATE_SECTION_VRAM: return VIDEO_RAM_SIZE;
+    case STATE_SECTION_WRAM: return WORK_RAM_SIZE;
+    case STATE_SECTION_XRAM: return EXT_RAM_MAX_SIZE;
+    default: return 0;
+  }
+}
 
+size_t emulator_get_state_page_count(Emulator* e) {
+  return DIV_CEIL(emulator_get_state_size(e), EMULATOR_STATE_PAGE_SIZE);
+}
+
+Result emulator_update_state(Emulator* e, FileData* file_data,
+                             u32* dirty_pages) {
+  CHECK_MSG(file_data->size == emulator_get_state_size(e),
+            "save state is wrong size: %ld, expected %ld.\n",
+            (long)file_data->size, (long)emulator_get_state_size(e));
+  u32 sections = emulator_get_dirty_state_sections(e);
+  size_t file_offset = SAVE_STATE_HEADER_SIZE;
+  int i;
+  for (i = 0; i < STATE_SECTION_COUNT; ++i) {
+    const StateSectionInfo* info = &s_state_sections[i];
+    size_t size = get_state_section_size(e, i);
+    file_offset += SAVE_STATE_SECTION_HEADER_SIZE;
+    if (sections & (1u << i)) {
+      u32 first_page = get_state_first_page(i);
+      if (first_page == STATE_PAGE_COUNT) {
+        update_state_bytes(e, file_data, dirty_pages, file_offset,
+                           info->offset, size);
+      } else {
+        /* The data comes first, then any other fields (e.g. the bank). */
+        size_t data_size = MIN(size, get_state_page_data_size(i));
+        size_t offset;
+        for (offset = 0; offset < data_size; offset += STATE_PAGE_SIZE) {
+          u32 page = first_page + (offset >> STATE_PAGE_SHIFT);
+          if (e->dirty_state_pages[page >> 5] & (1u << (page & 31))) {
+            update_state_bytes(e, file_data, dirty_pages, file_offset + offset,
+                               info->offset + offset,
+                               MIN(STATE_PAGE_SIZE, data_size - offset));
+          }
+        }
+        update_state_bytes(e, file_data, dirty_pages, file_offset + data_size,
+                           info->offset + data_size, size - data_size);
+      }
+    }
+    file_offset += size;
+  }
+  emulator_clear_dirty_state_sections(e);
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+/* These hold what the last emulator_run_until returned, and whether the host
+ * has seen the latest ext RAM writes, which depend on how the caller runs
+ * the emulator rather than on what was emulated. */
+#define STATE_SECTIONS_UNHASHED \
+  ((1u << STATE_SECTION_EVENT) | (1u << STATE_SECTION_EXT_RAM_UPDATED))
+
+#define STATE_HASH_SEED 0xcbf29ce484222325ull
+#define STATE_HASH_MULTIPLIER 0x9e3779b97f4a7c15ull
+
+static inline u64 hash_mix(u64 hash, u64 value) {
+  hash = ((hash << 5) | (hash >> 59)) ^ value;
+  return hash * STATE_HASH_MULTIPLIER;
+}
+
+/* Eight bytes at a time; the last partial word is zero-padded. */
+static u64 hash_bytes(u64 hash, const u8* data, size_t size) {
+  u64 word;
+  for (; size >= sizeof(word); data += sizeof(word), size -= sizeof(word)) {
+    memcpy(&word, data, sizeof(word));
+    hash = hash_mix(hash, word);
+  }
+  if (size > 0) {
+    word = 0;
+    memcpy(&word, data, size);
+    hash = hash_mix(hash, word);
+  }
+  return hash;
+}
+
+static u64 hash_finish(u64 hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  return hash ^ (hash >> 33);
+}
+
+static u64 hash_state_section(Emulator* e, StateSection section,
+                              const u32* stale_pages) {
+  const u8* data = (const u8*)&e->state + s_state_sections[section].offset;
+  size_t size = get_state_section_size(e, section);
+  u32 first_page = get_state_first_page(section);
+  if (section == STATE_SECTION_JOYP) {
+    /* The joypad callback is also called at the start of every
+     * emulator_run_until, so leave out when it was last called. */
+    Joypad joyp;
+    memcpy(&joyp, data, sizeof(joyp));
+    joyp.last_callback = 0;
+    return hash_bytes(STATE_HASH_SEED, (const u8*)&joyp, size);
+  }
+  if (first_page == STATE_PAGE_COUNT) {
+    return hash_bytes(STATE_HASH_SEED, data, size);
+  }
+  size_t data_size = MIN(size, get_state_page_data_size(section));
+  u64 hash = STATE_HASH_SEED;
+  size_t offset;
+  for (offset = 0; offset < data_size; offset += STATE_PAGE_SIZE) {
+    u32 page = first_page + (offset >> STATE_PAGE_SHIFT);
+    if (stale_pages[page >> 5] & (1u << (page & 31))) {
+      e->page_hashes[page] =
+          hash_bytes(STATE_HASH_SEED, data + offset,
+                     MIN(STATE_PAGE_SIZE, data_size - offset));
+    }
+    hash = hash_mix(hash, e->page_hashes[page]);
+  }
+  return hash_bytes(hash, data + data_size, size - data_size);
+}
+
+u64 emulator_hash_state(Emulator* e) {
+  u32 stale_pages[STATE_PAGE_COUNT / 32];
+  size_t i;
+  for (i = 0; i < ARRAY_SIZE(stale_pages); ++i) {
+    stale_pages[i] = e->hash_stale_pages[i] | e->dirty_state_pages[i];
+  }
+  u32 stale_sections = (e->hash_stale_sections | e->dirty_state_sections |
+                        ~STATE_SECTIONS_TRACKED) &
+                       STATE_SECTIONS_ALL;
+  u64 hash = STATE_HASH_SEED;
+  int section;
+  for (section = 0; section < STATE_SECTION_COUNT; ++section) {
+    if (STATE_SECTIONS_UNHASHED & (1u << section)) {
+      continue;
+    }
+    if (stale_sections & (1u << section)) {
+      e->section_hashes[section] =
+          hash_state_section(e, section, stale_pages);
+    }
+    hash = hash_mix(hash, s_state_sections[section].tag);
+    hash = hash_mix(hash, get_state_section_size(e, section));
+    hash = hash_mix(hash, e->section_hashes[section]);
+  }
+  e->hash_stale_sections = 0;
+  ZERO_MEMORY(e->hash_stale_pages);
+  return hash_finish(hash);
+}
+
+/* Checks the header and every section, so a state can be read without
+ * checking anything else. */
+static Result check_state(const FileData* file_data) {
+  const u8* src = file_data->data;
+  const u8* src_end = src + file_data->size;
+  CHECK_MSG(file_data->size >= SAVE_STATE_HEADER_SIZE &&
+                read_u32_le(src) == SAVE_STATE_MAGIC,
+            "not a save state, or saved by an older version.\n");
+  u32 version = read_u32_le(src + 4);
+  CHECK_MSG(version <= SAVE_STATE_VERSION,
+            "save state version %u is newer than %u.\n", version,
+            SAVE_STATE_VERSION);
+  /* No flags are defined yet. */
+  CHECK_MSG(read_u32_le(src + 8) == 0, "save state has unknown flags: %u.\n",
+            read_u32_le(src + 8));
+
+  const u8* p;
+  for (p = src + SAVE_STATE_HEADER_SIZE; p < src_end;) {
+    CHECK_MSG(src_end - p >= SAVE_STATE_SECTION_HEADER_SIZE,
+              "save state is truncated.\n");
+    u32 size = read_u32_le(p + 4);
+    CHECK_MSG(size <= src_end - p - SAVE_STATE_SECTION_HEADER_SIZE,
+              "save state is truncated.\n");
+    int section = find_state_section(read_u32_le(p));
+    CHECK_MSG(section < 0 || size <= s_state_sections[section].size,
+              "save state section \"%.4s\" is too large: %u.\n",
+              (const char*)p, size);
+    p += SAVE_STATE_SECTION_HEADER_SIZE + size;
+  }
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+static void update_palettes_from_state(Emulator* e) {
   if (IS_SGB) {
     emulator_set_bw_palette(e, PALETTE_TYPE_OBP0, &SGB.screen_pal[0]);
     emulator_set_bw_palette(e, PALETTE_TYPE_OBP1, &SGB.screen_pal[0]);
@@ -4945,26 +6687,302 @@ Result emulator_read_state(Emulator* e, const FileData* file_data) {
   update_bw_palette_rgba(e, PALETTE_TYPE_BGP);
   update_bw_palette_rgba(e, PALETTE_TYPE_OBP0);
   update_bw_palette_rgba(e, PALETTE_TYPE_OBP1);
+}
+
+Result emulator_read_state(Emulator* e, const FileData* file_data) {
+  const u8* src = file_data->data;
+  const u8* src_end = src + file_data->size;
+  /* Check every section before changing anything. */
+  CHECK(SUCCESS(check_state(file_data)));
+
+  const u8* p;
+  ZERO_MEMORY(e->state);
+  for (p = src + SAVE_STATE_HEADER_SIZE; p < src_end;) {
+    u32 size = read_u32_le(p + 4);
+    int section = find_state_section(read_u32_le(p));
+    if (section >= 0) {
+      const StateSectionInfo* info = &s_state_sections[section];
+      u8* dst = (u8*)&e->state + info->offset;
+      memcpy(dst, p + SAVE_STATE_SECTION_HEADER_SIZE, size);
+      memset(dst + size, 0, info->size - size);
+    }
+    p += SAVE_STATE_SECTION_HEADER_SIZE + size;
+  }
+  set_cart_info(e, e->state.cart_info_index);
+  mark_all_state_dirty(e);
+  update_palettes_from_state(e);
+  reset_test_result(e);
   return OK;
   ON_ERROR_RETURN;
 }
 
+/* Whether |file_data| is a full state with exactly the sections that
+ * emulator_write_state would write now. */
+static Bool is_current_state_layout(Emulator* e, const FileData* file_data) {
+  const u8* p = file_data->data;
+  if (file_data->size != emulator_get_state_size(e) ||
+      read_u32_le(p) != SAVE_STATE_MAGIC ||
+      read_u32_le(p + 4) != SAVE_STATE_VERSION || read_u32_le(p + 8) != 0) {
+    return FALSE;
+  }
+  p += SAVE_STATE_HEADER_SIZE;
+  int i;
+  for (i = 0; i < STATE_SECTION_COUNT; ++i) {
+    size_t size = get_state_section_size(e, i);
+    if (read_u32_le(p) != s_state_sections[i].tag ||
+        read_u32_le(p + 4) != size) {
+      return FALSE;
+    }
+    p += SAVE_STATE_SECTION_HEADER_SIZE + size;
+  }
+  return TRUE;
+}
+
+/* Returns TRUE if |size| bytes at |dst| differed from |src| (and were
+ * copied). */
+static Bool copy_if_changed(u8* dst, const u8* src, size_t size) {
+  if (size == 0 || memcmp(dst, src, size) == 0) {
+    return FALSE;
+  }
+  memcpy(dst, src, size);
+  return TRUE;
+}
+
+Result emulator_restore_state(Emulator* e, const FileData* file_data) {
+  if (!is_current_state_layout(e, file_data)) {
+    return emulator_read_state(e, file_data);
+  }
+
+  const u8* src = file_data->data + SAVE_STATE_HEADER_SIZE;
+  u32 changed = 0;
+  int i;
+  for (i = 0; i < STATE_SECTION_COUNT; ++i) {
+    const StateSectionInfo* info = &s_state_sections[i];
+    size_t size = get_state_section_size(e, i);
+    u8* dst = (u8*)&e->state + info->offset;
+    src += SAVE_STATE_SECTION_HEADER_SIZE;
+    u32 first_page = get_state_first_page(i);
+    if (first_page == STATE_PAGE_COUNT) {
+      if (copy_if_changed(dst, src, size)) {
+        changed |= 1u << i;
+      }
+    } else {
+      size_t data_size = MIN(size, get_state_page_data_size(i));
+      size_t offset;
+      for (offset = 0; offset < data_size; offset += STATE_PAGE_SIZE) {
+        if (copy_if_changed(dst + offset, src + offset,
+                            MIN(STATE_PAGE_SIZE, data_size - offset))) {
+          u32 page = first_page + (offset >> STATE_PAGE_SHIFT);
+          e->dirty_state_pages[page >> 5] |= 1u << (page & 31);
+          changed |= 1u << i;
+        }
+      }
+      if (copy_if_changed(dst + data_size, src + data_size,
+                          size - data_size)) {
+        changed |= 1u << i;
+      }
+    }
+    src += size;
+  }
+
+  if (changed & (1u << STATE_SECTION_CART)) {
+    set_cart_info(e, e->state.cart_info_index);
+  }
+  e->dirty_state_sections |= changed & STATE_SECTIONS_TRACKED;
+  if (changed & ((1u << STATE_SECTION_PPU) | (1u << STATE_SECTION_SGB) |
+                 (1u << STATE_SECTION_IS_SGB))) {
+    update_palettes_from_state(e);
+  }
+  reset_test_result(e);
+  return OK;
+}
+
+Result emulator_state_view_init(EmulatorStateView* view,
+                                const FileData* file_data) {
+  CHECK(SUCCESS(check_state(file_data)));
+  view->data = file_data->data;
+  view->size = file_data->size;
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+static const u8* find_state_view_section(const EmulatorStateView* view,
+                                         StateSection section,
+                                         size_t* out_size) {
+  const u8* p = view->data + SAVE_STATE_HEADER_SIZE;
+  const u8* end = view->data + view->size;
+  while (p < end) {
+    u32 size = read_u32_le(p + 4);
+    if (read_u32_le(p) == s_state_sections[section].tag) {
+      *out_size = size;
+      return p + SAVE_STATE_SECTION_HEADER_SIZE;
+    }
+    p += SAVE_STATE_SECTION_HEADER_SIZE + size;
+  }
+  return NULL;
+}
+
+/* Copies a section out, since it may not be aligned in the state. */
+static Bool read_state_view_section(const EmulatorStateView* view,
+                                    StateSection section, void* dst) {
+  size_t size;
+  const u8* src = find_state_view_section(view, section, &size);
+  if (!src) {
+    return FALSE;
+  }
+  memcpy(dst, src, size);
+  memset((u8*)dst + size, 0, s_state_sections[section].size - size);
+  return TRUE;
+}
+
+Bool emulator_state_view_get_registers(const EmulatorStateView* view,
+                                       Registers* out_registers) {
+  return read_state_view_section(view, STATE_SECTION_REGS, out_registers);
+}
+
+Ticks emulator_state_view_get_ticks(const EmulatorStateView* view) {
+  Ticks ticks;
+  if (!read_state_view_section(view, STATE_SECTION_TICKS, &ticks)) {
+    return INVALID_TICKS;
+  }
+  return ticks;
+}
+
+const u8* emulator_state_view_get_memory(const EmulatorStateView* view,
+                                         EmulatorStateMemory memory,
+                                         size_t* out_size) {
+  StateSection section;
+  size_t data_size;
+  switch (memory) {
+    case EMULATOR_STATE_MEMORY_VRAM:
+      section = STATE_SECTION_VRAM;
+      data_size = VIDEO_RAM_SIZE;
+      break;
+    case EMULATOR_STATE_MEMORY_WRAM:
+      section = STATE_SECTION_WRAM;
+      data_size = WORK_RAM_SIZE;
+      break;
+    case EMULATOR_STATE_MEMORY_EXT_RAM:
+      section = STATE_SECTION_XRAM;
+      data_size = EXT_RAM_MAX_SIZE;
+      break;
+    case EMULATOR_STATE_MEMORY_HRAM:
+      section = STATE_SECTION_HRAM;
+      data_size = HIGH_RAM_SIZE;
+      break;
+    default:
+      return NULL;
+  }
+  size_t size;
+  const u8* data = find_state_view_section(view, section, &size);
+  if (data) {
+    *out_size = MIN(size, data_size);
+  }
+  return data;
+}
+
 Result emulator_write_state(Emulator* e, FileData* file_data) {
-  CHECK(file_data->size >= sizeof(EmulatorState));
-  e->state.header = SAVE_STATE_HEADER;
-  memcpy(file_data->data, &e->state, file_data->size);
+  u8* dst = file_data->data;
+  u8* dst_end = dst + file_data->size;
+  CHECK_MSG(file_data->size >= SAVE_STATE_HEADER_SIZE,
+            "save state buffer is too small.\n");
+  write_u32_le(dst, SAVE_STATE_MAGIC);
+  write_u32_le(dst + 4, SAVE_STATE_VERSION);
+  write_u32_le(dst + 8, 0); /* Flags. */
+  dst += SAVE_STATE_HEADER_SIZE;
+  int i;
+  for (i = 0; i < STATE_SECTION_COUNT; ++i) {
+    size_t size = get_state_section_size(e, i);
+    CHECK_MSG((size_t)(dst_end - dst) >= SAVE_STATE_SECTION_HEADER_SIZE + size,
+              "save state buffer is too small.\n");
+    write_u32_le(dst, s_state_sections[i].tag);
+    write_u32_le(dst + 4, size);
+    memcpy(dst + SAVE_STATE_SECTION_HEADER_SIZE,
+           (u8*)&e->state + s_state_sections[i].offset, size);
+    dst += SAVE_STATE_SECTION_HEADER_SIZE + size;
+  }
+  file_data->size = dst - file_data->data;
   return OK;
   ON_ERROR_RETURN;
 }
 
+/* The MBC3 RTC is saved after ext RAM in the format used by VBA-M, BGB, etc:
+ * the current sec, min, hour, day and day-hi/halt/carry registers, then the
+ * latched registers, as little-endian u32s, then the host time when the file
+ * was written as a u64 Unix timestamp (u32 in older files). */
+static void write_rtc_footer(Emulator* e, u8* dst) {
+  Mbc3* mbc3 = &MMAP_STATE.mbc3;
+  /* May update latch_ticks, so call it first. */
+  Ticks now = mbc3_rtc_ticks(e);
+  Mbc3 current = *mbc3;
+  if (!mbc3->rtc_halt) {
+    mbc3_rtc_add(&current, now - mbc3->latch_ticks);
+  }
+  const Mbc3* regs[] = {&current, mbc3};
+  int i;
+  for (i = 0; i < 2; ++i) {
+    write_u32_le(dst + 0, regs[i]->sec);
+    write_u32_le(dst + 4, regs[i]->min);
+    write_u32_le(dst + 8, regs[i]->hour);
+    write_u32_le(dst + 12, regs[i]->day & 0xff);
+    write_u32_le(dst + 16, PACK(regs[i]->day_carry, MBC3_RTC_DAY_CARRY) |
+                               PACK(regs[i]->rtc_halt, MBC3_RTC_HALT) |
+                               PACK((regs[i]->day >> 8) & 1, MBC3_RTC_DAY_HI));
+    dst += 20;
+  }
+  u64 timestamp = (u64)time(NULL);
+  write_u32_le(dst, (u32)timestamp);
+  write_u32_le(dst + 4, (u32)(timestamp >> 32));
+}
+
+/* Restores the current RTC registers from the footer; the latched registers
+ * are not kept separately, so they are dropped. If the RTC follows host time,
+ * the time since the file was written is added on the next latch. */
+static void read_rtc_footer(Emulator* e, const u8* src, size_t size) {
+  Mbc3* mbc3 = &MMAP_STATE.mbc3;
+  u8 flags = read_u32_le(src + 16);
+  mbc3->sec = read_u32_le(src + 0) & 63;
+  mbc3->min = read_u32_le(src + 4) & 63;
+  mbc3->hour = read_u32_le(src + 8) & 31;
+  mbc3->day = (UNPACK(flags, MBC3_RTC_DAY_HI) << 8) |
+              (read_u32_le(src + 12) & 0xff);
+  mbc3->day_carry = UNPACK(flags, MBC3_RTC_DAY_CARRY);
+  mbc3->rtc_halt = UNPACK(flags, MBC3_RTC_HALT);
+  if (mbc3->rtc_halt) {
+    mbc3->latch_ticks = 0;
+    return;
+  }
+  Ticks now = mbc3_rtc_ticks(e);
+  Ticks delta = 0;
+  if (e->config.rtc_wall_clock) {
+    u64 timestamp = read_u32_le(src + 40);
+    if (size == RTC_FOOTER_SIZE) {
+      timestamp |= (u64)read_u32_le(src + 44) << 32;
+    }
+    u64 host_time = (u64)time(NULL);
+    if (host_time > timestamp) {
+      delta = (host_time - timestamp) * CPU_TICKS_PER_SECOND;
+    }
+  }
+  mbc3->latch_ticks = now - MIN(delta, now);
+}
+
 Result emulator_read_ext_ram(Emulator* e, const FileData* file_data) {
   if (EXT_RAM.battery_type != BATTERY_TYPE_WITH_BATTERY)
     return OK;
 
-  CHECK_MSG(file_data->size == EXT_RAM.size,
+  size_t footer_size = file_data->size - EXT_RAM.size;
+  CHECK_MSG(file_data->size == EXT_RAM.size ||
+                (has_rtc(e) && file_data->size > EXT_RAM.size &&
+                 (footer_size == RTC_FOOTER_SIZE ||
+                  footer_size == RTC_FOOTER_SIZE_32BIT_TIME)),
             "save file is wrong size: %ld, expected %ld.\n",
             (long)file_data->size, (long)EXT_RAM.size);
-  memcpy(EXT_RAM.data, file_data->data, file_data->size);
+  memcpy(EXT_RAM.data, file_data->data, EXT_RAM.size);
+  MARK_STATE_BYTES_DIRTY(XRAM, 0, EXT_RAM.size);
+  if (file_data->size != EXT_RAM.size) {
+    read_rtc_footer(e, file_data->data + EXT_RAM.size, footer_size);
+  }
   return OK;
   ON_ERROR_RETURN;
 }
@@ -4974,7 +6992,10 @@ Result emulator_write_ext_ram(Emulator* e, FileData* file_data) {
     return OK;
 
   CHECK(file_data->size >= EXT_RAM.size);
-  memcpy(file_data->data, EXT_RAM.data, file_data->size);
+  memcpy(file_data->data, EXT_RAM.data, EXT_RAM.size);
+  if (has_rtc(e) && file_data->size >= EXT_RAM.size + RTC_FOOTER_SIZE) {
+    write_rtc_footer(e, file_data->data + EXT_RAM.size);
+  }
   return OK;
   ON_ERROR_RETURN;
 }
@@ -5000,8 +7021,7 @@ Result emulator_write_ext_ram_to_file(Emulator* e, const char* filename) {
 
   Result result = ERROR;
   FileData file_data;
-  file_data.size = EXT_RAM.size;
-  file_data.data = xmalloc(file_data.size);
+  emulator_init_ext_ram_file_data(e, &file_data);
   CHECK(SUCCESS(emulator_write_ext_ram(e, &file_data)));
   CHECK(SUCCESS(file_write(filename, &file_data)));
   result = OK;
@@ -5025,7 +7045,7 @@ error:
 Result emulator_write_state_to_file(Emulator* e, const char* filename) {
   Result result = ERROR;
   FileData file_data;
-  emulator_init_state_file_data(&file_data);
+  emulator_init_state_file_data(e, &file_data);
   CHECK(SUCCESS(emulator_write_state(e, &file_data)));
   CHECK(SUCCESS(file_write(filename, &file_data)));
   result = OK;
@@ -5036,8 +7056,14 @@ error:
 #endif
 
 Emulator* emulator_new(const EmulatorInit* init) {
+  init_lfsr_tables();
   Emulator* e = xcalloc(1, sizeof(Emulator));
-  CHECK(SUCCESS(set_rom_file_data(e, &init->rom)));
+  if (init->shared_rom) {
+    e->rom = emulator_rom_ref(init->shared_rom);
+  } else {
+    e->rom = emulator_rom_new(&init->rom, NULL);
+    CHECK(e->rom != NULL);
+  }
   CHECK(SUCCESS(init_emulator(e, init)));
   CHECK(
       SUCCESS(init_audio_buffer(e, init->audio_frequency, init->audio_frames)));
@@ -5050,11 +7076,83 @@ error:
 void emulator_delete(Emulator* e) {
   if (e) {
     xfree(e->audio_buffer.data);
-    file_data_delete(&e->file_data);
+    emulator_rom_unref(e->rom);
     xfree(e);
   }
 }
 
+struct ApuPlayer {
+  Emulator* e; /* Only the APU state and audio buffer are used. */
+};
+
+ApuPlayer* apu_player_new(const ApuPlayerInit* init) {
+  init_lfsr_tables();
+  ApuPlayer* player = xcalloc(1, sizeof(ApuPlayer));
+  Emulator* e = player->e = xcalloc(1, sizeof(Emulator));
+  IS_CGB = init->is_cgb;
+  init_apu(e);
+  CHECK(
+      SUCCESS(init_audio_buffer(e, init->audio_frequency, init->audio_frames)));
+  return player;
+error:
+  apu_player_delete(player);
+  return NULL;
+}
+
+void apu_player_delete(ApuPlayer* player) {
+  if (player) {
+    emulator_delete(player->e);
+    xfree(player);
+  }
+}
+
+EmulatorEvent apu_player_run_until(ApuPlayer* player, Ticks until_ticks) {
+  Emulator* e = player->e;
+  AudioBuffer* ab = &e->audio_buffer;
+  if (e->state.event & EMULATOR_EVENT_AUDIO_BUFFER_FULL) {
+    ab->position = ab->data;
+  }
+  e->state.event = 0;
+
+  u64 frames_left = ab->frames - audio_buffer_get_frames(ab);
+  Ticks max_audio_ticks =
+      APU.sync_ticks +
+      (u32)DIV_CEIL(frames_left * CPU_TICKS_PER_SECOND, ab->frequency);
+  Ticks check_ticks = MIN(until_ticks, max_audio_ticks);
+  if (check_ticks > TICKS) {
+    /* The APU only updates in whole APU_TICKS. */
+    TICKS = ALIGN_UP(check_ticks, APU_TICKS);
+    apu_synchronize(e);
+  }
+  if (TICKS >= max_audio_ticks) {
+    e->state.event |= EMULATOR_EVENT_AUDIO_BUFFER_FULL;
+  }
+  if (TICKS >= until_ticks) {
+    e->state.event |= EMULATOR_EVENT_UNTIL_TICKS;
+  }
+  return e->state.event;
+}
+
+void apu_player_write(ApuPlayer* player, u8 addr, u8 value) {
+  Emulator* e = player->e;
+  if (addr >= APU_EVENT_WAVE_RAM_ADDR) {
+    addr -= APU_EVENT_WAVE_RAM_ADDR;
+    if (addr < WAVE_RAM_SIZE) {
+      write_wave_ram(e, addr, value);
+    }
+  } else if (addr < APU_REG_COUNT) {
+    write_apu(e, addr, value);
+  }
+}
+
+AudioBuffer* apu_player_get_audio_buffer(ApuPlayer* player) {
+  return &player->e->audio_buffer;
+}
+
+Ticks apu_player_get_ticks(ApuPlayer* player) {
+  return player->e->state.ticks;
+}
+
 void emulator_ticks_to_time(Ticks ticks, u32* day, u32* hr, u32* min, u32* sec,
                             u32* ms) {
   u64 secs = ticks / CPU_TICKS_PER_SECOND;
@@ -5083,6 +7181,7 @@ void emulator_set_builtin_palette(Emulator* e, u32 index) {
   for (int i = 0; i < 4; ++i) {
     SGB.screen_pal[i] = pals[index][0];
   }
+  MARK_STATE_DIRTY(SGB);
   update_bw_palette_rgba(e, PALETTE_TYPE_BGP);
 }
 
@@ -5094,6 +7193,71 @@ void emulator_reset_apu_log(Emulator* e) {
   e->apu_log.write_count = 0;
 }
 
+void emulator_set_serial_callback(Emulator* e, SerialCallback callback,
+                                  void* user_data) {
+  e->serial_info.callback = callback;
+  e->serial_info.user_data = user_data;
+}
+
+void emulator_set_sensor_callback(Emulator* e, SensorCallback callback,
+                                  void* user_data) {
+  e->sensor_info.callback = callback;
+  e->sensor_info.user_data = user_data;
+}
+
+SensorCallbackInfo emulator_get_sensor_callback(Emulator* e) {
+  return e->sensor_info;
+}
+
+void emulator_set_camera_callback(Emulator* e, CameraCallback callback,
+                                  void* user_data) {
+  e->camera_info.callback = callback;
+  e->camera_info.user_data = user_data;
+}
+
+CameraCallbackInfo emulator_get_camera_callback(Emulator* e) {
+  return e->camera_info;
+}
+
+Bool emulator_get_rumble(Emulator* e) {
+  return s_cart_type_info[e->cart_info->cart_type].mbc_type ==
+             MBC_TYPE_MBC5_RUMBLE &&
+         MMAP_STATE.mbc5.rumble;
+}
+
+u8 emulator_exchange_serial_byte(Emulator* e, u8 value, Ticks ticks) {
+  serial_synchronize(e);
+  SERIAL.receive_byte = value;
+  SERIAL.receive_ticks = ticks;
+  Bool waiting = SERIAL.transferring && SERIAL.clock == SERIAL_CLOCK_EXTERNAL;
+  if (waiting) {
+    calculate_next_serial_intr(e);
+  }
+  return waiting ? SERIAL.sb : 0xff;
+}
+
+void emulator_set_apu_event_callback(Emulator* e, ApuEventCallback callback,
+                                     void* user_data) {
+  e->apu_event_log.callback = callback;
+  e->apu_event_log.user_data = user_data;
+  emulator_flush_apu_events(e);
+}
+
+ApuEventCallbackInfo emulator_get_apu_event_callback(Emulator* e) {
+  ApuEventCallbackInfo info;
+  info.callback = e->apu_event_log.callback;
+  info.user_data = e->apu_event_log.user_data;
+  return info;
+}
+
+void emulator_flush_apu_events(Emulator* e) {
+  ApuEventLog* log = &e->apu_event_log;
+  if (log->callback && log->count > 0) {
+    log->callback(log->events, log->count, log->user_data);
+  }
+  log->count = 0;
+}
+
 u16 emulator_get_PC(Emulator* e) {
   return REG.PC;
 }
@@ -5128,10 +7292,13 @@ void emulator_set_PC(Emulator* e, u16 pc) {
 }
 
 u8* emulator_get_wram_ptr(Emulator* e) {
+  /* The caller may write through this, so assume it does. */
+  MARK_STATE_BYTES_DIRTY(WRAM, 0, WORK_RAM_SIZE);
   return WRAM.data;
 }
 
 u8* emulator_get_hram_ptr(Emulator* e) {
+  MARK_STATE_DIRTY(HRAM);
   return HRAM;
 }
 
@@ -36,6 +36,9 @@ extern "C" {
 #define PALETTE_COLOR_COUNT 4
 #define OBJ_COUNT 40
 
+#define CAMERA_IMAGE_WIDTH 128
+#define CAMERA_IMAGE_HEIGHT 112
+
 #define OBJ_X_OFFSET 8
 #define OBJ_Y_OFFSET 16
 
@@ -47,8 +50,15 @@ extern "C" {
 #define RGBA_BLACK 0xff000000u
 
 #define MAX_APU_LOG_FRAME_WRITES 1024
+#define APU_EVENT_CHUNK_SIZE 1024
+/* ApuEvent addresses are relative to 0xff10, so wave RAM is 0x20..0x2f. */
+#define APU_EVENT_WAVE_RAM_ADDR 0x20
 
 typedef struct Emulator Emulator;
+/* A ROM image and the cart headers found in it. It is never written, so one
+ * can be shared by any number of emulators. */
+typedef struct EmulatorRom EmulatorRom;
+typedef struct ApuPlayer ApuPlayer;
 
 enum {
   APU_CHANNEL1,
@@ -65,6 +75,34 @@ typedef struct JoypadCallbackInfo {
   void* user_data;
 } JoypadCallbackInfo;
 
+/* Called when a serial transfer using the internal clock starts; |ticks| is
+ * when it will finish. Returns the byte to shift in from the other end of the
+ * link cable. */
+typedef u8 (*SerialCallback)(u8 value, Ticks ticks, void* user_data);
+
+typedef struct SerialCallbackInfo {
+  SerialCallback callback;
+  void* user_data;
+} SerialCallbackInfo;
+
+/* Called when an MBC7 cartridge latches its accelerometer. Set |x| and |y| to
+ * the tilt in g, typically -1..1; they are 0 (level) when called. */
+typedef void (*SensorCallback)(f32* x, f32* y, void* user_data);
+
+typedef struct SensorCallbackInfo {
+  SensorCallback callback;
+  void* user_data;
+} SensorCallbackInfo;
+
+/* Called when a Pocket Camera takes a picture. Fill |image| with
+ * CAMERA_IMAGE_WIDTH * CAMERA_IMAGE_HEIGHT grayscale pixels, 0 is black. */
+typedef void (*CameraCallback)(u8* image, void* user_data);
+
+typedef struct CameraCallbackInfo {
+  CameraCallback callback;
+  void* user_data;
+} CameraCallbackInfo;
+
 typedef RGBA FrameBuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
 typedef RGBA SgbFrameBuffer[SGB_SCREEN_WIDTH * SGB_SCREEN_HEIGHT];
 
@@ -162,7 +200,8 @@ typedef enum CgbColorCurve {
 } CgbColorCurve;
 
 typedef struct EmulatorInit {
-  FileData rom;
+  FileData rom; /* Owned by the emulator. Not used if shared_rom is set. */
+  EmulatorRom* shared_rom; /* The emulator adds a reference. */
   int audio_frequency;
   int audio_frames;
   u32 random_seed;
@@ -171,6 +210,12 @@ typedef struct EmulatorInit {
   CgbColorCurve cgb_color_curve;
 } EmulatorInit;
 
+typedef struct ApuPlayerInit {
+  int audio_frequency;
+  int audio_frames;
+  Bool is_cgb;
+} ApuPlayerInit;
+
 typedef struct EmulatorConfig {
   Bool disable_sound[APU_CHANNEL_COUNT];
   Bool disable_bg;
@@ -178,6 +223,16 @@ typedef struct EmulatorConfig {
   Bool disable_obj;
   Bool allow_simulataneous_dpad_opposites;
   Bool log_apu_writes;
+  /* Keep APU registers exact, but don't generate samples or stop when the
+   * audio buffer is full. */
+  Bool disable_audio;
+  /* Stop with EMULATOR_EVENT_TEST_FINISHED when a test ROM reports its
+   * result; see emulator_get_test_result. */
+  Bool detect_test_result;
+  /* Run the MBC3 RTC from host time instead of emulated time, so it keeps
+   * real time when fast-forwarding, and catches up on time that passed since
+   * the save file was written. */
+  Bool rtc_wall_clock;
 } EmulatorConfig;
 
 typedef struct {
@@ -190,6 +245,23 @@ typedef struct {
   size_t write_count;
 } ApuLog;
 
+typedef struct {
+  Ticks ticks;
+  u8 addr;
+  u8 value;
+  Bool boot; /* Written by emulator_new to set up the post-boot state. */
+} ApuEvent;
+
+/* Called with a chunk of APU register and wave RAM writes, in tick order,
+ * whenever the chunk is full or emulator_flush_apu_events is called. */
+typedef void (*ApuEventCallback)(const ApuEvent* events, size_t count,
+                                 void* user_data);
+
+typedef struct ApuEventCallbackInfo {
+  ApuEventCallback callback;
+  void* user_data;
+} ApuEventCallbackInfo;
+
 typedef u32 EmulatorEvent;
 enum {
   EMULATOR_EVENT_NEW_FRAME = 0x1,
@@ -197,22 +269,65 @@ enum {
   EMULATOR_EVENT_UNTIL_TICKS = 0x4,
   EMULATOR_EVENT_BREAKPOINT = 0x8,
   EMULATOR_EVENT_INVALID_OPCODE = 0x10,
+  EMULATOR_EVENT_TEST_FINISHED = 0x20,
 };
 
+typedef enum TestResult {
+  TEST_RESULT_NONE,
+  TEST_RESULT_PASSED,
+  TEST_RESULT_FAILED,
+} TestResult;
+
 extern const size_t s_emulator_state_size;
 
+/* Frees the data passed to emulator_rom_new. */
+typedef void (*EmulatorRomFreeCallback)(FileData*);
+
+/* Takes ownership of |file_data|, which is freed with |free_data| (or
+ * file_data_delete if it is NULL) when the last reference is released, or
+ * if the ROM is invalid. Starts with one reference. */
+EmulatorRom* emulator_rom_new(const FileData* file_data,
+                              EmulatorRomFreeCallback free_data);
+EmulatorRom* emulator_rom_ref(EmulatorRom*);
+void emulator_rom_unref(EmulatorRom*);
+const FileData* emulator_rom_get_file_data(EmulatorRom*);
+
+/* The first call fills tables shared by every emulator, so create emulators
+ * (and ApuPlayers) on one thread. */
 Emulator* emulator_new(const EmulatorInit*);
 void emulator_delete(Emulator*);
+EmulatorRom* emulator_get_rom(Emulator*);
 
 void emulator_set_joypad_buttons(Emulator*, JoypadButtons*);
 void emulator_set_joypad_callback(Emulator*, JoypadCallback, void* user_data);
 JoypadCallbackInfo emulator_get_joypad_callback(Emulator*);
+void emulator_set_serial_callback(Emulator*, SerialCallback, void* user_data);
+void emulator_set_sensor_callback(Emulator*, SensorCallback, void* user_data);
+SensorCallbackInfo emulator_get_sensor_callback(Emulator*);
+void emulator_set_camera_callback(Emulator*, CameraCallback, void* user_data);
+CameraCallbackInfo emulator_get_camera_callback(Emulator*);
+/* Whether the motor of an MBC5 rumble cartridge is on. */
+Bool emulator_get_rumble(Emulator*);
+/* Clocks |value| into SB at |ticks|, as if sent from the other end of the link
+ * cable, if this emulator is waiting on the external clock then. Returns the
+ * byte that is shifted out in exchange, or 0xff if it isn't waiting now. */
+u8 emulator_exchange_serial_byte(Emulator*, u8 value, Ticks ticks);
 void emulator_set_config(Emulator*, const EmulatorConfig*);
 EmulatorConfig emulator_get_config(Emulator*);
+/* The result reported by a test ROM, if detect_test_result is set. Blargg's
+ * tests print "Passed" or "Failed" over serial, or write a status to ext RAM
+ * at $A000; mooneye's tests execute LD B,B with B,C,D,E,H,L set to
+ * 3,5,8,13,21,34 when they pass (or all 0x42 when they fail). Reading or
+ * restoring a state resets it to TEST_RESULT_NONE. */
+TestResult emulator_get_test_result(Emulator*);
 FrameBuffer* emulator_get_frame_buffer(Emulator*);
 SgbFrameBuffer* emulator_get_sgb_frame_buffer(Emulator*);
 AudioBuffer* emulator_get_audio_buffer(Emulator*);
+/* Drops the frames in the audio buffer, e.g. after rendering them before it is
+ * full. A full buffer is reset by the next emulator_run_until. */
+void emulator_reset_audio_buffer(Emulator*);
 Ticks emulator_get_ticks(Emulator*);
+Bool emulator_is_cgb(Emulator*);
 u32 emulator_get_ppu_frame(Emulator*);
 u32 audio_buffer_get_frames(AudioBuffer*);
 void emulator_set_builtin_palette(Emulator*, u32 index);
@@ -224,10 +339,69 @@ void emulator_ticks_to_time(Ticks, u32* day, u32* hr, u32* min, u32* sec,
 
 Bool emulator_was_ext_ram_updated(Emulator*);
 
-void emulator_init_state_file_data(FileData*);
+size_t emulator_get_state_size(Emulator*);
+void emulator_init_state_file_data(Emulator*, FileData*);
 void emulator_init_ext_ram_file_data(Emulator*, FileData*);
 Result emulator_read_state(Emulator*, const FileData*);
+/* |file_data| may point into caller-owned memory (e.g. an arena of
+ * snapshots) of at least emulator_get_state_size bytes; nothing is
+ * allocated. */
 Result emulator_write_state(Emulator*, FileData*);
+/* Like emulator_read_state, for restoring snapshots often: only the sections
+ * (and VRAM/WRAM/ext RAM pages) that differ from the current state are
+ * copied, and only those are marked dirty. Falls back to emulator_read_state
+ * unless the state was written in full by this version. */
+Result emulator_restore_state(Emulator*, const FileData*);
+
+/* A read-only view of a save state, for inspecting it without an Emulator.
+ * It points into the state's data, which must outlive it. */
+typedef struct EmulatorStateView {
+  const u8* data;
+  size_t size;
+} EmulatorStateView;
+
+typedef enum EmulatorStateMemory {
+  EMULATOR_STATE_MEMORY_VRAM,    /* All banks. */
+  EMULATOR_STATE_MEMORY_WRAM,    /* All banks. */
+  EMULATOR_STATE_MEMORY_EXT_RAM, /* Only the cart's RAM size. */
+  EMULATOR_STATE_MEMORY_HRAM,
+} EmulatorStateMemory;
+
+Result emulator_state_view_init(EmulatorStateView*, const FileData*);
+/* These fail (returning FALSE, INVALID_TICKS or NULL) if the state doesn't
+ * include the section, e.g. one written by an older version. */
+Bool emulator_state_view_get_registers(const EmulatorStateView*, Registers*);
+Ticks emulator_state_view_get_ticks(const EmulatorStateView*);
+const u8* emulator_state_view_get_memory(const EmulatorStateView*,
+                                         EmulatorStateMemory,
+                                         size_t* out_size);
+
+/* A set of save state sections, as a bitmask. VRAM, WRAM, ext RAM, OAM, SGB
+ * and HRAM are reported only after they are written; the rest are always
+ * reported. */
+u32 emulator_get_dirty_state_sections(Emulator*);
+void emulator_clear_dirty_state_sections(Emulator*);
+/* A 64-bit hash of the emulated machine, for finding where two runs
+ * diverge. It covers every section of a full save state except the events
+ * returned by the last emulator_run_until, the flag read by
+ * emulator_was_ext_ram_updated and when the joypad callback was last called,
+ * so it doesn't depend on how the run is split into emulator_run_until
+ * calls. Only VRAM, WRAM and ext RAM pages and the
+ * VRAM, WRAM, ext RAM, OAM, SGB and HRAM sections written since the last call
+ * are hashed again. Comparable only between builds with the same save state
+ * layout. */
+u64 emulator_hash_state(Emulator*);
+
+#define EMULATOR_STATE_PAGE_SIZE 256
+
+/* The number of EMULATOR_STATE_PAGE_SIZE pages in a full state. */
+size_t emulator_get_state_page_count(Emulator*);
+/* Brings |file_data|, a full state written earlier by emulator_write_state,
+ * up to date by copying only what may have changed since it was last written
+ * or updated. Sets the bit in |dirty_pages| (one bit per page of file_data,
+ * 32 to a u32) for each page that was copied, and clears the dirty sections.
+ */
+Result emulator_update_state(Emulator*, FileData*, u32* dirty_pages);
 Result emulator_read_ext_ram(Emulator*, const FileData*);
 Result emulator_write_ext_ram(Emulator*, FileData*);
 
@@ -243,6 +417,25 @@ EmulatorEvent emulator_run_until(Emulator*, Ticks until_ticks);
 
 ApuLog* emulator_get_apu_log(Emulator*);
 void emulator_reset_apu_log(Emulator*);
+void emulator_set_apu_event_callback(Emulator*, ApuEventCallback,
+                                     void* user_data);
+ApuEventCallbackInfo emulator_get_apu_event_callback(Emulator*);
+void emulator_flush_apu_events(Emulator*);
+
+/* Runs only the APU, driven by a stream of register writes (e.g. ApuEvents
+ * from emulator_set_apu_event_callback). No ROM is needed, and the CPU and PPU
+ * never run. It starts from the APU state that emulator_new leaves, so the
+ * events with boot set are already applied and must be skipped; replaying
+ * them would restart channel 1. */
+ApuPlayer* apu_player_new(const ApuPlayerInit*);
+void apu_player_delete(ApuPlayer*);
+/* Generates audio until until_ticks, or until the audio buffer is full. */
+EmulatorEvent apu_player_run_until(ApuPlayer*, Ticks until_ticks);
+/* Writes an APU register or wave RAM byte (see ApuEvent) at the current
+ * ticks. */
+void apu_player_write(ApuPlayer*, u8 addr, u8 value);
+AudioBuffer* apu_player_get_audio_buffer(ApuPlayer*);
+Ticks apu_player_get_ticks(ApuPlayer*);
 
 #ifdef __cplusplus
 }
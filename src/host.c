@@ -12,7 +12,10 @@
 #include "host-gl.h"
 #include "host-ui.h"
 #include "joypad.h"
+#include "replay.h"
 #include "rewind.h"
+#include "rewind-worker.h"
+#include "socket-link.h"
 
 #define HOOK0(name)                           \
   do                                          \
@@ -36,6 +39,9 @@ typedef f32 HostAudioSample;
 #define AUDIO_CONVERT_SAMPLE_FROM_U8(X, fvol) ((fvol) * (X) * (1 / 255.0f))
 #define AUDIO_TARGET_QUEUED_SIZE (2 * host->audio.spec.size)
 #define AUDIO_MAX_QUEUED_SIZE (5 * host->audio.spec.size)
+#define AUDIO_PACED_SLICE_MS 1
+#define AUDIO_PACED_MAX_MS 100 /* Most emulated time per paced run. */
+#define AUDIO_PACED_FRAME_MARGIN_MS 2 /* Return this early to catch vsync. */
 
 typedef struct {
   GLint internal_format;
@@ -47,10 +53,19 @@ typedef struct {
   SDL_AudioDeviceID dev;
   SDL_AudioSpec spec;
   u8* buffer; /* Size is spec.size. */
+  u32 target_queued_size;
   Bool ready;
   f32 volume; /* [0..1] */
 } Audio;
 
+typedef struct {
+  f64 input_ms; /* Time of the most recent joypad key/button event. */
+  Bool pending_audio;
+  Bool pending_photon;
+  Bool frame_ready; /* A frame was emulated after the input. */
+  HostLatencyStats stats;
+} Latency;
+
 typedef struct {
   RewindResult rewind_result;
   JoypadPlayback joypad_playback;
@@ -65,6 +80,7 @@ typedef struct Host {
   SDL_GLContext gl_context;
   SDL_GameController* controller;
   Audio audio;
+  Latency latency;
   u64 start_counter;
   u64 performance_frequency;
   struct HostUI* ui;
@@ -72,7 +88,11 @@ typedef struct Host {
   HostTexture* sgb_fb_texture;
   JoypadBuffer* joypad_buffer;
   RewindBuffer* rewind_buffer;
+  RewindWorker* rewind_worker; /* NULL if appending on this thread. */
   RewindState rewind_state;
+  ReplayWriter* replay_writer;
+  Bool replay_keyframe_pending; /* Written before emulating any further. */
+  SocketLink* socket_link;
   JoypadPlayback joypad_playback;
   Ticks last_ticks;
   Bool key_state[HOST_KEYCODE_COUNT];
@@ -126,6 +146,10 @@ f64 host_get_time_ms(Host* host) {
   return (f64)(now - host->start_counter) * 1000 / host->performance_frequency;
 }
 
+static f64 host_audio_bytes_per_ms(Host* host) {
+  return host->audio.spec.freq * AUDIO_FRAME_SIZE / 1000.0;
+}
+
 static Result host_init_audio(Host* host) {
   host->audio.ready = FALSE;
   host_set_audio_volume(host, host->init.audio_volume);
@@ -141,6 +165,15 @@ static Result host_init_audio(Host* host) {
 
   host->audio.buffer = xcalloc(1, host->audio.spec.size);
   CHECK_MSG(host->audio.buffer != NULL, "Audio buffer allocation failed.\n");
+
+  if (host_is_audio_paced(host)) {
+    u32 size =
+        (u32)(host->init.audio_latency_ms * host_audio_bytes_per_ms(host));
+    size -= size % AUDIO_FRAME_SIZE;
+    host->audio.target_queued_size = MAX(size, AUDIO_FRAME_SIZE);
+  } else {
+    host->audio.target_queued_size = AUDIO_TARGET_QUEUED_SIZE;
+  }
   return OK;
   ON_ERROR_RETURN;
 }
@@ -155,6 +188,32 @@ static HostKeycode scancode_to_keycode(SDL_Scancode scancode) {
   return s_map[scancode];
 }
 
+static Bool is_joypad_keycode(HostKeycode keycode) {
+  switch (keycode) {
+    case HOST_KEYCODE_UP:
+    case HOST_KEYCODE_DOWN:
+    case HOST_KEYCODE_LEFT:
+    case HOST_KEYCODE_RIGHT:
+    case HOST_KEYCODE_Z:
+    case HOST_KEYCODE_X:
+    case HOST_KEYCODE_RETURN:
+    case HOST_KEYCODE_TAB:
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+static void host_note_input(Host* host, u32 timestamp) {
+  /* SDL event timestamps use SDL_GetTicks(), so convert to the performance
+   * counter clock used by host_get_time_ms(). */
+  Latency* latency = &host->latency;
+  latency->input_ms = host_get_time_ms(host) - (SDL_GetTicks() - timestamp);
+  latency->pending_audio = TRUE;
+  latency->pending_photon = TRUE;
+  latency->frame_ready = FALSE;
+}
+
 Bool host_poll_events(Host* host) {
   Emulator* e = host_get_emulator(host);
   Bool running = TRUE;
@@ -168,6 +227,9 @@ Bool host_poll_events(Host* host) {
         HostKeycode keycode = scancode_to_keycode(event.key.keysym.scancode);
         if (!host_ui_capture_keyboard(host->ui)) {
           host->key_state[keycode] = event.type == SDL_KEYDOWN;
+          if (is_joypad_keycode(keycode) && !event.key.repeat) {
+            host_note_input(host, event.key.timestamp);
+          }
         }
         if (event.type == SDL_KEYDOWN) {
           HOOK(key_down, keycode);
@@ -181,6 +243,10 @@ Bool host_poll_events(Host* host) {
           host->controller = SDL_GameControllerOpen(event.cdevice.which);
         }
         break;
+      case SDL_CONTROLLERBUTTONDOWN:
+      case SDL_CONTROLLERBUTTONUP:
+        host_note_input(host, event.cbutton.timestamp);
+        break;
       case SDL_CONTROLLERDEVICEREMOVED: {
         if (host->controller) {
           SDL_GameControllerClose(host->controller);
@@ -204,6 +270,13 @@ void host_begin_video(Host* host) {
 
 void host_end_video(Host* host) {
   host_ui_end_frame(host->ui);
+  Latency* latency = &host->latency;
+  if (latency->frame_ready) {
+    latency->stats.input_to_photon_ms =
+        host_get_time_ms(host) - latency->input_ms;
+    latency->pending_photon = FALSE;
+    latency->frame_ready = FALSE;
+  }
 }
 
 void host_reset_audio(Host* host) {
@@ -241,8 +314,17 @@ void host_render_audio(Host* host) {
     SDL_QueueAudio(audio->dev, audio->buffer, buffer_size);
     HOOK(audio_add_buffer, queued_size, queued_size + buffer_size);
     queued_size += buffer_size;
+    Latency* latency = &host->latency;
+    if (latency->pending_audio) {
+      /* The end of this buffer was emulated after the input was polled, and
+       * will be heard once everything queued before it has played. */
+      latency->stats.input_to_audio_ms =
+          host_get_time_ms(host) - latency->input_ms +
+          queued_size / host_audio_bytes_per_ms(host);
+      latency->pending_audio = FALSE;
+    }
   }
-  if (!audio->ready && queued_size >= AUDIO_TARGET_QUEUED_SIZE) {
+  if (!audio->ready && queued_size >= audio->target_queued_size) {
     HOOK(audio_buffer_ready, queued_size);
     audio->ready = TRUE;
     SDL_PauseAudioDevice(audio->dev, 0);
@@ -284,10 +366,35 @@ static void joypad_callback(JoypadButtons* joyp, void* user_data) {
 
   Ticks ticks = emulator_get_ticks(host_get_emulator(host));
   joypad_append_if_new(host->joypad_buffer, joyp, ticks);
+  if (host->replay_writer) {
+    replay_writer_append_joypad(host->replay_writer, joyp, ticks);
+  }
+}
+
+static Bool host_is_playing_back(Host* host) {
+  return host->init.joypad_filename || host->init.read_replay_filename;
+}
+
+static Result host_read_replay(Host* host, Emulator* e) {
+  Replay* replay = NULL;
+  CHECK(SUCCESS(replay_read_from_file(host->init.read_replay_filename, &replay,
+                                      &host->joypad_buffer)));
+  CHECK(SUCCESS(replay_check_rom(replay, e)));
+  CHECK(SUCCESS(
+      replay_seek_to_keyframe(replay, e, host->init.replay_keyframe)));
+  replay_delete(replay);
+  emulator_set_joypad_playback_callback(e, host->joypad_buffer,
+                                        &host->joypad_playback);
+  return OK;
+error:
+  replay_delete(replay);
+  return ERROR;
 }
 
 static Result host_init_joypad(Host* host, Emulator* e) {
-  if (host->init.joypad_filename) {
+  if (host->init.read_replay_filename) {
+    CHECK(SUCCESS(host_read_replay(host, e)));
+  } else if (host->init.joypad_filename) {
     FileData file_data;
     CHECK(SUCCESS(file_read(host->init.joypad_filename, &file_data)));
     CHECK(SUCCESS(joypad_read(&file_data, &host->joypad_buffer)));
@@ -302,20 +409,81 @@ static Result host_init_joypad(Host* host, Emulator* e) {
   ON_ERROR_RETURN;
 }
 
+static void host_stop_replay(Host* host) {
+  PRINT_ERROR("Unable to write replay, stopping.\n");
+  replay_writer_delete(host->replay_writer);
+  host->replay_writer = NULL;
+}
+
+/* Deferred until the emulator is about to run, so that anything the caller
+ * does to the state first (e.g. loading the battery save) is included. */
+static void write_pending_replay_keyframe(Host* host) {
+  if (host->replay_writer && host->replay_keyframe_pending &&
+      !host->rewind_state.rewinding) {
+    host->replay_keyframe_pending = FALSE;
+    if (!SUCCESS(replay_writer_append_keyframe(host->replay_writer,
+                                               host_get_emulator(host)))) {
+      host_stop_replay(host);
+    }
+  }
+}
+
+static void end_replay_frame(Host* host) {
+  if (host->replay_writer && !host->rewind_state.rewinding &&
+      !SUCCESS(replay_writer_end_frame(host->replay_writer,
+                                       host_get_emulator(host)))) {
+    host_stop_replay(host);
+  }
+}
+
+static void truncate_replay(Host* host) {
+  if (host->replay_writer) {
+    Ticks ticks = emulator_get_ticks(host_get_emulator(host));
+    if (SUCCESS(replay_writer_truncate(host->replay_writer, ticks,
+                                       &host->joypad_buffer->last_buttons))) {
+      host->replay_keyframe_pending = TRUE;
+    } else {
+      host_stop_replay(host);
+    }
+  }
+}
+
 static void append_rewind_state(Host* host) {
   if (host->rewind_state.rewinding) {
     return;
   }
 
-  rewind_append(host->rewind_buffer, host_get_emulator(host));
+  if (host->rewind_worker) {
+    rewind_worker_append(host->rewind_worker, host_get_emulator(host));
+  } else {
+    rewind_append(host->rewind_buffer, host_get_emulator(host));
+  }
+}
+
+static void host_lock_rewind_buffer(Host* host) {
+  if (host->rewind_worker) {
+    rewind_worker_lock(host->rewind_worker);
+  }
+}
+
+static void host_unlock_rewind_buffer(Host* host) {
+  if (host->rewind_worker) {
+    rewind_worker_unlock(host->rewind_worker);
+  }
 }
 
 Ticks host_get_rewind_oldest_ticks(struct Host* host) {
-  return rewind_get_oldest_ticks(host->rewind_buffer);
+  host_lock_rewind_buffer(host);
+  Ticks ticks = rewind_get_oldest_ticks(host->rewind_buffer);
+  host_unlock_rewind_buffer(host);
+  return ticks;
 }
 
 Ticks host_get_rewind_newest_ticks(struct Host* host) {
-  return rewind_get_newest_ticks(host->rewind_buffer);
+  host_lock_rewind_buffer(host);
+  Ticks ticks = rewind_get_newest_ticks(host->rewind_buffer);
+  host_unlock_rewind_buffer(host);
+  return ticks;
 }
 
 JoypadStats host_get_joypad_stats(struct Host* host) {
@@ -323,7 +491,21 @@ JoypadStats host_get_joypad_stats(struct Host* host) {
 }
 
 RewindStats host_get_rewind_stats(struct Host* host) {
-  return rewind_get_stats(host->rewind_buffer);
+  host_lock_rewind_buffer(host);
+  RewindStats stats = rewind_get_stats(host->rewind_buffer);
+  host_unlock_rewind_buffer(host);
+  return stats;
+}
+
+void host_set_rewind_codec(struct Host* host, RewindCodec codec) {
+  host->init.rewind.codec = codec;
+  host_lock_rewind_buffer(host);
+  rewind_set_codec(host->rewind_buffer, codec);
+  host_unlock_rewind_buffer(host);
+}
+
+void host_note_state_loaded(struct Host* host) {
+  truncate_replay(host);
 }
 
 Result host_write_joypad_to_file(struct Host* host, const char* filename) {
@@ -349,6 +531,10 @@ static void host_handle_event(Host* host, EmulatorEvent event) {
     }
 
     append_rewind_state(host);
+    end_replay_frame(host);
+    if (host->latency.pending_photon) {
+      host->latency.frame_ready = TRUE;
+    }
   }
   if (event & EMULATOR_EVENT_AUDIO_BUFFER_FULL) {
     host_render_audio(host);
@@ -359,9 +545,14 @@ static void host_handle_event(Host* host, EmulatorEvent event) {
 static EmulatorEvent host_run_until_ticks(struct Host* host, Ticks ticks) {
   Emulator* e = host_get_emulator(host);
   assert(emulator_get_ticks(e) <= ticks);
+  write_pending_replay_keyframe(host);
   EmulatorEvent event;
   do {
-    event = emulator_run_until(e, ticks);
+    if (host->socket_link && !host->rewind_state.rewinding) {
+      event = socket_link_run_until(host->socket_link, ticks);
+    } else {
+      event = emulator_run_until(e, ticks);
+    }
     host_handle_event(host, event);
   } while (!(event & (EMULATOR_EVENT_UNTIL_TICKS | EMULATOR_EVENT_BREAKPOINT |
                       EMULATOR_EVENT_INVALID_OPCODE)));
@@ -370,6 +561,11 @@ static EmulatorEvent host_run_until_ticks(struct Host* host, Ticks ticks) {
 
 void host_begin_rewind(Host* host) {
   assert(!host->rewind_state.rewinding);
+  /* Nothing is appended while rewinding, so once the pending states are in
+   * the buffer it can be used on this thread without locking. */
+  if (host->rewind_worker) {
+    rewind_worker_flush(host->rewind_worker);
+  }
   host->rewind_state.rewinding = TRUE;
 }
 
@@ -380,7 +576,7 @@ Result host_rewind_to_ticks(Host* host, Ticks ticks) {
   CHECK(SUCCESS(rewind_to_ticks(host->rewind_buffer, ticks, result)));
 
   Emulator* e = host_get_emulator(host);
-  CHECK(SUCCESS(emulator_read_state(e, &result->file_data)));
+  CHECK(SUCCESS(emulator_restore_state(e, &result->file_data)));
   assert(emulator_get_ticks(e) == result->info->ticks);
 
   if (emulator_get_ticks(e) < ticks) {
@@ -405,9 +601,10 @@ void host_end_rewind(Host* host) {
     Emulator* e = host_get_emulator(host);
     rewind_truncate_to(host->rewind_buffer, e,
                        &host->rewind_state.rewind_result);
-    if (!host->init.joypad_filename) {
+    if (!host_is_playing_back(host)) {
       joypad_truncate_to(host->joypad_buffer,
                          host->rewind_state.joypad_playback.current);
+      truncate_replay(host);
       /* Append the current joypad state. */
       JoypadButtons buttons;
       joypad_callback(&buttons, host);
@@ -422,6 +619,10 @@ Bool host_is_rewinding(Host* host) {
   return host->rewind_state.rewinding;
 }
 
+Bool host_is_linked(Host* host) {
+  return host->socket_link != NULL;
+}
+
 Result host_init(Host* host, Emulator* e) {
   CHECK_MSG(
       SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_GAMECONTROLLER) == 0,
@@ -429,8 +630,26 @@ Result host_init(Host* host, Emulator* e) {
   host_init_time(host);
   CHECK(SUCCESS(host_init_video(host)));
   CHECK(SUCCESS(host_init_audio(host)));
-  host_init_joypad(host, e);
+  CHECK(SUCCESS(host_init_joypad(host, e)));
+  if (host->init.write_replay_filename) {
+    CHECK_MSG(!host_is_playing_back(host),
+              "Can't write a replay while playing back input.\n");
+    host->replay_writer =
+        replay_writer_new(host->init.write_replay_filename, e, 0);
+    CHECK(host->replay_writer != NULL);
+    host->replay_keyframe_pending = TRUE;
+  }
   host->rewind_buffer = rewind_new(&host->init.rewind, e);
+  /* With only one CPU the worker thread would just add overhead. If it can't
+   * be started, states are appended on this thread instead. */
+  if (SDL_GetCPUCount() > 1) {
+    host->rewind_worker = rewind_worker_new(host->rewind_buffer, e);
+  }
+  if (host->init.link_socket_path) {
+    host->socket_link =
+        socket_link_new(e, host->joypad_buffer, host->init.link_socket_path);
+    CHECK(host->socket_link != NULL);
+  }
   host->last_ticks = emulator_get_ticks(e);
   return OK;
   ON_ERROR_RETURN;
@@ -446,9 +665,68 @@ EmulatorEvent host_run_ms(struct Host* host, f64 delta_ms) {
   return event;
 }
 
+static void host_flush_audio(Host* host, EmulatorEvent event) {
+  /* A full buffer has already been rendered by host_handle_event, and will be
+   * reset by the emulator on the next run. */
+  if (event & EMULATOR_EVENT_AUDIO_BUFFER_FULL) {
+    return;
+  }
+  Emulator* e = host_get_emulator(host);
+  if (audio_buffer_get_frames(emulator_get_audio_buffer(e)) > 0) {
+    host_render_audio(host);
+    emulator_reset_audio_buffer(e);
+  }
+}
+
+Bool host_is_audio_paced(Host* host) {
+  return host->init.audio_latency_ms > 0;
+}
+
+EmulatorEvent host_run_audio_paced(Host* host, f64 frame_ms) {
+  assert(!host->rewind_state.rewinding);
+  if (host->config.no_sync) {
+    return host_run_ms(host, frame_ms);
+  }
+
+  Emulator* e = host_get_emulator(host);
+  Ticks slice_ticks = AUDIO_PACED_SLICE_MS * CPU_TICKS_PER_SECOND / 1000;
+  Ticks max_ticks =
+      emulator_get_ticks(e) + AUDIO_PACED_MAX_MS * CPU_TICKS_PER_SECOND / 1000;
+  f64 end_ms = host_get_time_ms(host) + frame_ms - AUDIO_PACED_FRAME_MARGIN_MS;
+  EmulatorEvent event = 0;
+  /* Top up the queue a slice at a time for the whole frame, so it never holds
+   * much more than the target. */
+  do {
+    if (SDL_GetQueuedAudioSize(host->audio.dev) <
+            host->audio.target_queued_size &&
+        emulator_get_ticks(e) < max_ticks) {
+      EmulatorEvent slice_event =
+          host_run_until_ticks(host, emulator_get_ticks(e) + slice_ticks);
+      host_flush_audio(host, slice_event);
+      event |= slice_event;
+      if (slice_event &
+          (EMULATOR_EVENT_BREAKPOINT | EMULATOR_EVENT_INVALID_OPCODE)) {
+        break;
+      }
+    } else {
+      SDL_Delay(AUDIO_PACED_SLICE_MS);
+    }
+  } while (host_get_time_ms(host) < end_ms);
+  host->last_ticks = emulator_get_ticks(e);
+  return event;
+}
+
+HostLatencyStats host_get_latency_stats(Host* host) {
+  HostLatencyStats stats = host->latency.stats;
+  stats.audio_queued_ms =
+      SDL_GetQueuedAudioSize(host->audio.dev) / host_audio_bytes_per_ms(host);
+  return stats;
+}
+
 EmulatorEvent host_step(Host* host) {
   assert(!host->rewind_state.rewinding);
   Emulator* e = host_get_emulator(host);
+  write_pending_replay_keyframe(host);
   EmulatorEvent event = emulator_step(e);
   host_handle_event(host, event);
   host->last_ticks = emulator_get_ticks(e);
@@ -470,6 +748,8 @@ error:
 
 void host_delete(Host* host) {
   if (host) {
+    rewind_worker_delete(host->rewind_worker);
+    replay_writer_delete(host->replay_writer);
     if (host->init.use_sgb_border) {
       host_destroy_texture(host, host->sgb_fb_texture);
     }
@@ -479,6 +759,7 @@ void host_delete(Host* host) {
     SDL_Quit();
     joypad_delete(host->joypad_buffer);
     rewind_delete(host->rewind_buffer);
+    socket_link_delete(host->socket_link);
     xfree(host->audio.buffer);
     xfree(host);
   }
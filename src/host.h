@@ -127,7 +127,21 @@ typedef struct HostInit {
   f32 audio_volume;
   RewindInit rewind;
   const char* joypad_filename;
+  /* If set, play back the replay in this file, starting from keyframe
+   * |replay_keyframe|, instead of reading input. */
+  const char* read_replay_filename;
+  u32 replay_keyframe;
+  /* If set, stream a replay of this session to this file as it is played. */
+  const char* write_replay_filename;
   Bool use_sgb_border;
+  /* If non-zero, run the emulator in small slices whenever the audio queue
+   * drops below this many milliseconds, instead of once per video frame.
+   * The device still pulls audio_frames at a time, so keep that buffer no
+   * larger than this latency, or it will underflow. */
+  f64 audio_latency_ms;
+  /* If set, connect the link cable to another process over the Unix domain
+   * socket at this path. */
+  const char* link_socket_path;
 } HostInit;
 
 typedef struct HostConfig {
@@ -135,6 +149,12 @@ typedef struct HostConfig {
   Bool fullscreen;
 } HostConfig;
 
+typedef struct HostLatencyStats {
+  f64 input_to_audio_ms;  /* Key/button event to queued audio playing. */
+  f64 input_to_photon_ms; /* Key/button event to next presented frame. */
+  f64 audio_queued_ms;    /* Audio currently queued on the device. */
+} HostLatencyStats;
+
 typedef enum HostTextureFormat {
   HOST_TEXTURE_FORMAT_RGBA,
   HOST_TEXTURE_FORMAT_U8,
@@ -151,6 +171,11 @@ struct Host* host_new(const HostInit*, struct Emulator*);
 void host_delete(struct Host*);
 Bool host_poll_events(struct Host*);
 EmulatorEvent host_run_ms(struct Host*, f64 delta_ms);
+/* Runs the emulator for about |frame_ms| of wall time, in small slices
+ * whenever the audio queue drops below the target latency. */
+EmulatorEvent host_run_audio_paced(struct Host*, f64 frame_ms);
+Bool host_is_audio_paced(struct Host*);
+HostLatencyStats host_get_latency_stats(struct Host*);
 EmulatorEvent host_step(struct Host*);
 void host_render_audio(struct Host*);
 void host_reset_audio(struct Host*);
@@ -174,13 +199,18 @@ Ticks host_get_rewind_oldest_ticks(struct Host*);
 Ticks host_get_rewind_newest_ticks(struct Host*);
 JoypadStats host_get_joypad_stats(struct Host*);
 RewindStats host_get_rewind_stats(struct Host*);
+void host_set_rewind_codec(struct Host*, RewindCodec);
 
 Result host_write_joypad_to_file(struct Host*, const char* filename);
+/* Call after replacing the emulator's state (e.g. loading a save state), so
+ * the replay being written continues from it. */
+void host_note_state_loaded(struct Host*);
 
 void host_begin_rewind(struct Host*);
 Result host_rewind_to_ticks(struct Host*, Ticks ticks);
 void host_end_rewind(struct Host*);
 Bool host_is_rewinding(struct Host*);
+Bool host_is_linked(struct Host*);
 
 HostTexture* host_get_frame_buffer_texture(struct Host*);
 HostTexture* host_create_texture(struct Host*, int w, int h, HostTextureFormat);
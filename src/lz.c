@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "lz.h"
+
+#include <string.h>
+
+/* The LZ4 block format is a list of sequences. Each is a token byte (literal
+ * count in the high nibble, match length - 4 in the low nibble), optional
+ * extra literal count bytes, the literals, then the little-endian 16-bit match
+ * offset and optional extra match length bytes. A nibble of 15 is followed by
+ * extra bytes that are summed until one is less than 255. The last sequence
+ * has only literals. */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+/* The last 5 bytes are always literals, and the last match must start at
+ * least 12 bytes before the end. */
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_FIND_LIMIT 12
+#define LZ_HASH_BITS 12
+/* Skip ahead faster the longer we go without finding a match. */
+#define LZ_SKIP_SHIFT 6
+
+static u32 read_u32(const u8* src) {
+  u32 result;
+  memcpy(&result, src, sizeof(result));
+  return result;
+}
+
+static u64 read_u64(const u8* src) {
+  u64 result;
+  memcpy(&result, src, sizeof(result));
+  return result;
+}
+
+static u32 hash_u32(u32 value) {
+  return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static u8* write_length(size_t length, u8* dst, u8* dst_max_end) {
+  for (; length >= 255; length -= 255) {
+    if (dst >= dst_max_end) {
+      return NULL;
+    }
+    *dst++ = 255;
+  }
+  if (dst >= dst_max_end) {
+    return NULL;
+  }
+  *dst++ = (u8)length;
+  return dst;
+}
+
+/* |match_length| is 0 for the last sequence. */
+static u8* write_sequence(const u8* literals, size_t literal_count,
+                          size_t offset, size_t match_length, u8* dst,
+                          u8* dst_max_end) {
+  if (dst >= dst_max_end) {
+    return NULL;
+  }
+  u8* token = dst++;
+  *token = (u8)(MIN(literal_count, 15) << 4);
+  if (literal_count >= 15) {
+    dst = write_length(literal_count - 15, dst, dst_max_end);
+    if (!dst) {
+      return NULL;
+    }
+  }
+  if (literal_count > (size_t)(dst_max_end - dst)) {
+    return NULL;
+  }
+  memcpy(dst, literals, literal_count);
+  dst += literal_count;
+
+  if (match_length) {
+    if (dst_max_end - dst < 2) {
+      return NULL;
+    }
+    *dst++ = offset & 0xff;
+    *dst++ = (offset >> 8) & 0xff;
+    size_t length = match_length - LZ_MIN_MATCH;
+    *token |= (u8)MIN(length, 15);
+    if (length >= 15) {
+      dst = write_length(length - 15, dst, dst_max_end);
+    }
+  }
+  return dst;
+}
+
+u8* lz_compress(const u8* src, size_t src_size, u8* dst, u8* dst_max_end) {
+  const u8* src_end = src + src_size;
+  const u8* anchor = src;
+  if (src_size > LZ_MATCH_FIND_LIMIT) {
+    /* Positions (relative to src) of the last time a hash was seen. A match
+     * is only used if its bytes match, so stale entries are harmless. */
+    u32 table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const u8* ip = src;
+    const u8* ip_limit = src_end - LZ_MATCH_FIND_LIMIT;
+    const u8* match_limit = src_end - LZ_LAST_LITERALS;
+    while (ip < ip_limit) {
+      u32 value = read_u32(ip);
+      u32 hash = hash_u32(value);
+      const u8* ref = src + table[hash];
+      table[hash] = (u32)(ip - src);
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read_u32(ref) != value) {
+        ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+        continue;
+      }
+
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const u8* end = ip + LZ_MIN_MATCH;
+      const u8* ref_end = ref + LZ_MIN_MATCH;
+      while (end + 8 <= match_limit && read_u64(end) == read_u64(ref_end)) {
+        end += 8;
+        ref_end += 8;
+      }
+      while (end < match_limit && *end == *ref_end) {
+        end++;
+        ref_end++;
+      }
+
+      dst = write_sequence(anchor, ip - anchor, ip - ref, end - ip, dst,
+                           dst_max_end);
+      if (!dst) {
+        return NULL;
+      }
+      ip = anchor = end;
+      if (ip < ip_limit) {
+        table[hash_u32(read_u32(ip - 2))] = (u32)(ip - 2 - src);
+      }
+    }
+  }
+  return write_sequence(anchor, src_end - anchor, 0, 0, dst, dst_max_end);
+}
+
+static Result read_length(const u8** src, const u8* src_end, size_t* length) {
+  const u8* s = *src;
+  u8 byte;
+  do {
+    CHECK(s < src_end);
+    byte = *s++;
+    *length += byte;
+  } while (byte == 255);
+  *src = s;
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+Result lz_decompress(const u8* src, size_t src_size, u8* dst, u8* dst_end) {
+  const u8* src_end = src + src_size;
+  u8* dst_begin = dst;
+  while (1) {
+    CHECK(src < src_end);
+    u8 token = *src++;
+    size_t length = token >> 4;
+    if (length == 15) {
+      CHECK(SUCCESS(read_length(&src, src_end, &length)));
+    }
+    CHECK(length <= (size_t)(src_end - src));
+    CHECK(length <= (size_t)(dst_end - dst));
+    memcpy(dst, src, length);
+    src += length;
+    dst += length;
+    if (src == src_end) {
+      break;
+    }
+
+    CHECK(src_end - src >= 2);
+    size_t offset = src[0] | (src[1] << 8);
+    src += 2;
+    CHECK(offset != 0 && offset <= (size_t)(dst - dst_begin));
+    length = (token & 15) + LZ_MIN_MATCH;
+    if ((token & 15) == 15) {
+      CHECK(SUCCESS(read_length(&src, src_end, &length)));
+    }
+    CHECK(length <= (size_t)(dst_end - dst));
+    /* The match may overlap the bytes being written; copy the repeated
+     * pattern, doubling in size each time. */
+    const u8* ref = dst - offset;
+    if (offset == 1) {
+      memset(dst, *ref, length);
+      dst += length;
+    } else {
+      while (length > 0) {
+        size_t count = MIN(length, (size_t)(dst - ref));
+        memcpy(dst, ref, count);
+        dst += count;
+        length -= count;
+      }
+    }
+  }
+  CHECK(dst == dst_end);
+  return OK;
+  ON_ERROR_RETURN;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef BINJGB_LZ_H_
+#define BINJGB_LZ_H_
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A small, fast LZ77 compressor, writing the LZ4 block format (no frame
+ * header). It favors speed over ratio: matches are found with a single hash
+ * table lookup. */
+
+/* Returns the end of the compressed data, or NULL if it doesn't fit before
+ * |dst_max_end|. */
+u8* lz_compress(const u8* src, size_t src_size, u8* dst, u8* dst_max_end);
+
+/* Fails unless |src| decompresses to exactly |dst_end - dst| bytes. */
+Result lz_decompress(const u8* src, size_t src_size, u8* dst, u8* dst_end);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BINJGB_LZ_H_ */
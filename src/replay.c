@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "replay.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "lz.h"
+
+#define REPLAY_MAGIC 0x52474a42 /* "BJGR" */
+#define REPLAY_VERSION 1
+#define REPLAY_HEADER_SIZE 16     /* magic, version, ROM hash. */
+#define REPLAY_CHUNK_HEADER_SIZE 8 /* type, payload size. */
+#define REPLAY_KEYFRAME_HEADER_SIZE 12 /* ticks, state size. */
+#define REPLAY_JOYPAD_RECORD_SIZE 9    /* ticks, buttons. */
+#define REPLAY_JOYPAD_DEFAULT_CAPACITY 64
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+typedef enum {
+  ReplayChunk_Keyframe = 1,
+  ReplayChunk_Joypad = 2,
+  ReplayChunk_Truncate = 3,
+} ReplayChunk;
+
+struct ReplayWriter {
+  FILE* file;
+  u32 frames_per_keyframe;
+  u32 frames_until_keyframe;
+  FileData state;
+  FileData compressed;
+  JoypadButtons last_buttons;
+  u8* joypad_records; /* Buffered until the end of the frame. */
+  size_t joypad_count;
+  size_t joypad_capacity;
+};
+
+static u64 hash_rom(struct Emulator* e) {
+  const FileData* file_data =
+      emulator_rom_get_file_data(emulator_get_rom(e));
+  u64 hash = FNV_OFFSET_BASIS;
+  size_t i;
+  for (i = 0; i < file_data->size; ++i) {
+    hash = (hash ^ file_data->data[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static u8* write_u32(u8* dst, u32 value) {
+  memcpy(dst, &value, sizeof(value));
+  return dst + sizeof(value);
+}
+
+static u8* write_u64(u8* dst, u64 value) {
+  memcpy(dst, &value, sizeof(value));
+  return dst + sizeof(value);
+}
+
+static u32 read_u32(const u8* src) {
+  u32 value;
+  memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+static u64 read_u64(const u8* src) {
+  u64 value;
+  memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+static Result write_chunk(ReplayWriter* writer, ReplayChunk type,
+                          const u8* header, size_t header_size,
+                          const u8* payload, size_t payload_size) {
+  u8 chunk_header[REPLAY_CHUNK_HEADER_SIZE];
+  write_u32(write_u32(chunk_header, type),
+            (u32)(header_size + payload_size));
+  CHECK_MSG(fwrite(chunk_header, sizeof(chunk_header), 1, writer->file) == 1 &&
+                fwrite(header, header_size, 1, writer->file) == 1 &&
+                (payload_size == 0 ||
+                 fwrite(payload, payload_size, 1, writer->file) == 1),
+            "fwrite failed.\n");
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+ReplayWriter* replay_writer_new(const char* filename, struct Emulator* e,
+                                u32 frames_per_keyframe) {
+  ReplayWriter* writer = xcalloc(1, sizeof(ReplayWriter));
+  writer->frames_per_keyframe = frames_per_keyframe
+                                    ? frames_per_keyframe
+                                    : REPLAY_DEFAULT_FRAMES_PER_KEYFRAME;
+  writer->file = fopen(filename, "wb");
+  CHECK_MSG(writer->file, "unable to open file \"%s\".\n", filename);
+
+  u8 header[REPLAY_HEADER_SIZE];
+  write_u64(write_u32(write_u32(header, REPLAY_MAGIC), REPLAY_VERSION),
+            hash_rom(e));
+  CHECK_MSG(fwrite(header, sizeof(header), 1, writer->file) == 1,
+            "fwrite failed.\n");
+
+  emulator_init_state_file_data(e, &writer->state);
+  /* Enough for an incompressible state. */
+  writer->compressed.size = writer->state.size + writer->state.size / 255 + 16;
+  writer->compressed.data = xmalloc(writer->compressed.size);
+  return writer;
+error:
+  replay_writer_delete(writer);
+  return NULL;
+}
+
+void replay_writer_delete(ReplayWriter* writer) {
+  if (!writer) {
+    return;
+  }
+  if (writer->file) {
+    fclose(writer->file);
+  }
+  file_data_delete(&writer->state);
+  file_data_delete(&writer->compressed);
+  xfree(writer->joypad_records);
+  xfree(writer);
+}
+
+static Result write_joypad_records(ReplayWriter* writer) {
+  if (writer->joypad_count == 0) {
+    return OK;
+  }
+  CHECK(SUCCESS(write_chunk(writer, ReplayChunk_Joypad, writer->joypad_records,
+                            writer->joypad_count * REPLAY_JOYPAD_RECORD_SIZE,
+                            NULL, 0)));
+  writer->joypad_count = 0;
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+Result replay_writer_append_keyframe(ReplayWriter* writer,
+                                     struct Emulator* e) {
+  CHECK(SUCCESS(write_joypad_records(writer)));
+  CHECK(SUCCESS(emulator_write_state(e, &writer->state)));
+  u8* end = lz_compress(writer->state.data, writer->state.size,
+                        writer->compressed.data,
+                        writer->compressed.data + writer->compressed.size);
+  CHECK(end != NULL);
+
+  u8 header[REPLAY_KEYFRAME_HEADER_SIZE];
+  write_u32(write_u64(header, emulator_get_ticks(e)), (u32)writer->state.size);
+  CHECK(SUCCESS(write_chunk(writer, ReplayChunk_Keyframe, header,
+                            sizeof(header), writer->compressed.data,
+                            end - writer->compressed.data)));
+  CHECK_MSG(fflush(writer->file) == 0, "fflush failed.\n");
+  writer->frames_until_keyframe = writer->frames_per_keyframe;
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+static void buffer_joypad_record(ReplayWriter* writer, JoypadButtons* buttons,
+                                 Ticks ticks) {
+  if (writer->joypad_count == writer->joypad_capacity) {
+    writer->joypad_capacity = writer->joypad_capacity
+                                  ? writer->joypad_capacity * 2
+                                  : REPLAY_JOYPAD_DEFAULT_CAPACITY;
+    writer->joypad_records =
+        xrealloc(writer->joypad_records,
+                 writer->joypad_capacity * REPLAY_JOYPAD_RECORD_SIZE);
+  }
+  u8* record =
+      writer->joypad_records + writer->joypad_count++ * REPLAY_JOYPAD_RECORD_SIZE;
+  *write_u64(record, ticks) = joypad_pack_buttons(buttons);
+  writer->last_buttons = *buttons;
+}
+
+void replay_writer_append_joypad(ReplayWriter* writer, JoypadButtons* buttons,
+                                 Ticks ticks) {
+  if (joypad_pack_buttons(buttons) !=
+      joypad_pack_buttons(&writer->last_buttons)) {
+    buffer_joypad_record(writer, buttons, ticks);
+  }
+}
+
+Result replay_writer_end_frame(ReplayWriter* writer, struct Emulator* e) {
+  if (writer->frames_until_keyframe == 0 ||
+      --writer->frames_until_keyframe == 0) {
+    CHECK(SUCCESS(replay_writer_append_keyframe(writer, e)));
+  } else if (writer->joypad_count != 0) {
+    CHECK(SUCCESS(write_joypad_records(writer)));
+    CHECK_MSG(fflush(writer->file) == 0, "fflush failed.\n");
+  }
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+Result replay_writer_truncate(ReplayWriter* writer, Ticks ticks,
+                              JoypadButtons* buttons) {
+  while (writer->joypad_count &&
+         read_u64(writer->joypad_records +
+                  (writer->joypad_count - 1) * REPLAY_JOYPAD_RECORD_SIZE) >
+             ticks) {
+    writer->joypad_count--;
+  }
+  CHECK(SUCCESS(write_joypad_records(writer)));
+  u8 header[sizeof(u64)];
+  write_u64(header, ticks);
+  CHECK(SUCCESS(write_chunk(writer, ReplayChunk_Truncate, header,
+                            sizeof(header), NULL, 0)));
+  buffer_joypad_record(writer, buttons, ticks);
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+Result replay_read_from_file(const char* filename, Replay** out_replay,
+                             JoypadBuffer** out_joypad_buffer) {
+  Replay* replay = xcalloc(1, sizeof(Replay));
+  JoypadState* joypad_states = NULL;
+  size_t joypad_count = 0, joypad_capacity = 0;
+  size_t keyframe_capacity = 0;
+  CHECK(SUCCESS(file_read(filename, &replay->file_data)));
+
+  const u8* data = replay->file_data.data;
+  size_t size = replay->file_data.size;
+  CHECK_MSG(size >= REPLAY_HEADER_SIZE && read_u32(data) == REPLAY_MAGIC,
+            "\"%s\" is not a replay file.\n", filename);
+  CHECK_MSG(read_u32(data + 4) == REPLAY_VERSION,
+            "Unsupported replay version %u.\n", read_u32(data + 4));
+  replay->rom_hash = read_u64(data + 8);
+
+  size_t offset = REPLAY_HEADER_SIZE;
+  while (size - offset >= REPLAY_CHUNK_HEADER_SIZE) {
+    u32 type = read_u32(data + offset);
+    size_t chunk_size = read_u32(data + offset + 4);
+    const u8* chunk = data + offset + REPLAY_CHUNK_HEADER_SIZE;
+    if (chunk_size > size - offset - REPLAY_CHUNK_HEADER_SIZE) {
+      /* Cut off while it was being written. */
+      break;
+    }
+    offset += REPLAY_CHUNK_HEADER_SIZE + chunk_size;
+
+    switch (type) {
+      case ReplayChunk_Keyframe: {
+        CHECK_MSG(chunk_size > REPLAY_KEYFRAME_HEADER_SIZE,
+                  "Bad keyframe size %zu.\n", chunk_size);
+        Ticks ticks = read_u64(chunk);
+        ReplayKeyframe* last =
+            replay->keyframe_count
+                ? &replay->keyframes[replay->keyframe_count - 1]
+                : NULL;
+        if (last && last->ticks == ticks) {
+          /* Written again after truncating to it. */
+          replay->keyframe_count--;
+        } else {
+          CHECK_MSG(!last || last->ticks < ticks,
+                    "Expected keyframe ticks to be sorted, got %" PRIu64
+                    " then %" PRIu64 "\n",
+                    last->ticks, ticks);
+        }
+        if (replay->keyframe_count == keyframe_capacity) {
+          keyframe_capacity = keyframe_capacity ? keyframe_capacity * 2 : 16;
+          replay->keyframes = xrealloc(
+              replay->keyframes, keyframe_capacity * sizeof(ReplayKeyframe));
+        }
+        ReplayKeyframe* keyframe = &replay->keyframes[replay->keyframe_count++];
+        keyframe->ticks = ticks;
+        keyframe->state_size = read_u32(chunk + 8);
+        keyframe->offset = chunk + REPLAY_KEYFRAME_HEADER_SIZE - data;
+        keyframe->size = chunk_size - REPLAY_KEYFRAME_HEADER_SIZE;
+        break;
+      }
+
+      case ReplayChunk_Joypad: {
+        CHECK_MSG(chunk_size % REPLAY_JOYPAD_RECORD_SIZE == 0,
+                  "Bad joypad chunk size %zu.\n", chunk_size);
+        size_t count = chunk_size / REPLAY_JOYPAD_RECORD_SIZE;
+        if (joypad_count + count > joypad_capacity) {
+          joypad_capacity = MAX(joypad_capacity * 2, joypad_count + count);
+          joypad_states =
+              xrealloc(joypad_states, joypad_capacity * sizeof(JoypadState));
+        }
+        size_t i;
+        for (i = 0; i < count; ++i) {
+          const u8* record = chunk + i * REPLAY_JOYPAD_RECORD_SIZE;
+          JoypadState* state = &joypad_states[joypad_count];
+          state->ticks = read_u64(record);
+          state->buttons = record[8];
+          CHECK_MSG(joypad_count == 0 || state[-1].ticks <= state->ticks,
+                    "Expected joypad ticks to be sorted, got %" PRIu64
+                    " then %" PRIu64 "\n",
+                    state[-1].ticks, state->ticks);
+          joypad_count++;
+        }
+        break;
+      }
+
+      case ReplayChunk_Truncate: {
+        CHECK_MSG(chunk_size == sizeof(u64), "Bad truncate chunk size %zu.\n",
+                  chunk_size);
+        Ticks ticks = read_u64(chunk);
+        while (replay->keyframe_count &&
+               replay->keyframes[replay->keyframe_count - 1].ticks > ticks) {
+          replay->keyframe_count--;
+        }
+        while (joypad_count && joypad_states[joypad_count - 1].ticks > ticks) {
+          joypad_count--;
+        }
+        break;
+      }
+
+      default:
+        /* Skip chunks from newer versions. */
+        break;
+    }
+  }
+  CHECK_MSG(replay->keyframe_count != 0, "\"%s\" has no keyframes.\n",
+            filename);
+
+  JoypadBuffer* joypad_buffer = joypad_new();
+  size_t i;
+  for (i = 0; i < joypad_count; ++i) {
+    JoypadButtons buttons = joypad_unpack_buttons(joypad_states[i].buttons);
+    joypad_append(joypad_buffer, &buttons, joypad_states[i].ticks);
+  }
+  xfree(joypad_states);
+  *out_replay = replay;
+  *out_joypad_buffer = joypad_buffer;
+  return OK;
+error:
+  xfree(joypad_states);
+  replay_delete(replay);
+  return ERROR;
+}
+
+void replay_delete(Replay* replay) {
+  if (!replay) {
+    return;
+  }
+  file_data_delete(&replay->file_data);
+  xfree(replay->keyframes);
+  xfree(replay);
+}
+
+Result replay_check_rom(Replay* replay, struct Emulator* e) {
+  u64 rom_hash = hash_rom(e);
+  CHECK_MSG(replay->rom_hash == rom_hash,
+            "Replay was recorded with a different ROM (hash %016" PRIx64
+            ", expected %016" PRIx64 ").\n",
+            replay->rom_hash, rom_hash);
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+Result replay_seek_to_keyframe(Replay* replay, struct Emulator* e,
+                               size_t index) {
+  FileData state;
+  ZERO_MEMORY(state);
+  CHECK_MSG(index < replay->keyframe_count,
+            "Keyframe %zu out of range, replay has %zu.\n", index,
+            replay->keyframe_count);
+  ReplayKeyframe* keyframe = &replay->keyframes[index];
+  state.size = keyframe->state_size;
+  state.data = xmalloc(state.size);
+  CHECK_MSG(SUCCESS(lz_decompress(replay->file_data.data + keyframe->offset,
+                                  keyframe->size, state.data,
+                                  state.data + state.size)),
+            "Keyframe %zu is corrupt.\n", index);
+  CHECK(SUCCESS(emulator_read_state(e, &state)));
+  file_data_delete(&state);
+  return OK;
+error:
+  file_data_delete(&state);
+  return ERROR;
+}
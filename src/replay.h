@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef BINJGB_REPLAY_H_
+#define BINJGB_REPLAY_H_
+
+#include "common.h"
+#include "joypad.h"
+
+struct Emulator;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A replay file is a header (with a hash of the ROM) followed by a stream of
+ * chunks, each appended as it is produced:
+ *
+ *   keyframe: the LZ-compressed emulator state at some ticks
+ *   joypad:   the joypad changes since the previous joypad chunk
+ *   truncate: the emulator's state jumped back (e.g. after rewinding), so
+ *             drop everything recorded after these ticks
+ *
+ * There is no trailing index, so a file cut off by a crash is still valid up
+ * to its last complete chunk. When reading, the chunk headers are scanned
+ * once to build the keyframe index. */
+
+#define REPLAY_DEFAULT_FRAMES_PER_KEYFRAME 600 /* ~10 seconds. */
+
+typedef struct ReplayWriter ReplayWriter;
+
+/* Writes the header; the first keyframe must be appended before running. */
+ReplayWriter* replay_writer_new(const char* filename, struct Emulator*,
+                                u32 frames_per_keyframe);
+void replay_writer_delete(ReplayWriter*);
+
+Result replay_writer_append_keyframe(ReplayWriter*, struct Emulator*);
+/* Buffers |buttons| if they changed. Call from the joypad callback. */
+void replay_writer_append_joypad(ReplayWriter*, JoypadButtons*, Ticks);
+/* Writes the buffered joypad changes, then a keyframe if one is due, and
+ * flushes the file. */
+Result replay_writer_end_frame(ReplayWriter*, struct Emulator*);
+/* Drops everything after |ticks| (e.g. after rewinding or loading a state),
+ * then continues from |buttons|. A keyframe must be appended before running
+ * again. */
+Result replay_writer_truncate(ReplayWriter*, Ticks, JoypadButtons* buttons);
+
+typedef struct {
+  Ticks ticks;
+  size_t offset; /* Of the compressed state in the file. */
+  size_t size;
+  size_t state_size; /* Uncompressed. */
+} ReplayKeyframe;
+
+typedef struct {
+  FileData file_data;
+  u64 rom_hash;
+  ReplayKeyframe* keyframes; /* Sorted by ticks. */
+  size_t keyframe_count;
+} Replay;
+
+/* The joypad changes are returned as a new JoypadBuffer, owned by the
+ * caller. */
+Result replay_read_from_file(const char* filename, Replay** out_replay,
+                             JoypadBuffer** out_joypad_buffer);
+void replay_delete(Replay*);
+
+/* Fails if the replay was recorded with a different ROM. */
+Result replay_check_rom(Replay*, struct Emulator*);
+Result replay_seek_to_keyframe(Replay*, struct Emulator*, size_t index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BINJGB_REPLAY_H_ */
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "rewind-worker.h"
+
+#include <string.h>
+
+#include <SDL.h>
+
+#include "emulator.h"
+
+/* Enough to ride out the worker thread not being scheduled for a few
+ * frames. */
+#define REWIND_WORKER_SLOT_COUNT 4
+
+typedef struct {
+  Ticks ticks;
+  FileData state;
+  u32* dirty_pages; /* Pages updated since the previous slot's state. */
+  u32* stale_pages; /* Pages that differ from the capture. */
+} RewindWorkerSlot;
+
+struct RewindWorker {
+  RewindBuffer* buffer;
+  SDL_Thread* thread;
+  SDL_mutex* buffer_mutex; /* Held by the worker while appending. */
+  SDL_mutex* queue_mutex;  /* Guards first_slot, slot_count and quit. */
+  SDL_cond* queue_cond;    /* Signaled when a slot is filled or freed. */
+  RewindWorkerSlot slots[REWIND_WORKER_SLOT_COUNT];
+  u32 first_slot; /* The oldest filled slot. */
+  u32 slot_count; /* Filled slots, including the one being appended. */
+  Bool quit;
+
+  /* Only used by the emulator thread. It is brought up to date with
+   * emulator_update_state, then its stale pages are copied to a slot. */
+  FileData capture;
+  u32* capture_dirty_pages;
+  size_t dirty_pages_size;
+};
+
+static int worker_thread(void* user_data) {
+  RewindWorker* worker = user_data;
+  SDL_LockMutex(worker->queue_mutex);
+  while (1) {
+    while (worker->slot_count == 0 && !worker->quit) {
+      SDL_CondWait(worker->queue_cond, worker->queue_mutex);
+    }
+    if (worker->quit) {
+      break;
+    }
+    /* The emulator thread won't touch this slot until it is freed below. */
+    RewindWorkerSlot* slot = &worker->slots[worker->first_slot];
+    SDL_UnlockMutex(worker->queue_mutex);
+
+    SDL_LockMutex(worker->buffer_mutex);
+    rewind_append_state(worker->buffer, slot->ticks, &slot->state,
+                        slot->dirty_pages);
+    SDL_UnlockMutex(worker->buffer_mutex);
+
+    SDL_LockMutex(worker->queue_mutex);
+    worker->first_slot = (worker->first_slot + 1) % REWIND_WORKER_SLOT_COUNT;
+    worker->slot_count--;
+    SDL_CondBroadcast(worker->queue_cond);
+  }
+  SDL_UnlockMutex(worker->queue_mutex);
+  return 0;
+}
+
+RewindWorker* rewind_worker_new(RewindBuffer* buffer, Emulator* e) {
+  RewindWorker* worker = xcalloc(1, sizeof(RewindWorker));
+  worker->buffer = buffer;
+  worker->dirty_pages_size = buffer->dirty_pages_size;
+  emulator_init_state_file_data(e, &worker->capture);
+  (void)emulator_write_state(e, &worker->capture);
+  worker->capture_dirty_pages = xcalloc(1, worker->dirty_pages_size);
+  int i;
+  for (i = 0; i < REWIND_WORKER_SLOT_COUNT; ++i) {
+    emulator_init_state_file_data(e, &worker->slots[i].state);
+    worker->slots[i].dirty_pages = xcalloc(1, worker->dirty_pages_size);
+    worker->slots[i].stale_pages = xmalloc(worker->dirty_pages_size);
+    memset(worker->slots[i].stale_pages, 0xff, worker->dirty_pages_size);
+  }
+
+  worker->buffer_mutex = SDL_CreateMutex();
+  worker->queue_mutex = SDL_CreateMutex();
+  worker->queue_cond = SDL_CreateCond();
+  CHECK_MSG(worker->buffer_mutex && worker->queue_mutex && worker->queue_cond,
+            "SDL_CreateMutex failed: %s\n", SDL_GetError());
+  worker->thread = SDL_CreateThread(worker_thread, "rewind", worker);
+  CHECK_MSG(worker->thread != NULL, "SDL_CreateThread failed: %s\n",
+            SDL_GetError());
+  return worker;
+error:
+  rewind_worker_delete(worker);
+  return NULL;
+}
+
+void rewind_worker_delete(RewindWorker* worker) {
+  if (!worker) {
+    return;
+  }
+  if (worker->thread) {
+    SDL_LockMutex(worker->queue_mutex);
+    worker->quit = TRUE;
+    SDL_CondBroadcast(worker->queue_cond);
+    SDL_UnlockMutex(worker->queue_mutex);
+    SDL_WaitThread(worker->thread, NULL);
+  }
+  if (worker->queue_cond) {
+    SDL_DestroyCond(worker->queue_cond);
+  }
+  if (worker->queue_mutex) {
+    SDL_DestroyMutex(worker->queue_mutex);
+  }
+  if (worker->buffer_mutex) {
+    SDL_DestroyMutex(worker->buffer_mutex);
+  }
+  int i;
+  for (i = 0; i < REWIND_WORKER_SLOT_COUNT; ++i) {
+    xfree(worker->slots[i].stale_pages);
+    xfree(worker->slots[i].dirty_pages);
+    file_data_delete(&worker->slots[i].state);
+  }
+  xfree(worker->capture_dirty_pages);
+  file_data_delete(&worker->capture);
+  xfree(worker);
+}
+
+static void copy_stale_pages(RewindWorker* worker, RewindWorkerSlot* slot) {
+  size_t size = worker->capture.size;
+  size_t i, bit;
+  for (i = 0; i < worker->dirty_pages_size / sizeof(u32); ++i) {
+    u32 bits = slot->stale_pages[i];
+    for (bit = 0; bits; ++bit, bits >>= 1) {
+      size_t offset = (i * 32 + bit) * EMULATOR_STATE_PAGE_SIZE;
+      if ((bits & 1) && offset < size) {
+        memcpy(slot->state.data + offset, worker->capture.data + offset,
+               MIN(EMULATOR_STATE_PAGE_SIZE, size - offset));
+      }
+    }
+    slot->stale_pages[i] = 0;
+  }
+}
+
+void rewind_worker_append(RewindWorker* worker, Emulator* e) {
+  (void)emulator_update_state(e, &worker->capture,
+                              worker->capture_dirty_pages);
+  size_t i, j;
+  for (i = 0; i < REWIND_WORKER_SLOT_COUNT; ++i) {
+    for (j = 0; j < worker->dirty_pages_size / sizeof(u32); ++j) {
+      worker->slots[i].stale_pages[j] |= worker->capture_dirty_pages[j];
+    }
+  }
+
+  SDL_LockMutex(worker->queue_mutex);
+  while (worker->slot_count == REWIND_WORKER_SLOT_COUNT) {
+    SDL_CondWait(worker->queue_cond, worker->queue_mutex);
+  }
+  u32 index =
+      (worker->first_slot + worker->slot_count) % REWIND_WORKER_SLOT_COUNT;
+  SDL_UnlockMutex(worker->queue_mutex);
+
+  /* The worker doesn't touch a slot until it is counted. */
+  RewindWorkerSlot* slot = &worker->slots[index];
+  slot->ticks = emulator_get_ticks(e);
+  copy_stale_pages(worker, slot);
+  memcpy(slot->dirty_pages, worker->capture_dirty_pages,
+         worker->dirty_pages_size);
+  memset(worker->capture_dirty_pages, 0, worker->dirty_pages_size);
+
+  SDL_LockMutex(worker->queue_mutex);
+  worker->slot_count++;
+  SDL_CondBroadcast(worker->queue_cond);
+  SDL_UnlockMutex(worker->queue_mutex);
+}
+
+void rewind_worker_flush(RewindWorker* worker) {
+  SDL_LockMutex(worker->queue_mutex);
+  while (worker->slot_count > 0) {
+    SDL_CondWait(worker->queue_cond, worker->queue_mutex);
+  }
+  SDL_UnlockMutex(worker->queue_mutex);
+}
+
+void rewind_worker_lock(RewindWorker* worker) {
+  SDL_LockMutex(worker->buffer_mutex);
+}
+
+void rewind_worker_unlock(RewindWorker* worker) {
+  SDL_UnlockMutex(worker->buffer_mutex);
+}
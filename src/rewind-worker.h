@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef BINJGB_REWIND_WORKER_H_
+#define BINJGB_REWIND_WORKER_H_
+
+#include "common.h"
+#include "rewind.h"
+
+struct Emulator;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Appends to a RewindBuffer on another thread. The emulator thread only
+ * copies each state into a free slot of a small pool; the worker thread diffs
+ * and compresses it into the buffer.
+ *
+ * While a worker exists, it owns the buffer: other reads must be done between
+ * rewind_worker_lock and rewind_worker_unlock, and anything that modifies the
+ * buffer (e.g. rewinding) must call rewind_worker_flush first, without
+ * appending again until it is done. */
+typedef struct RewindWorker RewindWorker;
+
+/* |buffer| must have just been created for |e| (with rewind_new), and must
+ * outlive the worker. */
+RewindWorker* rewind_worker_new(RewindBuffer* buffer, struct Emulator* e);
+/* States that haven't been appended yet are dropped. */
+void rewind_worker_delete(RewindWorker*);
+
+/* Captures the emulator's current state. Only blocks if the worker has
+ * fallen behind by the whole pool. */
+void rewind_worker_append(RewindWorker*, struct Emulator*);
+/* Waits until every captured state has been appended. */
+void rewind_worker_flush(RewindWorker*);
+
+void rewind_worker_lock(RewindWorker*);
+void rewind_worker_unlock(RewindWorker*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BINJGB_REWIND_WORKER_H_ */
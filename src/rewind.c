@@ -8,11 +8,30 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <time.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RLE_SIMD_WIDTH 32
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RLE_SIMD_WIDTH 16
+#else
+#define RLE_SIMD_WIDTH 0
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include "emulator.h"
+#include "lz.h"
 
 #define SANITY_CHECK 0
 
+#define PAGE_SIZE EMULATOR_STATE_PAGE_SIZE
+#define IS_PAGE_DIRTY(pages, page) (((pages)[(page) >> 5] >> ((page) & 31)) & 1)
+
 #define GET_TICKS(x) ((x).ticks)
 #define CMP_GT(x, y) ((x) > (y))
 
@@ -27,76 +46,50 @@
  * - non-runs are written directly
  * - runs are written with the first two bytes of the run , followed by the
  *   number of subsequent bytes in the run (i.e. count - 2) encoded as a
- *   varint. */
-#define ENCODE_RLE(READ, src_size, dst_begin, dst_max_end, dst_new_end) \
-  do {                                                                  \
-    u8* dst = dst_begin;                                                \
-    assert(src_size > 0);                                               \
-    const u8* src_end = src + src_size;                                 \
-    /* Always write the first byte. */                                  \
-    u8 last = READ();                                                   \
-    CHECK_WRITE(1, dst, dst_max_end);                                   \
-    *dst++ = last;                                                      \
-    while (src < src_end) {                                             \
-      u8 next = READ();                                                 \
-      if (next == last) {                                               \
-        u32 count = 0;                                                  \
-        while (src < src_end) {                                         \
-          next = READ();                                                \
-          if (next != last) {                                           \
-            break;                                                      \
-          }                                                             \
-          count++;                                                      \
-        }                                                               \
-        CHECK_WRITE(1, dst, dst_max_end);                               \
-        *dst++ = last;                                                  \
-        dst = write_varint(count, dst, dst_max_end);                    \
-        if (!dst) {                                                     \
-          return NULL;                                                  \
-        }                                                               \
-        if (src == src_end) {                                           \
-          break;                                                        \
-        }                                                               \
-      }                                                                 \
-      CHECK_WRITE(1, dst, dst_max_end);                                 \
-      *dst++ = next;                                                    \
-      last = next;                                                      \
-    }                                                                   \
-    dst_new_end = dst;                                                  \
-  } while (0)
-
-#define DECODE_RLE(WRITE, src, src_size)   \
-  do {                                     \
-    assert(src_size > 0);                  \
-    const u8* src_end = src + src_size;    \
-    u8 last = *src++;                      \
-    WRITE(last);                           \
-    while (src < src_end) {                \
-      u8 next = *src++;                    \
-      if (next == last) {                  \
-        u32 count = read_varint(&src) + 1; \
-        for (; count > 0; count--) {       \
-          WRITE(last);                     \
-        }                                  \
-      } else {                             \
-        WRITE(next);                       \
-        last = next;                       \
-      }                                    \
-    }                                      \
-  } while (0)
+ *   varint.
+ *
+ * Diffs are encoded the same way, using the difference from the base state
+ * for each byte. Most of a diff is zero, so runs are found (and decoded)
+ * many bytes at a time. */
+
+typedef struct {
+  const char* name;
+  /* Encodes |src|, or if |base| isn't NULL, the dirty pages of its difference
+   * from |base|. Returns NULL if there isn't enough room. */
+  u8* (*encode)(RewindBuffer*, const u8* src, const u8* base, size_t size,
+                u8* dst_begin, u8* dst_max_end);
+  void (*decode)(RewindBuffer*, const u8* src, size_t src_size,
+                 const u8* base, u8* dst, u8* dst_end);
+} RewindCodecInfo;
 
 static void rewind_sanity_check(RewindBuffer*, Emulator*);
 
-RewindBuffer* rewind_new(const RewindInit* init, Emulator* e) {
+static u64 get_time_ns(void) {
+  struct timespec ts;
+#ifdef _MSC_VER
+  timespec_get(&ts, TIME_UTC);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static RewindBuffer* new_tier(const RewindInit* init, size_t capacity,
+                              Emulator* e) {
   RewindBuffer* buffer = xmalloc(sizeof(RewindBuffer));
   ZERO_MEMORY(*buffer);
   buffer->init = *init;
 
-  size_t capacity = init->buffer_capacity;
+  /* The infos are stored from the end of the buffer. */
+  capacity -= capacity % sizeof(RewindInfo);
+  buffer->capacity = capacity;
   u8* data = xmalloc(capacity);
-  emulator_init_state_file_data(&buffer->last_state);
-  emulator_init_state_file_data(&buffer->last_base_state);
-  emulator_init_state_file_data(&buffer->rewind_diff_state);
+  emulator_init_state_file_data(e, &buffer->last_base_state);
+  emulator_init_state_file_data(e, &buffer->rewind_diff_state);
+  buffer->dirty_pages_size =
+      DIV_CEIL(emulator_get_state_page_count(e), 32) * sizeof(u32);
+  buffer->dirty_pages = xcalloc(1, buffer->dirty_pages_size);
+  buffer->codec_scratch = xmalloc(buffer->last_base_state.size);
   buffer->last_base_state_ticks = INVALID_TICKS;
   buffer->data_range[0].begin = buffer->data_range[0].end = data;
   buffer->data_range[1] = buffer->data_range[0];
@@ -104,6 +97,31 @@ RewindBuffer* rewind_new(const RewindInit* init, Emulator* e) {
   buffer->info_range[0].begin = buffer->info_range[0].end = info;
   buffer->info_range[1] = buffer->info_range[0];
   buffer->frames_until_next_base = 0;
+  buffer->frames_until_next_state = 0;
+  return buffer;
+}
+
+RewindBuffer* rewind_new(const RewindInit* init, Emulator* e) {
+  RewindBuffer* buffer = NULL;
+  if (init->tier_count == 0) {
+    buffer = new_tier(init, init->buffer_capacity, e);
+  } else {
+    assert(init->tier_count <= REWIND_MAX_TIERS);
+    RewindBuffer** next = &buffer;
+    int i;
+    for (i = 0; i < init->tier_count; ++i) {
+      const RewindTierInit* tier = &init->tiers[i];
+      assert(tier->capacity_percent <= 100);
+      *next = new_tier(
+          init, init->buffer_capacity / 100 * tier->capacity_percent, e);
+      (*next)->tier = *tier;
+      next = &(*next)->next_tier;
+    }
+  }
+
+  emulator_init_state_file_data(e, &buffer->last_state);
+  (void)emulator_write_state(e, &buffer->last_state);
+  buffer->append_dirty_pages = xcalloc(1, buffer->dirty_pages_size);
 
   rewind_append(buffer, e);
 
@@ -111,11 +129,18 @@ RewindBuffer* rewind_new(const RewindInit* init, Emulator* e) {
 }
 
 void rewind_delete(RewindBuffer* buffer) {
-  xfree(buffer->rewind_diff_state.data);
-  xfree(buffer->last_base_state.data);
-  xfree(buffer->last_state.data);
-  xfree(buffer->data_range[0].begin);
-  xfree(buffer);
+  while (buffer) {
+    RewindBuffer* next_tier = buffer->next_tier;
+    xfree(buffer->codec_scratch);
+    xfree(buffer->dirty_pages);
+    xfree(buffer->append_dirty_pages);
+    xfree(buffer->rewind_diff_state.data);
+    xfree(buffer->last_base_state.data);
+    xfree(buffer->last_state.data);
+    xfree(buffer->data_range[0].begin);
+    xfree(buffer);
+    buffer = next_tier;
+  }
 }
 
 static u8* write_varint(u32 value, u8* dst_begin, u8* dst_max_end) {
@@ -155,63 +180,395 @@ static u32 read_varint(const u8** src) {
   }
 }
 
+#if RLE_SIMD_WIDTH
+static u32 count_trailing_zeros(u32 x) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, x);
+  return index;
+#else
+  return __builtin_ctz(x);
+#endif
+}
+#endif
+
+/* Returns how many of the first |size| bytes of |src| (less |base|, if it is
+ * not NULL) are equal to |value|. */
+static size_t get_run_length(const u8* src, const u8* base, size_t size,
+                             u8 value) {
+  size_t i = 0;
+#if RLE_SIMD_WIDTH == 32
+  __m256i values = _mm256_set1_epi8(value);
+  for (; i + 32 <= size; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+    if (base) {
+      x = _mm256_sub_epi8(x, _mm256_loadu_si256((const __m256i*)(base + i)));
+    }
+    u32 mask = ~(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, values));
+    if (mask) {
+      return i + count_trailing_zeros(mask);
+    }
+  }
+#elif RLE_SIMD_WIDTH == 16
+  __m128i values = _mm_set1_epi8(value);
+  for (; i + 16 <= size; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+    if (base) {
+      x = _mm_sub_epi8(x, _mm_loadu_si128((const __m128i*)(base + i)));
+    }
+    u32 mask = ~(u32)_mm_movemask_epi8(_mm_cmpeq_epi8(x, values)) & 0xffff;
+    if (mask) {
+      return i + count_trailing_zeros(mask);
+    }
+  }
+#endif
+  if (base) {
+    for (; i < size && (u8)(src[i] - base[i]) == value; ++i) {
+    }
+  } else {
+    for (; i < size && src[i] == value; ++i) {
+    }
+  }
+  return i;
+}
+
+/* Encodes |src|, or its difference from |base| if it is not NULL. Returns
+ * NULL if there isn't enough room. */
+static u8* encode_runs(const u8* src, const u8* base, size_t src_size,
+                       u8* dst_begin, u8* dst_max_end) {
+  u8* dst = dst_begin;
+  assert(src_size > 0);
+  size_t i = 0;
+  while (i < src_size) {
+    u8 value = base ? src[i] - base[i] : src[i];
+    size_t count = 1;
+    if (i + 1 < src_size &&
+        (u8)(base ? src[i + 1] - base[i + 1] : src[i + 1]) == value) {
+      count = 2 + get_run_length(src + i + 2, base ? base + i + 2 : NULL,
+                                 src_size - i - 2, value);
+    }
+    CHECK_WRITE(1, dst, dst_max_end);
+    *dst++ = value;
+    if (count >= 2) {
+      CHECK_WRITE(1, dst, dst_max_end);
+      *dst++ = value;
+      dst = write_varint(count - 2, dst, dst_max_end);
+      if (!dst) {
+        return NULL;
+      }
+    }
+    i += count;
+  }
+  return dst;
+}
+
+/* Decodes until |dst_end| is reached, adding |base| if it is not NULL.
+ * Returns the new source position. */
+static const u8* decode_runs(const u8* src, const u8* base, u8* dst,
+                             u8* dst_end) {
+  while (dst < dst_end) {
+    u8 value = *src++;
+    size_t count = 1;
+    /* The encoder never writes the same byte twice except to start a run. */
+    if (dst + 1 < dst_end && *src == value) {
+      src++;
+      count = read_varint(&src) + 2;
+    }
+    assert(count <= (size_t)(dst_end - dst));
+    if (!base) {
+      memset(dst, value, count);
+    } else if (value == 0) {
+      memcpy(dst, base, count);
+      base += count;
+    } else {
+      size_t i;
+      for (i = 0; i < count; ++i) {
+        dst[i] = *base++ + value;
+      }
+    }
+    dst += count;
+  }
+  return src;
+}
+
 static u8* encode_rle(const u8* src, size_t src_size, u8* dst_begin,
                       u8* dst_max_end) {
-  u8* dst_new_end;
-#define READ() (*src++)
-  ENCODE_RLE(READ, src_size, dst_begin, dst_max_end, dst_new_end);
-#undef READ
-  return dst_new_end;
+  return encode_runs(src, NULL, src_size, dst_begin, dst_max_end);
 }
 
 static void decode_rle(const u8* src, size_t src_size, u8* dst, u8* dst_end) {
-#define WRITE(x) *dst++ = (x)
-  DECODE_RLE(WRITE, src, src_size);
-#undef WRITE
-  assert(dst == dst_end);
+  const u8* src_end = decode_runs(src, NULL, dst, dst_end);
+  assert(src_end == src + src_size);
+  (void)src_end;
 }
 
 static u8* encode_diff(const u8* src, const u8* base, size_t src_size,
                        u8* dst_begin, u8* dst_max_end) {
-  u8* dst_new_end;
-#define READ() (*src++ - *base++)
-  ENCODE_RLE(READ, src_size, dst_begin, dst_max_end, dst_new_end);
-#undef READ
-  return dst_new_end;
+  return encode_runs(src, base, src_size, dst_begin, dst_max_end);
+}
+
+/* Finds the next run of dirty pages, starting at |*page|. On return, the run
+ * is [*first, *page). */
+static Bool next_dirty_range(const u32* dirty_pages, size_t page_count,
+                             size_t* page, size_t* first) {
+  size_t p = *page;
+  while (p < page_count && !IS_PAGE_DIRTY(dirty_pages, p)) {
+    p = (p & 31) == 0 && dirty_pages[p >> 5] == 0 ? p + 32 : p + 1;
+  }
+  if (p >= page_count) {
+    return FALSE;
+  }
+  *first = p;
+  while (p < page_count && IS_PAGE_DIRTY(dirty_pages, p)) {
+    p++;
+  }
+  *page = p;
+  return TRUE;
+}
+
+/* A diff only covers the pages that may have changed since the base state:
+ * for each run of dirty pages, the number of clean pages before it and the
+ * number of pages in it, as varints, then the RLE encoded difference. */
+static u8* encode_diff_pages(const u8* src, const u8* base, size_t src_size,
+                             const u32* dirty_pages, u8* dst_begin,
+                             u8* dst_max_end) {
+  u8* dst = dst_begin;
+  size_t page_count = DIV_CEIL(src_size, PAGE_SIZE);
+  size_t page = 0;
+  size_t first;
+  size_t last_end = 0;
+  while (next_dirty_range(dirty_pages, page_count, &page, &first)) {
+    dst = write_varint(first - last_end, dst, dst_max_end);
+    if (dst) {
+      dst = write_varint(page - first, dst, dst_max_end);
+    }
+    if (!dst) {
+      return NULL;
+    }
+    size_t offset = first * PAGE_SIZE;
+    size_t end = MIN(page * PAGE_SIZE, src_size);
+    dst = encode_diff(src + offset, base + offset, end - offset, dst,
+                      dst_max_end);
+    if (!dst) {
+      return NULL;
+    }
+    last_end = page;
+  }
+  return dst;
 }
 
 static void decode_diff(const u8* src, size_t src_size, const u8* base, u8* dst,
                         u8* dst_end) {
-#define WRITE(x) *dst++ = (*base++ + (x))
-  DECODE_RLE(WRITE, src, src_size);
-#undef WRITE
-  assert(dst == dst_end);
+  const u8* src_end = src + src_size;
+  size_t size = dst_end - dst;
+  size_t offset = 0;
+  memcpy(dst, base, size);
+  while (src < src_end) {
+    offset += read_varint(&src) * PAGE_SIZE;
+    size_t count = read_varint(&src) * PAGE_SIZE;
+    size_t end = MIN(offset + count, size);
+    src = decode_runs(src, base + offset, dst + offset, dst + end);
+    offset = end;
+  }
+  assert(src == src_end);
+}
+
+static u8* rle_encode(RewindBuffer* buf, const u8* src, const u8* base,
+                      size_t size, u8* dst_begin, u8* dst_max_end) {
+  if (!base) {
+    return encode_rle(src, size, dst_begin, dst_max_end);
+  }
+  return encode_diff_pages(src, base, size, buf->dirty_pages, dst_begin,
+                           dst_max_end);
+}
+
+static void rle_decode(RewindBuffer* buf, const u8* src, size_t src_size,
+                       const u8* base, u8* dst, u8* dst_end) {
+  if (!base) {
+    decode_rle(src, src_size, dst, dst_end);
+  } else {
+    decode_diff(src, src_size, base, dst, dst_end);
+  }
+}
+
+/* LZ diffs list the runs of dirty pages first, as for RLE diffs, ending with
+ * a run of zero pages. The differences for all of the runs follow as a
+ * single LZ block, since most of them are too small to compress well on their
+ * own. */
+static u8* lz_encode(RewindBuffer* buf, const u8* src, const u8* base,
+                     size_t size, u8* dst_begin, u8* dst_max_end) {
+  if (!base) {
+    return lz_compress(src, size, dst_begin, dst_max_end);
+  }
+  u8* dst = dst_begin;
+  u8* diff = buf->codec_scratch;
+  size_t page_count = DIV_CEIL(size, PAGE_SIZE);
+  size_t page = 0;
+  size_t first;
+  size_t last_end = 0;
+  while (next_dirty_range(buf->dirty_pages, page_count, &page, &first)) {
+    dst = write_varint(first - last_end, dst, dst_max_end);
+    if (dst) {
+      dst = write_varint(page - first, dst, dst_max_end);
+    }
+    if (!dst) {
+      return NULL;
+    }
+    size_t i;
+    size_t end = MIN(page * PAGE_SIZE, size);
+    for (i = first * PAGE_SIZE; i < end; ++i) {
+      *diff++ = src[i] - base[i];
+    }
+    last_end = page;
+  }
+  CHECK_WRITE(2, dst, dst_max_end);
+  *dst++ = 0;
+  *dst++ = 0;
+  return lz_compress(buf->codec_scratch, diff - buf->codec_scratch, dst,
+                     dst_max_end);
+}
+
+static void lz_decode(RewindBuffer* buf, const u8* src, size_t src_size,
+                      const u8* base, u8* dst, u8* dst_end) {
+  const u8* src_end = src + src_size;
+  Result result;
+  if (!base) {
+    result = lz_decompress(src, src_size, dst, dst_end);
+    assert(SUCCESS(result));
+    (void)result;
+    return;
+  }
+
+  size_t size = dst_end - dst;
+  const u8* ranges = src;
+  size_t offset = 0;
+  size_t diff_size = 0;
+  while (1) {
+    offset += read_varint(&src) * PAGE_SIZE;
+    size_t count = read_varint(&src) * PAGE_SIZE;
+    if (count == 0) {
+      break;
+    }
+    size_t end = MIN(offset + count, size);
+    diff_size += end - offset;
+    offset = end;
+  }
+  const u8* diff = buf->codec_scratch;
+  result = lz_decompress(src, src_end - src, buf->codec_scratch,
+                         buf->codec_scratch + diff_size);
+  assert(SUCCESS(result));
+  (void)result;
+
+  memcpy(dst, base, size);
+  src = ranges;
+  offset = 0;
+  while (1) {
+    offset += read_varint(&src) * PAGE_SIZE;
+    size_t count = read_varint(&src) * PAGE_SIZE;
+    if (count == 0) {
+      break;
+    }
+    size_t end = MIN(offset + count, size);
+    for (; offset < end; ++offset) {
+      dst[offset] = base[offset] + *diff++;
+    }
+  }
 }
 
-static RewindInfo* find_first_base_in_range(RewindInfoRange range) {
-  RewindInfo* base = range.begin;
-  for (; base < range.end; base++) {
-    if (base->kind == RewindInfoKind_Base) {
-      return base;
+static const RewindCodecInfo s_rewind_codecs[] = {
+    {"RLE", rle_encode, rle_decode},
+    {"LZ", lz_encode, lz_decode},
+};
+
+static void decode_info(RewindBuffer* buf, const RewindInfo* info,
+                        const u8* base, FileData* file_data) {
+  RewindCodecStats* stats = &buf->codec_stats[info->codec];
+  u64 start_ns = get_time_ns();
+  s_rewind_codecs[info->codec].decode(buf, info->data, info->size, base,
+                                      file_data->data,
+                                      file_data->data + file_data->size);
+  stats->decode_ns += get_time_ns() - start_ns;
+  stats->decoded_frames++;
+}
+
+static Bool is_rewind_range_empty(RewindInfoRange* r) {
+  return r->end == r->begin;
+}
+
+static Ticks get_tier_oldest_ticks(RewindBuffer* buf) {
+  RewindInfoRange* info_range = buf->info_range;
+  /* info_range[1] is always older than info_range[0], if it exists, so check
+   * that first. */
+  int i;
+  for (i = 1; i >= 0; --i) {
+    if (!is_rewind_range_empty(&info_range[i])) {
+      /* end is exclusive. */
+      return info_range[i].end[-1].ticks;
     }
   }
+
+  return INVALID_TICKS;
+}
+
+static Ticks get_tier_newest_ticks(RewindBuffer* buf) {
+  RewindInfoRange* info_range = buf->info_range;
+
+  int i;
+  for (i = 0; i < 2; ++i) {
+    if (!is_rewind_range_empty(&info_range[i])) {
+      return info_range[i].begin[0].ticks;
+    }
+  }
+
+  return INVALID_TICKS;
+}
+
+/* Finds the newest info at or before |ticks|, in either info range. */
+static RewindInfo* find_info_at_or_before(RewindBuffer* buf, Ticks ticks,
+                                          int* out_info_range_index) {
+  int i;
+  for (i = 0; i < 2; ++i) {
+    RewindInfoRange* range = &buf->info_range[i];
+    if (is_rewind_range_empty(range) || ticks < range->end[-1].ticks) {
+      continue;
+    }
+    LOWER_BOUND(RewindInfo, found, range->begin, range->end, ticks, GET_TICKS,
+                CMP_GT);
+    if (found->ticks > ticks) {
+      ++found;
+    }
+    *out_info_range_index = i;
+    return found;
+  }
   return NULL;
 }
 
-void rewind_append(RewindBuffer* buf, Emulator* e) {
-  Ticks ticks = emulator_get_ticks(e);
-  (void)emulator_write_state(e, &buf->last_state);
+/* Finds the info for exactly |ticks|, in either info range. */
+static RewindInfo* find_info(RewindBuffer* buf, Ticks ticks) {
+  int info_range_index;
+  RewindInfo* found = find_info_at_or_before(buf, ticks, &info_range_index);
+  return found && found->ticks == ticks ? found : NULL;
+}
+
+/* |state| is last_state, or a copy of it made by rewind_append_state's
+ * caller. buf->dirty_pages must already include its dirty pages. */
+static void append_state(RewindBuffer* buf, Ticks ticks, const u8* state) {
+  size_t size = buf->last_base_state.size;
 
   /* The new state must be written in sorted order; if it is out of order (from
    * a rewind), then the subsequent saved states should have been cleared
    * first. */
-  assert(rewind_get_newest_ticks(buf) == INVALID_TICKS ||
-         ticks > rewind_get_oldest_ticks(buf));
-
+  assert(get_tier_newest_ticks(buf) == INVALID_TICKS ||
+         ticks > get_tier_newest_ticks(buf));
+  RewindCodec codec = buf->init.codec;
+  const RewindCodecInfo* codec_info = &s_rewind_codecs[codec];
   RewindInfoKind kind;
   if (buf->frames_until_next_base-- == 0) {
     kind = RewindInfoKind_Base;
-    buf->frames_until_next_base = buf->init.frames_per_base_state;
+    /* Keep the base states of a coarser tier about as far apart in time, so
+     * its diffs stay small. */
+    buf->frames_until_next_base =
+        buf->init.frames_per_base_state / MAX(buf->tier.frames_per_state, 1);
   } else {
     kind = RewindInfoKind_Diff;
   }
@@ -223,6 +580,7 @@ void rewind_append(RewindBuffer* buf, Emulator* e) {
   RewindInfoRange* info_range = buf->info_range;
   RewindInfo* new_info = --info_range[0].begin;
   Bool wrap = (u8*)new_info <= data_range[1].end;
+  u64 start_ns = get_time_ns();
   while (1) {
     if (wrap) {
       /* Need to wrap, roll back decrement and swap ranges. */
@@ -242,8 +600,8 @@ void rewind_append(RewindBuffer* buf, Emulator* e) {
       case RewindInfoKind_Diff:
         if (buf->last_base_state_ticks != INVALID_TICKS) {
           data_end =
-              encode_diff(buf->last_state.data, buf->last_base_state.data,
-                          buf->last_state.size, data_begin, data_end_max);
+              codec_info->encode(buf, state, buf->last_base_state.data, size,
+                                 data_begin, data_end_max);
           break;
         }
         /* There is no previous base state, so we can't diff. Fallthrough to
@@ -251,10 +609,10 @@ void rewind_append(RewindBuffer* buf, Emulator* e) {
 
       case RewindInfoKind_Base:
         kind = RewindInfoKind_Base;
-        data_end = encode_rle(buf->last_state.data, buf->last_state.size,
-                              data_begin, data_end_max);
-        memcpy(buf->last_base_state.data, buf->last_state.data,
-               buf->last_state.size);
+        data_end = codec_info->encode(buf, state, NULL, size, data_begin,
+                                      data_end_max);
+        memcpy(buf->last_base_state.data, state, size);
+        memset(buf->dirty_pages, 0, buf->dirty_pages_size);
         buf->last_base_state_ticks = ticks;
         break;
     }
@@ -267,6 +625,7 @@ void rewind_append(RewindBuffer* buf, Emulator* e) {
     break;
   }
 
+  u64 encode_ns = get_time_ns() - start_ns;
   assert(data_end <= data_end_max);
   data_range[0].end = data_end;
 
@@ -278,6 +637,12 @@ void rewind_append(RewindBuffer* buf, Emulator* e) {
 
   new_end = MIN(new_end, new_info);
 
+  /* The oldest diffs can't be decoded once their base state is gone. */
+  while (info_range[1].begin < new_end &&
+         new_end[-1].kind == RewindInfoKind_Diff) {
+    --new_end;
+  }
+
   info_range[1].end = new_end;
   info_range[1].begin = MIN(info_range[1].begin, info_range[1].end);
 
@@ -285,6 +650,8 @@ void rewind_append(RewindBuffer* buf, Emulator* e) {
   new_info->data = data_begin;
   new_info->size = data_end - data_begin;
   new_info->kind = kind;
+  new_info->codec = codec;
+  new_info->base_ticks = buf->last_base_state_ticks;
 
   if (info_range[1].begin < info_range[1].end) {
     data_range[1].begin = info_range[1].end[-1].data;
@@ -296,19 +663,65 @@ void rewind_append(RewindBuffer* buf, Emulator* e) {
 
   /* Update stats. */
   buf->total_kind_bytes[kind] += new_info->size;
-  buf->total_uncompressed_bytes += buf->last_state.size;
+  buf->total_uncompressed_bytes += size;
+  RewindCodecStats* codec_stats = &buf->codec_stats[codec];
+  codec_stats->encoded_frames++;
+  codec_stats->uncompressed_bytes += size;
+  codec_stats->compressed_bytes += new_info->size;
+  codec_stats->encode_ns += encode_ns;
+}
+
+/* Offers a state to each tier. |dirty_pages| are the pages it updated since
+ * the previous state. */
+static void append_to_tiers(RewindBuffer* buf, Ticks ticks, const u8* state,
+                            const u32* dirty_pages) {
+  RewindBuffer* tier;
+  for (tier = buf; tier; tier = tier->next_tier) {
+    size_t i;
+    for (i = 0; i < tier->dirty_pages_size / sizeof(u32); ++i) {
+      tier->dirty_pages[i] |= dirty_pages[i];
+    }
+    if (tier->frames_until_next_state-- <= 0) {
+      tier->frames_until_next_state = tier->tier.frames_per_state - 1;
+      append_state(tier, ticks, state);
+    }
+  }
+}
 
+void rewind_append(RewindBuffer* buf, Emulator* e) {
+  memset(buf->append_dirty_pages, 0, buf->dirty_pages_size);
+  (void)emulator_update_state(e, &buf->last_state, buf->append_dirty_pages);
+#if SANITY_CHECK
+  {
+    /* last_state is only updated from the dirty pages; it must still match. */
+    FileData full;
+    emulator_init_state_file_data(e, &full);
+    (void)emulator_write_state(e, &full);
+    assert(memcmp(full.data, buf->last_state.data, full.size) == 0);
+    file_data_delete(&full);
+  }
+#endif
+  append_to_tiers(buf, emulator_get_ticks(e), buf->last_state.data,
+                  buf->append_dirty_pages);
   rewind_sanity_check(buf, e);
 }
 
-Result rewind_to_ticks(RewindBuffer* buf, Ticks ticks,
-                        RewindResult* out_result) {
+void rewind_append_state(RewindBuffer* buf, Ticks ticks, const FileData* state,
+                         const u32* dirty_pages) {
+  assert(state->size == buf->last_state.size);
+  append_to_tiers(buf, ticks, state->data, dirty_pages);
+}
+
+static Result rewind_tier_to_ticks(RewindBuffer* buf, Ticks ticks,
+                                   RewindResult* out_result) {
   RewindInfoRange* info_range = buf->info_range;
 
   int info_range_index;
-  if (ticks >= info_range[0].end[-1].ticks) {
+  if (!is_rewind_range_empty(&info_range[0]) &&
+      ticks >= info_range[0].end[-1].ticks) {
     info_range_index = 0;
-  } else if (ticks >= info_range[1].end[-1].ticks) {
+  } else if (!is_rewind_range_empty(&info_range[1]) &&
+             ticks >= info_range[1].end[-1].ticks) {
     info_range_index = 1;
   } else {
     return ERROR;
@@ -322,49 +735,38 @@ Result rewind_to_ticks(RewindBuffer* buf, Ticks ticks,
 
   /* We actually want upper bound, so increment if it wasn't an exact match. */
   if (found->ticks != ticks) {
-    assert(found + 1 != end);
-    ++found;
-    // HACK: Rewind one more, if available -- this way we'll render frames when
-    // rewinding.
     if (found + 1 < end) {
       ++found;
     }
+    // HACK: Rewind one more, if available -- this way we'll render frames when
+    // rewinding. A coarser tier has to run forward to |ticks| anyway.
+    if (found + 1 < end && buf->tier.frames_per_state <= 1) {
+      ++found;
+    }
   }
 
   assert(found->ticks <= ticks);
 
-  FileData* file_data = NULL;
-  if (found->kind == RewindInfoKind_Base) {
-    file_data = &buf->last_base_state;
-    decode_rle(found->data, found->size, file_data->data,
-               file_data->data + file_data->size);
-    buf->last_base_state_ticks = found->ticks;
-  } else {
-    assert(found->kind == RewindInfoKind_Diff);
-    /* Find the previous base state. */
-    RewindInfoRange range = {found, end};
-    RewindInfo* base_info = find_first_base_in_range(range);
-    if (!base_info) {
-      if (info_range_index == 1) {
-        /* No previous base state, can't decode. */
-        return ERROR;
-      }
-
-      /* Search the previous range. */
-      base_info = find_first_base_in_range(info_range[1]);
-      if (!base_info) {
-        return ERROR;
-      }
-    }
+  RewindInfo* base_info = find_info(buf, found->base_ticks);
+  if (!base_info) {
+    /* The base state has been overwritten, can't decode. */
+    return ERROR;
+  }
+  assert(base_info->kind == RewindInfoKind_Base);
 
-    FileData* base = &buf->last_base_state;
-    decode_rle(base_info->data, base_info->size, base->data,
-               base->data + base->size);
+  /* When scrubbing, most seeks share a base state with the previous one. */
+  FileData* base = &buf->last_base_state;
+  if (buf->last_base_state_ticks != base_info->ticks) {
+    decode_info(buf, base_info, NULL, base);
     buf->last_base_state_ticks = base_info->ticks;
+  }
+  /* The next diff can't rely on the dirty pages since the old base. */
+  memset(buf->dirty_pages, 0xff, buf->dirty_pages_size);
 
+  FileData* file_data = base;
+  if (found->kind == RewindInfoKind_Diff) {
     file_data = &buf->rewind_diff_state;
-    decode_diff(found->data, found->size, base->data, file_data->data,
-                file_data->data + file_data->size);
+    decode_info(buf, found, base->data, file_data);
   }
 
   out_result->info_range_index = info_range_index;
@@ -373,84 +775,155 @@ Result rewind_to_ticks(RewindBuffer* buf, Ticks ticks,
   return OK;
 }
 
-void rewind_truncate_to(RewindBuffer* buffer, Emulator* e,
-                        RewindResult* result) {
-  /* Remove data from rewind buffer that are now invalid. */
-  int info_range_index = result->info_range_index;
-  RewindInfo* info = result->info;
-  RewindDataRange* data_range = buffer->data_range;
-  RewindInfoRange* info_range = buffer->info_range;
+Result rewind_to_ticks(RewindBuffer* buf, Ticks ticks,
+                        RewindResult* out_result) {
+  /* Use the finest tier that can still decode |ticks|. */
+  int tier;
+  for (tier = 0; buf; buf = buf->next_tier, ++tier) {
+    Ticks oldest = get_tier_oldest_ticks(buf);
+    if (oldest != INVALID_TICKS && ticks >= oldest &&
+        SUCCESS(rewind_tier_to_ticks(buf, ticks, out_result))) {
+      out_result->tier = tier;
+      return OK;
+    }
+  }
+  return ERROR;
+}
+
+static void truncate_tier(RewindBuffer* buf, int info_range_index,
+                          RewindInfo* info) {
+  RewindDataRange* data_range = buf->data_range;
+  RewindInfoRange* info_range = buf->info_range;
   info_range[info_range_index].begin = info;
   data_range[info_range_index].end = info->data + info->size;
   if (info_range_index == 1) {
     info_range[0].begin = info_range[0].end;
     data_range[0].end = data_range[0].begin;
   }
+}
 
-  rewind_sanity_check(buffer, e);
+/* For a tier that wasn't rewound: its last base state may be gone, and
+ * rewinding may have decoded another one, so start again from a new base
+ * state. */
+static void drop_tier_newer_than(RewindBuffer* buf, Ticks ticks) {
+  int info_range_index;
+  RewindInfo* info = find_info_at_or_before(buf, ticks, &info_range_index);
+  if (info) {
+    truncate_tier(buf, info_range_index, info);
+  } else {
+    buf->info_range[0].begin = buf->info_range[0].end;
+    buf->info_range[1] = buf->info_range[0];
+    buf->data_range[0].end = buf->data_range[0].begin;
+    buf->data_range[1] = buf->data_range[0];
+  }
+  buf->last_base_state_ticks = INVALID_TICKS;
+  buf->frames_until_next_base = 0;
+  buf->frames_until_next_state = 0;
 }
 
-static Bool is_rewind_range_empty(RewindInfoRange* r) {
-  return r->end == r->begin;
+void rewind_truncate_to(RewindBuffer* buffer, Emulator* e,
+                        RewindResult* result) {
+  /* Remove data from rewind buffer that are now invalid. */
+  RewindBuffer* buf;
+  int tier;
+  for (buf = buffer, tier = 0; buf; buf = buf->next_tier, ++tier) {
+    if (tier == result->tier) {
+      truncate_tier(buf, result->info_range_index, result->info);
+    } else {
+      drop_tier_newer_than(buf, result->info->ticks);
+    }
+  }
+
+  rewind_sanity_check(buffer, e);
 }
 
 Ticks rewind_get_oldest_ticks(RewindBuffer* buffer) {
-  RewindInfoRange* info_range = buffer->info_range;
-  /* info_range[1] is always older than info_range[0], if it exists, so check
-   * that first. */
-  int i;
-  for (i = 1; i >= 0; --i) {
-    if (!is_rewind_range_empty(&info_range[i])) {
-      /* end is exclusive. */
-      return info_range[i].end[-1].ticks;
+  Ticks oldest = INVALID_TICKS;
+  for (; buffer; buffer = buffer->next_tier) {
+    Ticks ticks = get_tier_oldest_ticks(buffer);
+    if (ticks != INVALID_TICKS && (oldest == INVALID_TICKS || ticks < oldest)) {
+      oldest = ticks;
     }
   }
-
-  return INVALID_TICKS;
+  return oldest;
 }
 
 Ticks rewind_get_newest_ticks(RewindBuffer* buffer) {
-  RewindInfoRange* info_range = buffer->info_range;
-
-  int i;
-  for (i = 0; i < 2; ++i) {
-    if (!is_rewind_range_empty(&info_range[i])) {
-      return info_range[i].begin[0].ticks;
+  Ticks newest = INVALID_TICKS;
+  for (; buffer; buffer = buffer->next_tier) {
+    Ticks ticks = get_tier_newest_ticks(buffer);
+    if (ticks != INVALID_TICKS && (newest == INVALID_TICKS || ticks > newest)) {
+      newest = ticks;
     }
   }
-
-  return INVALID_TICKS;
+  return newest;
 }
 
 RewindStats rewind_get_stats(RewindBuffer* buffer) {
   RewindStats stats;
   ZERO_MEMORY(stats);
-  stats.base_bytes = buffer->total_kind_bytes[RewindInfoKind_Base];
-  stats.diff_bytes = buffer->total_kind_bytes[RewindInfoKind_Diff];
-  stats.uncompressed_bytes = buffer->total_uncompressed_bytes;
-  stats.used_bytes = 0;
-  stats.capacity_bytes = buffer->init.buffer_capacity;
 
   u8* begin = buffer->data_range[0].begin;
   int i;
   for (i = 0; i < 2; ++i) {
     RewindDataRange* data_range = &buffer->data_range[i];
     RewindInfoRange* info_range = &buffer->info_range[i];
-    stats.used_bytes += data_range->end - data_range->begin;
-    stats.used_bytes +=
-        (info_range->end - info_range->begin) * sizeof(RewindInfo);
-
     stats.data_ranges[i*2+0] = data_range->begin - begin;
     stats.data_ranges[i*2+1] = data_range->end - begin;
     stats.info_ranges[i*2+0] = (u8*)info_range->begin - begin;
     stats.info_ranges[i*2+1] = (u8*)info_range->end - begin;
   }
 
+  RewindBuffer* buf;
+  for (buf = buffer; buf; buf = buf->next_tier) {
+    RewindTierStats* tier = &stats.tiers[stats.tier_count++];
+    tier->frames_per_state = MAX(buf->tier.frames_per_state, 1);
+    tier->oldest_ticks = get_tier_oldest_ticks(buf);
+    tier->newest_ticks = get_tier_newest_ticks(buf);
+    tier->capacity_bytes = buf->capacity;
+    for (i = 0; i < 2; ++i) {
+      RewindDataRange* data_range = &buf->data_range[i];
+      RewindInfoRange* info_range = &buf->info_range[i];
+      size_t count = info_range->end - info_range->begin;
+      tier->state_count += count;
+      tier->used_bytes += data_range->end - data_range->begin;
+      tier->used_bytes += count * sizeof(RewindInfo);
+    }
+
+    stats.base_bytes += buf->total_kind_bytes[RewindInfoKind_Base];
+    stats.diff_bytes += buf->total_kind_bytes[RewindInfoKind_Diff];
+    stats.uncompressed_bytes += buf->total_uncompressed_bytes;
+    stats.used_bytes += tier->used_bytes;
+    stats.capacity_bytes += tier->capacity_bytes;
+    RewindCodec codec;
+    for (codec = 0; codec < RewindCodec_Count; ++codec) {
+      RewindCodecStats* dst = &stats.codecs[codec];
+      const RewindCodecStats* src = &buf->codec_stats[codec];
+      dst->encoded_frames += src->encoded_frames;
+      dst->uncompressed_bytes += src->uncompressed_bytes;
+      dst->compressed_bytes += src->compressed_bytes;
+      dst->encode_ns += src->encode_ns;
+      dst->decoded_frames += src->decoded_frames;
+      dst->decode_ns += src->decode_ns;
+    }
+  }
   return stats;
 }
 
-void rewind_sanity_check(RewindBuffer* buffer, Emulator* e) {
+void rewind_set_codec(RewindBuffer* buffer, RewindCodec codec) {
+  assert(codec < RewindCodec_Count);
+  for (; buffer; buffer = buffer->next_tier) {
+    buffer->init.codec = codec;
+  }
+}
+
+const char* rewind_get_codec_name(RewindCodec codec) {
+  assert(codec < RewindCodec_Count);
+  return s_rewind_codecs[codec].name;
+}
+
 #if SANITY_CHECK
+static void sanity_check_tier(RewindBuffer* buffer, Emulator* e) {
   assert(buffer->data_range[0].begin <= buffer->data_range[0].end);
   assert(buffer->data_range[0].end <= buffer->data_range[1].begin);
   assert((void*)buffer->data_range[0].end <=
@@ -459,12 +932,13 @@ void rewind_sanity_check(RewindBuffer* buffer, Emulator* e) {
   assert(buffer->info_range[0].begin <= buffer->info_range[0].end);
 
   Bool has_base = FALSE;
+  Ticks base_ticks = INVALID_TICKS;
   FileData base;
   FileData diff;
   FileData temp;
-  emulator_init_state_file_data(&base);
-  emulator_init_state_file_data(&diff);
-  emulator_init_state_file_data(&temp);
+  emulator_init_state_file_data(e, &base);
+  emulator_init_state_file_data(e, &diff);
+  emulator_init_state_file_data(e, &temp);
 
   Result result = emulator_write_state(e, &temp);
   assert(SUCCESS(result));
@@ -499,13 +973,19 @@ void rewind_sanity_check(RewindBuffer* buffer, Emulator* e) {
       FileData* fd = NULL;
       if (info->kind == RewindInfoKind_Base) {
         has_base = TRUE;
-        decode_rle(info->data, info->size, base.data, base.data + base.size);
+        assert(info->base_ticks == info->ticks);
+        s_rewind_codecs[info->codec].decode(buffer, info->data, info->size,
+                                            NULL, base.data,
+                                            base.data + base.size);
+        base_ticks = info->ticks;
         fd = &base;
       } else {
         assert(info->kind == RewindInfoKind_Diff);
         if (has_base) {
-          decode_diff(info->data, info->size, base.data, diff.data,
-                      diff.data + diff.size);
+          assert(info->base_ticks == base_ticks);
+          s_rewind_codecs[info->codec].decode(buffer, info->data, info->size,
+                                              base.data, diff.data,
+                                              diff.data + diff.size);
           fd = &diff;
         }
       }
@@ -523,5 +1003,13 @@ void rewind_sanity_check(RewindBuffer* buffer, Emulator* e) {
   file_data_delete(&temp);
   file_data_delete(&diff);
   file_data_delete(&base);
+}
 #endif /* SANITY_CHECK */
+
+void rewind_sanity_check(RewindBuffer* buffer, Emulator* e) {
+#if SANITY_CHECK
+  for (; buffer; buffer = buffer->next_tier) {
+    sanity_check_tier(buffer, e);
+  }
+#endif
 }
@@ -20,11 +20,21 @@ typedef enum {
   RewindInfoKind_Diff,
 } RewindInfoKind;
 
+/* How states are compressed. Each RewindInfo remembers its codec, so the codec
+ * can be changed without discarding the buffer. */
+typedef enum {
+  RewindCodec_Rle, /* Run-length encoding; cheapest, fine for diffs. */
+  RewindCodec_Lz,  /* LZ77 (LZ4 block format); smaller base states. */
+  RewindCodec_Count,
+} RewindCodec;
+
 typedef struct {
   Ticks ticks;
   u8* data;
   size_t size;
   RewindInfoKind kind;
+  RewindCodec codec;
+  Ticks base_ticks; /* The base state a diff is relative to, or ticks. */
 } RewindInfo;
 
 typedef struct {
@@ -38,16 +48,43 @@ typedef struct {
 } RewindDataRange;
 
 typedef struct {
+  int tier;
   int info_range_index;
   RewindInfo* info;
   FileData file_data;
 } RewindResult;
 
+#define REWIND_MAX_TIERS 4
+
+/* A tier keeps one of every |frames_per_state| states (0 or 1 keeps them all)
+ * in its share of the buffer. */
+typedef struct {
+  int frames_per_state;
+  u32 capacity_percent;
+} RewindTierInit;
+
 typedef struct {
   size_t buffer_capacity;
   int frames_per_base_state;
+  RewindCodec codec;
+  /* If tier_count is 0, every state is kept in one ring until it is
+   * overwritten. Otherwise each tier is its own ring, ordered from finest to
+   * coarsest, and every state is offered to all of them. A coarse tier keeps
+   * its own base states, so it covers much more time in the same space, and
+   * history that the finer tiers have dropped can still be reached. */
+  RewindTierInit tiers[REWIND_MAX_TIERS];
+  int tier_count;
 } RewindInit;
 
+typedef struct {
+  size_t encoded_frames;
+  size_t uncompressed_bytes;
+  size_t compressed_bytes;
+  u64 encode_ns;
+  size_t decoded_frames;
+  u64 decode_ns;
+} RewindCodecStats;
+
 typedef struct RewindBuffer {
  /*
   * |                  rewind buffer                      |
@@ -74,21 +111,44 @@ typedef struct RewindBuffer {
   *
   */
   RewindInit init;
+  RewindTierInit tier;
+  /* The next coarser tier, or NULL. Only the first tier tracks last_state; the
+   * rewind_* functions take the first tier and apply to all of them. */
+  struct RewindBuffer* next_tier;
+  size_t capacity;
+  int frames_until_next_state;
   RewindDataRange data_range[2];
   RewindInfoRange info_range[2];
   FileData last_state;
+  /* Pages updated by the state being appended. */
+  u32* append_dirty_pages;
   FileData last_base_state;
   Ticks last_base_state_ticks;
+  /* Pages of the newest state that may differ from last_base_state. */
+  u32* dirty_pages;
+  size_t dirty_pages_size;
   int frames_until_next_base;
 
   /* Data is decompressed into these states when rewinding. */
   FileData rewind_diff_state;
+  /* State-sized scratch space for codecs that can't work in place. */
+  u8* codec_scratch;
 
   /* Stats */
   size_t total_kind_bytes[2];
   size_t total_uncompressed_bytes;
+  RewindCodecStats codec_stats[RewindCodec_Count];
 } RewindBuffer;
 
+typedef struct {
+  int frames_per_state;
+  Ticks oldest_ticks; /* INVALID_TICKS if the tier is empty. */
+  Ticks newest_ticks;
+  size_t state_count;
+  size_t used_bytes;
+  size_t capacity_bytes;
+} RewindTierStats;
+
 typedef struct {
   size_t base_bytes;
   size_t diff_bytes;
@@ -96,18 +156,34 @@ typedef struct {
   size_t used_bytes;
   size_t capacity_bytes;
 
+  /* Of the first tier. */
   size_t data_ranges[4];
   size_t info_ranges[4];
+
+  RewindTierStats tiers[REWIND_MAX_TIERS];
+  int tier_count;
+
+  /* Totals for each codec since the buffer was created. */
+  RewindCodecStats codecs[RewindCodec_Count];
 } RewindStats;
 
 RewindBuffer* rewind_new(const RewindInit*, struct Emulator*);
 void rewind_delete(RewindBuffer*);
 void rewind_append(RewindBuffer*, struct Emulator*);
+/* Like rewind_append, but for a state captured earlier (e.g. on another
+ * thread) with emulator_update_state. |dirty_pages| are the pages it updated
+ * since the previously appended state. Don't mix this with rewind_append on
+ * the same buffer. */
+void rewind_append_state(RewindBuffer*, Ticks, const FileData* state,
+                         const u32* dirty_pages);
 Result rewind_to_ticks(RewindBuffer*, Ticks, RewindResult*);
 void rewind_truncate_to(RewindBuffer*, struct Emulator*, RewindResult*);
 Ticks rewind_get_oldest_ticks(RewindBuffer*);
 Ticks rewind_get_newest_ticks(RewindBuffer*);
 RewindStats rewind_get_stats(RewindBuffer*);
+/* Used for states appended from now on. */
+void rewind_set_codec(RewindBuffer*, RewindCodec);
+const char* rewind_get_codec_name(RewindCodec);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "rom-cache.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ROM_CACHE_MMAP 1
+#endif
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+typedef struct RomCacheEntry {
+  struct RomCacheEntry* next;
+  u64 hash;
+  EmulatorRom* rom;
+} RomCacheEntry;
+
+/* Entries don't hold a reference; they are removed when the ROM's data is
+ * freed. */
+static RomCacheEntry* s_rom_cache;
+
+static u64 hash_data(const FileData* file_data) {
+  u64 hash = FNV_OFFSET_BASIS;
+  size_t i;
+  for (i = 0; i < file_data->size; ++i) {
+    hash = (hash ^ file_data->data[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static void remove_entry(const u8* data) {
+  RomCacheEntry** link;
+  for (link = &s_rom_cache; *link; link = &(*link)->next) {
+    RomCacheEntry* entry = *link;
+    if (emulator_rom_get_file_data(entry->rom)->data == data) {
+      *link = entry->next;
+      xfree(entry);
+      return;
+    }
+  }
+}
+
+static void free_rom_data(FileData* file_data) {
+  remove_entry(file_data->data);
+  file_data_delete(file_data);
+}
+
+#if ROM_CACHE_MMAP
+static void unmap_rom_data(FileData* file_data) {
+  remove_entry(file_data->data);
+  munmap(file_data->data, file_data->size);
+  file_data->data = NULL;
+  file_data->size = 0;
+}
+
+/* Only files whose size is already a multiple of MINIMUM_ROM_SIZE are mapped,
+ * since the emulator can't pad a mapping. Returns FALSE if the file should be
+ * read instead. */
+static Bool map_file(const char* filename, FileData* out_file_data) {
+  Bool result = FALSE;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return FALSE;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+      (st.st_size & (MINIMUM_ROM_SIZE - 1)) == 0) {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+      out_file_data->data = data;
+      out_file_data->size = st.st_size;
+      result = TRUE;
+    }
+  }
+  close(fd);
+  return result;
+}
+#endif
+
+EmulatorRom* rom_cache_load(const char* filename, Bool map) {
+  FileData file_data;
+  EmulatorRomFreeCallback free_data = free_rom_data;
+#if ROM_CACHE_MMAP
+  if (map && map_file(filename, &file_data)) {
+    free_data = unmap_rom_data;
+  } else
+#endif
+  if (!SUCCESS(file_read_aligned(filename, MINIMUM_ROM_SIZE, &file_data))) {
+    return NULL;
+  }
+
+  u64 hash = hash_data(&file_data);
+  RomCacheEntry* entry;
+  for (entry = s_rom_cache; entry; entry = entry->next) {
+    const FileData* cached = emulator_rom_get_file_data(entry->rom);
+    if (entry->hash == hash && cached->size == file_data.size &&
+        memcmp(cached->data, file_data.data, file_data.size) == 0) {
+      free_data(&file_data);
+      return emulator_rom_ref(entry->rom);
+    }
+  }
+
+  u8* data = file_data.data;
+  EmulatorRom* rom = emulator_rom_new(&file_data, free_data);
+  /* The emulator copies the data if it has to grow it; that copy isn't
+   * tracked, so don't cache it. */
+  if (rom && emulator_rom_get_file_data(rom)->data == data) {
+    entry = xcalloc(1, sizeof(RomCacheEntry));
+    entry->next = s_rom_cache;
+    entry->hash = hash;
+    entry->rom = rom;
+    s_rom_cache = entry;
+  }
+  return rom;
+}
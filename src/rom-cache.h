@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef BINJGB_ROM_CACHE_H_
+#define BINJGB_ROM_CACHE_H_
+
+#include "common.h"
+#include "emulator.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Loads a ROM file. ROMs with the same contents are only loaded once; while
+ * any emulator is still using one, loading it again returns another
+ * reference to it. Release the result with emulator_rom_unref. Not
+ * thread-safe.
+ *
+ * If |map| is TRUE, the file is memory-mapped read-only where possible
+ * instead of read, which saves memory when running many emulators. Only use
+ * it when nothing will rewrite the file while it is loaded (e.g. not when
+ * the ROM is being rebuilt while the emulator is open): edits to the file
+ * change the ROM under the running emulator, and accessing it after the
+ * file is truncated raises SIGBUS. */
+EmulatorRom* rom_cache_load(const char* filename, Bool map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BINJGB_ROM_CACHE_H_ */
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "serial-link.h"
+
+/* Neither emulator runs more than this far ahead of the other. It must be
+ * less than a byte transfer (SERIAL_TICKS * 8), so a transfer that starts in
+ * one emulator always finishes in the other emulator's future. */
+#define SERIAL_LINK_SLICE_TICKS 2048
+
+/* Stop catching up the other emulator when one of these happens, since they
+ * must be handled before it can continue. */
+#define SERIAL_LINK_STOP_EVENTS                                      \
+  (EMULATOR_EVENT_AUDIO_BUFFER_FULL | EMULATOR_EVENT_BREAKPOINT | \
+   EMULATOR_EVENT_INVALID_OPCODE)
+
+typedef struct {
+  struct SerialLink* link;
+  int index;
+} SerialLinkPort;
+
+struct SerialLink {
+  Emulator* e[SERIAL_LINK_EMULATOR_COUNT];
+  SerialLinkPort port[SERIAL_LINK_EMULATOR_COUNT];
+  EmulatorEvent events[SERIAL_LINK_EMULATOR_COUNT]; /* Not yet reported. */
+  Bool running[SERIAL_LINK_EMULATOR_COUNT];
+  Ticks slice_ticks; /* End of the current slice. */
+};
+
+static void run_emulator(SerialLink* link, int index, Ticks until_ticks) {
+  link->running[index] = TRUE;
+  EmulatorEvent event = emulator_run_until(link->e[index], until_ticks);
+  link->running[index] = FALSE;
+  link->events[index] |= event & ~EMULATOR_EVENT_UNTIL_TICKS;
+}
+
+static u8 serial_callback(u8 value, Ticks ticks, void* user_data) {
+  SerialLinkPort* port = user_data;
+  SerialLink* link = port->link;
+  int other = !port->index;
+  Ticks start_ticks = emulator_get_ticks(link->e[port->index]);
+  /* Bring the other emulator up to the start of the transfer, so the byte it
+   * sends back is current. If it is running, it is the one that called us. */
+  while (!link->running[other] &&
+         emulator_get_ticks(link->e[other]) < start_ticks &&
+         !(link->events[other] & SERIAL_LINK_STOP_EVENTS)) {
+    run_emulator(link, other, start_ticks);
+  }
+  return emulator_exchange_serial_byte(link->e[other], value, ticks);
+}
+
+SerialLink* serial_link_new(Emulator* e0, Emulator* e1) {
+  SerialLink* link = xcalloc(1, sizeof(SerialLink));
+  link->e[0] = e0;
+  link->e[1] = e1;
+  int i;
+  for (i = 0; i < SERIAL_LINK_EMULATOR_COUNT; ++i) {
+    link->port[i].link = link;
+    link->port[i].index = i;
+    emulator_set_serial_callback(link->e[i], serial_callback, &link->port[i]);
+  }
+  return link;
+}
+
+void serial_link_delete(SerialLink* link) {
+  if (!link) {
+    return;
+  }
+  int i;
+  for (i = 0; i < SERIAL_LINK_EMULATOR_COUNT; ++i) {
+    emulator_set_serial_callback(link->e[i], NULL, NULL);
+  }
+  xfree(link);
+}
+
+void serial_link_run_until(SerialLink* link, Ticks until_ticks,
+                           EmulatorEvent events[SERIAL_LINK_EMULATOR_COUNT]) {
+  int i;
+  while (!(link->events[0] | link->events[1])) {
+    Ticks ticks0 = emulator_get_ticks(link->e[0]);
+    Ticks ticks1 = emulator_get_ticks(link->e[1]);
+    if (MIN(ticks0, ticks1) >= until_ticks) {
+      break;
+    }
+    if (MIN(ticks0, ticks1) >= link->slice_ticks) {
+      link->slice_ticks =
+          MIN(MAX(ticks0, ticks1) + SERIAL_LINK_SLICE_TICKS, until_ticks);
+    }
+    Ticks slice_ticks = MIN(link->slice_ticks, until_ticks);
+    for (i = 0; i < SERIAL_LINK_EMULATOR_COUNT; ++i) {
+      if (!link->events[i] && emulator_get_ticks(link->e[i]) < slice_ticks) {
+        run_emulator(link, i, slice_ticks);
+      }
+    }
+  }
+
+  for (i = 0; i < SERIAL_LINK_EMULATOR_COUNT; ++i) {
+    events[i] = link->events[i];
+    if (emulator_get_ticks(link->e[i]) >= until_ticks) {
+      events[i] |= EMULATOR_EVENT_UNTIL_TICKS;
+    }
+    link->events[i] = 0;
+  }
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef BINJGB_SERIAL_LINK_H_
+#define BINJGB_SERIAL_LINK_H_
+
+#include "common.h"
+#include "emulator.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SERIAL_LINK_EMULATOR_COUNT 2
+
+/* Connects two emulators with a link cable, and runs them in lockstep. The
+ * result only depends on the two emulators' initial state and inputs, so
+ * repeated runs are identical. */
+typedef struct SerialLink SerialLink;
+
+/* Replaces the serial callbacks of both emulators. They must outlive the
+ * link. */
+SerialLink* serial_link_new(Emulator* e0, Emulator* e1);
+void serial_link_delete(SerialLink*);
+
+/* Runs both emulators until they reach until_ticks, or until either has an
+ * event to report (e.g. a new frame). The events for each emulator are
+ * written to events[0] and events[1]; EMULATOR_EVENT_UNTIL_TICKS is set for
+ * each emulator that has reached until_ticks. */
+void serial_link_run_until(SerialLink*, Ticks until_ticks,
+                           EmulatorEvent events[SERIAL_LINK_EMULATOR_COUNT]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BINJGB_SERIAL_LINK_H_ */
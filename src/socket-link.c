@@ -0,0 +1,651 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "socket-link.h"
+
+#include <assert.h>
+#include <inttypes.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+/* Snapshots are taken this often, and this many are kept. */
+#define SOCKET_LINK_SNAPSHOT_TICKS (PPU_FRAME_TICKS / 4)
+#define SOCKET_LINK_SNAPSHOT_COUNT 32
+
+/* Don't run further ahead of the other end than this. A byte from the other
+ * end can then be at most this far in our past, so it must be well inside the
+ * ticks covered by the snapshots. */
+#define SOCKET_LINK_MAX_AHEAD_TICKS (PPU_FRAME_TICKS * 4)
+
+#define SOCKET_LINK_MAX_TRANSFERS 1024
+#define SOCKET_LINK_WAIT_MS 1000
+
+/* All ticks sent over the socket are relative to when the link connected. */
+typedef enum {
+  SOCKET_LINK_MESSAGE_TICKS,    /* The sender has run until |ticks|. */
+  SOCKET_LINK_MESSAGE_TRANSFER, /* The sender started a transfer. */
+  SOCKET_LINK_MESSAGE_REPLY,    /* The receiver's byte for that transfer. */
+} SocketLinkMessageType;
+
+typedef struct {
+  Ticks ticks;          /* When the transfer started. */
+  Ticks complete_ticks; /* When the transfer finishes. */
+  u8 type;
+  u8 value;
+  u8 padding[6];
+} SocketLinkMessage;
+
+typedef struct {
+  Ticks ticks;
+  Ticks complete_ticks;
+  u8 value; /* Sent: our byte. Received: their byte. */
+  u8 reply; /* Sent: the byte shifted in. Received: the byte sent back. */
+  Bool resolved; /* Sent: |reply| is from the other end, not a prediction.
+                    Received: |reply| has been sent. */
+  Bool applied;  /* Received only: exchanged with the emulator. */
+} SocketLinkTransfer;
+
+typedef struct {
+  SocketLinkTransfer data[SOCKET_LINK_MAX_TRANSFERS];
+  size_t count;
+} SocketLinkTransfers;
+
+typedef struct {
+  FileData file_data;
+  Ticks ticks;
+} SocketLinkSnapshot;
+
+struct SocketLink {
+  Emulator* e;
+  JoypadBuffer* joypad_buffer;
+  int fd;
+  int listen_fd; /* Waiting for the other end to connect, if >= 0. */
+  char* path;
+  Bool connected;
+  Ticks base_ticks;     /* Our ticks when the link connected. */
+  Ticks peer_ticks;     /* How far the other end has run. */
+  Ticks rollback_ticks; /* Replay from before here, or INVALID_TICKS. */
+  u8 predicted;         /* The next byte we expect to receive. */
+  SocketLinkTransfers sent;
+  SocketLinkTransfers received;
+  SocketLinkSnapshot snapshots[SOCKET_LINK_SNAPSHOT_COUNT];
+  size_t snapshot_first;
+  size_t snapshot_count;
+  Ticks next_snapshot_ticks;
+  u8 read_buffer[sizeof(SocketLinkMessage)];
+  size_t read_size;
+  SocketLinkStats stats;
+};
+
+static Ticks get_link_ticks(SocketLink* link) {
+  return emulator_get_ticks(link->e) - link->base_ticks;
+}
+
+static SocketLinkTransfer* find_transfer(SocketLinkTransfers* transfers,
+                                         Ticks ticks) {
+  size_t i;
+  for (i = transfers->count; i > 0; --i) {
+    SocketLinkTransfer* transfer = &transfers->data[i - 1];
+    if (transfer->ticks == ticks) {
+      return transfer;
+    } else if (transfer->ticks < ticks) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* Drops every transfer at or after |ticks|. */
+static void truncate_transfers(SocketLinkTransfers* transfers, Ticks ticks) {
+  while (transfers->count > 0 &&
+         transfers->data[transfers->count - 1].ticks >= ticks) {
+    transfers->count--;
+  }
+}
+
+static SocketLinkTransfer* append_transfer(SocketLinkTransfers* transfers) {
+  if (transfers->count == SOCKET_LINK_MAX_TRANSFERS) {
+    /* Much older than any snapshot, so it can't be replayed anyway. */
+    memmove(&transfers->data[0], &transfers->data[1],
+            (transfers->count - 1) * sizeof(SocketLinkTransfer));
+    transfers->count--;
+  }
+  SocketLinkTransfer* transfer = &transfers->data[transfers->count++];
+  ZERO_MEMORY(*transfer);
+  return transfer;
+}
+
+/* Drops transfers before |ticks| that won't be needed again. */
+static void prune_transfers(SocketLinkTransfers* transfers, Ticks ticks) {
+  size_t count = 0;
+  while (count < transfers->count && transfers->data[count].ticks < ticks &&
+         (transfers->data[count].applied || transfers->data[count].resolved)) {
+    count++;
+  }
+  memmove(&transfers->data[0], &transfers->data[count],
+          (transfers->count - count) * sizeof(SocketLinkTransfer));
+  transfers->count -= count;
+}
+
+static void request_rollback(SocketLink* link, Ticks ticks) {
+  link->rollback_ticks = MIN(link->rollback_ticks, ticks);
+}
+
+static SocketLinkSnapshot* get_snapshot(SocketLink* link, size_t index) {
+  return &link->snapshots[(link->snapshot_first + index) %
+                          SOCKET_LINK_SNAPSHOT_COUNT];
+}
+
+static void take_snapshot(SocketLink* link) {
+  if (link->snapshot_count == SOCKET_LINK_SNAPSHOT_COUNT) {
+    link->snapshot_first =
+        (link->snapshot_first + 1) % SOCKET_LINK_SNAPSHOT_COUNT;
+    link->snapshot_count--;
+  }
+  SocketLinkSnapshot* snapshot = get_snapshot(link, link->snapshot_count++);
+  emulator_write_state(link->e, &snapshot->file_data);
+  snapshot->ticks = emulator_get_ticks(link->e);
+  link->next_snapshot_ticks = snapshot->ticks + SOCKET_LINK_SNAPSHOT_TICKS;
+
+  Ticks oldest_ticks = get_snapshot(link, 0)->ticks - link->base_ticks;
+  prune_transfers(&link->sent, oldest_ticks);
+  prune_transfers(&link->received, oldest_ticks);
+}
+
+#ifndef _WIN32
+
+static void disconnect(SocketLink* link) {
+  if (link->connected) {
+    PRINT_ERROR("link disconnected.\n");
+    link->connected = FALSE;
+  }
+}
+
+static void send_message(SocketLink* link, SocketLinkMessageType type,
+                         Ticks ticks, Ticks complete_ticks, u8 value) {
+  if (!link->connected) {
+    return;
+  }
+  SocketLinkMessage message;
+  ZERO_MEMORY(message);
+  message.ticks = ticks;
+  message.complete_ticks = complete_ticks;
+  message.type = type;
+  message.value = value;
+
+  const u8* data = (const u8*)&message;
+  size_t size = sizeof(message);
+  while (size > 0) {
+#ifdef MSG_NOSIGNAL
+    ssize_t written = send(link->fd, data, size, MSG_NOSIGNAL);
+#else
+    ssize_t written = send(link->fd, data, size, 0);
+#endif
+    if (written > 0) {
+      data += written;
+      size -= written;
+    } else if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pfd = {link->fd, POLLOUT, 0};
+      poll(&pfd, 1, SOCKET_LINK_WAIT_MS);
+    } else if (written < 0 && errno == EINTR) {
+      continue;
+    } else {
+      disconnect(link);
+      return;
+    }
+  }
+}
+
+static int wait_for_socket(SocketLink* link, int timeout_ms) {
+  struct pollfd pfd = {link->fd, POLLIN, 0};
+  return poll(&pfd, 1, timeout_ms);
+}
+
+#else
+
+static void send_message(SocketLink* link, SocketLinkMessageType type,
+                         Ticks ticks, Ticks complete_ticks, u8 value) {}
+
+#endif
+
+static u8 serial_callback(u8 value, Ticks complete_ticks, void* user_data) {
+  SocketLink* link = user_data;
+  if (!link->connected) {
+    return 0xff;
+  }
+  Ticks ticks = get_link_ticks(link);
+  SocketLinkTransfer* transfer = find_transfer(&link->sent, ticks);
+  if (transfer && transfer->value == value) {
+    /* Replaying a transfer that was already sent. */
+    return transfer->reply;
+  }
+
+  truncate_transfers(&link->sent, ticks);
+  transfer = append_transfer(&link->sent);
+  transfer->ticks = ticks;
+  transfer->complete_ticks = complete_ticks - link->base_ticks;
+  transfer->value = value;
+  transfer->reply = link->predicted;
+  send_message(link, SOCKET_LINK_MESSAGE_TRANSFER, transfer->ticks,
+               transfer->complete_ticks, value);
+  return transfer->reply;
+}
+
+static void handle_message(SocketLink* link, const SocketLinkMessage* message) {
+  switch (message->type) {
+    case SOCKET_LINK_MESSAGE_TICKS:
+      link->peer_ticks = MAX(link->peer_ticks, message->ticks);
+      break;
+
+    case SOCKET_LINK_MESSAGE_TRANSFER: {
+      /* Anything at or after this transfer is from a future that the other
+       * end has since rolled back. */
+      Bool undo = FALSE;
+      while (link->received.count > 0 &&
+             link->received.data[link->received.count - 1].ticks >=
+                 message->ticks) {
+        undo |= link->received.data[link->received.count - 1].applied;
+        link->received.count--;
+      }
+      SocketLinkTransfer* transfer = append_transfer(&link->received);
+      transfer->ticks = message->ticks;
+      transfer->complete_ticks = message->complete_ticks;
+      transfer->value = message->value;
+      if (undo || get_link_ticks(link) > message->ticks) {
+        request_rollback(link, message->ticks);
+      }
+      break;
+    }
+
+    case SOCKET_LINK_MESSAGE_REPLY: {
+      link->predicted = message->value;
+      SocketLinkTransfer* transfer = find_transfer(&link->sent, message->ticks);
+      if (!transfer) {
+        break;
+      }
+      if (transfer->reply != message->value) {
+        request_rollback(link, transfer->ticks);
+      }
+      transfer->reply = message->value;
+      transfer->resolved = TRUE;
+      break;
+    }
+  }
+}
+
+/* Reads all pending messages. If |wait| is TRUE, waits for at least one. */
+static void read_messages(SocketLink* link, Bool wait) {
+#ifndef _WIN32
+  while (link->connected) {
+    ssize_t size = recv(link->fd, link->read_buffer + link->read_size,
+                        sizeof(link->read_buffer) - link->read_size, 0);
+    if (size > 0) {
+      link->read_size += size;
+      if (link->read_size == sizeof(link->read_buffer)) {
+        SocketLinkMessage message;
+        memcpy(&message, link->read_buffer, sizeof(message));
+        link->read_size = 0;
+        handle_message(link, &message);
+        wait = FALSE;
+      }
+    } else if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!wait) {
+        break;
+      }
+      wait_for_socket(link, SOCKET_LINK_WAIT_MS);
+    } else if (size < 0 && errno == EINTR) {
+      continue;
+    } else {
+      disconnect(link);
+    }
+  }
+#endif
+}
+
+/* Exchanges any received bytes that are due with the emulator. */
+static void apply_received(SocketLink* link) {
+  Ticks ticks = get_link_ticks(link);
+  size_t i;
+  for (i = 0; i < link->received.count; ++i) {
+    SocketLinkTransfer* transfer = &link->received.data[i];
+    if (transfer->applied || transfer->ticks > ticks) {
+      continue;
+    }
+    u8 reply = emulator_exchange_serial_byte(
+        link->e, transfer->value, transfer->complete_ticks + link->base_ticks);
+    transfer->applied = TRUE;
+    if (!transfer->resolved || transfer->reply != reply) {
+      transfer->reply = reply;
+      transfer->resolved = TRUE;
+      send_message(link, SOCKET_LINK_MESSAGE_REPLY, transfer->ticks,
+                   transfer->complete_ticks, reply);
+    }
+  }
+}
+
+static Ticks get_next_received_ticks(SocketLink* link) {
+  size_t i;
+  for (i = 0; i < link->received.count; ++i) {
+    SocketLinkTransfer* transfer = &link->received.data[i];
+    if (!transfer->applied) {
+      return transfer->ticks + link->base_ticks;
+    }
+  }
+  return INVALID_TICKS;
+}
+
+/* Runs in slices, stopping at each snapshot and each received byte. When
+ * replaying, all events are ignored. */
+static EmulatorEvent run_slices(SocketLink* link, Ticks until_ticks,
+                                Bool replaying) {
+  Emulator* e = link->e;
+  while (TRUE) {
+    apply_received(link);
+    Ticks ticks = emulator_get_ticks(e);
+    if (ticks >= link->next_snapshot_ticks) {
+      take_snapshot(link);
+    }
+    if (ticks >= until_ticks) {
+      return EMULATOR_EVENT_UNTIL_TICKS;
+    }
+    Ticks slice_ticks = MIN(until_ticks, link->next_snapshot_ticks);
+    slice_ticks = MIN(slice_ticks, get_next_received_ticks(link));
+    EmulatorEvent event = emulator_run_until(e, slice_ticks);
+    event &= ~EMULATOR_EVENT_UNTIL_TICKS;
+    if (event & (EMULATOR_EVENT_BREAKPOINT | EMULATOR_EVENT_INVALID_OPCODE)) {
+      /* Replaying won't get any further either. */
+      return event;
+    } else if (event && !replaying) {
+      if (emulator_get_ticks(e) >= until_ticks) {
+        event |= EMULATOR_EVENT_UNTIL_TICKS;
+      }
+      return event;
+    }
+  }
+}
+
+static void rollback(SocketLink* link) {
+  Emulator* e = link->e;
+  Ticks target_ticks = link->rollback_ticks + link->base_ticks;
+  Ticks ticks = emulator_get_ticks(e);
+  link->rollback_ticks = INVALID_TICKS;
+  if (ticks <= target_ticks) {
+    return;
+  }
+
+  size_t index = link->snapshot_count;
+  while (index > 0 && get_snapshot(link, index - 1)->ticks >= target_ticks) {
+    index--;
+  }
+  if (index == 0) {
+    PRINT_ERROR("link: can't roll back to %" PRIu64 ", out of sync.\n",
+                target_ticks);
+    return;
+  }
+  SocketLinkSnapshot* snapshot = get_snapshot(link, index - 1);
+  link->snapshot_count = index;
+  link->next_snapshot_ticks = snapshot->ticks + SOCKET_LINK_SNAPSHOT_TICKS;
+
+  /* If the audio buffer filled up before the rollback, the host has already
+   * played it; the flag that would reset it is part of the restored state. */
+  AudioBuffer* ab = emulator_get_audio_buffer(e);
+  if (audio_buffer_get_frames(ab) >= ab->frames) {
+    ab->position = ab->data;
+  }
+
+  /* Everything logged so far happened before the rollback. */
+  emulator_flush_apu_events(e);
+  emulator_read_state(e, &snapshot->file_data);
+  size_t i;
+  for (i = 0; i < link->received.count; ++i) {
+    SocketLinkTransfer* transfer = &link->received.data[i];
+    if (transfer->ticks + link->base_ticks > snapshot->ticks) {
+      transfer->applied = FALSE;
+    }
+  }
+
+  /* Replay back to where we were with the recorded input. The replayed audio
+   * and APU writes have already been played (or logged), so don't generate
+   * them again. */
+  JoypadCallbackInfo old_jci = emulator_get_joypad_callback(e);
+  JoypadPlayback playback;
+  if (link->joypad_buffer) {
+    emulator_set_joypad_playback_callback(e, link->joypad_buffer, &playback);
+  }
+  ApuEventCallbackInfo old_aci = emulator_get_apu_event_callback(e);
+  emulator_set_apu_event_callback(e, NULL, NULL);
+  EmulatorConfig old_config = emulator_get_config(e);
+  EmulatorConfig config = old_config;
+  config.disable_audio = TRUE;
+  config.log_apu_writes = FALSE;
+  emulator_set_config(e, &config);
+
+  run_slices(link, ticks, TRUE);
+
+  emulator_set_config(e, &old_config);
+  emulator_set_apu_event_callback(e, old_aci.callback, old_aci.user_data);
+  emulator_set_joypad_callback(e, old_jci.callback, old_jci.user_data);
+
+  link->stats.rollbacks++;
+  link->stats.rollback_ticks += ticks - snapshot->ticks;
+}
+
+static void update(SocketLink* link, Bool wait) {
+  read_messages(link, wait);
+  while (link->rollback_ticks != INVALID_TICKS) {
+    rollback(link);
+    /* Replaying may have sent new transfers, whose replies may roll back
+     * again; those are picked up next time. */
+    read_messages(link, FALSE);
+  }
+}
+
+static void accept_peer(SocketLink*, int timeout_ms);
+
+EmulatorEvent socket_link_run_until(SocketLink* link, Ticks until_ticks) {
+  Emulator* e = link->e;
+  if (link->listen_fd >= 0) {
+    accept_peer(link, 0);
+    if (!link->connected) {
+      /* Run unlinked until the other end connects. */
+      return emulator_run_until(e, until_ticks);
+    }
+  }
+  update(link, FALSE);
+  while (TRUE) {
+    Ticks limit_ticks = until_ticks;
+    if (link->connected) {
+      limit_ticks = MIN(limit_ticks, link->base_ticks + link->peer_ticks +
+                                         SOCKET_LINK_MAX_AHEAD_TICKS);
+    }
+    if (emulator_get_ticks(e) >= limit_ticks &&
+        emulator_get_ticks(e) < until_ticks) {
+      /* Too far ahead; wait for the other end to catch up. */
+      send_message(link, SOCKET_LINK_MESSAGE_TICKS, get_link_ticks(link), 0, 0);
+      update(link, TRUE);
+      continue;
+    }
+
+    EmulatorEvent event = run_slices(link, limit_ticks, FALSE);
+    send_message(link, SOCKET_LINK_MESSAGE_TICKS, get_link_ticks(link), 0, 0);
+    update(link, FALSE);
+    if (emulator_get_ticks(e) < until_ticks) {
+      event &= ~EMULATOR_EVENT_UNTIL_TICKS;
+    }
+    if (event) {
+      return event;
+    }
+  }
+}
+
+/* Starts the link over |fd|, from the emulator's current ticks. */
+static void connect_peer(SocketLink* link, int fd) {
+  link->fd = fd;
+  link->connected = TRUE;
+  link->base_ticks = emulator_get_ticks(link->e);
+  link->peer_ticks = 0;
+  link->snapshot_first = 0;
+  link->snapshot_count = 0;
+  take_snapshot(link);
+}
+
+#ifndef _WIN32
+
+static void stop_listening(SocketLink* link) {
+  close(link->listen_fd);
+  link->listen_fd = -1;
+  unlink(link->path);
+}
+
+static Result set_nonblocking(int fd) {
+  CHECK_MSG(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0,
+            "fcntl failed: %s\n", strerror(errno));
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+/* Connects to whoever is listening at the link's path, or else starts
+ * listening there. */
+static Result open_socket(SocketLink* link) {
+  int fd = -1;
+  struct sockaddr_un addr;
+  ZERO_MEMORY(addr);
+  addr.sun_family = AF_UNIX;
+  CHECK_MSG(strlen(link->path) < sizeof(addr.sun_path),
+            "link path too long: %s\n", link->path);
+  strcpy(addr.sun_path, link->path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK_MSG(fd >= 0, "socket failed: %s\n", strerror(errno));
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    CHECK(SUCCESS(set_nonblocking(fd)));
+    connect_peer(link, fd);
+    return OK;
+  }
+
+  /* Nobody is listening yet, so be the one that listens. */
+  close(fd);
+  fd = -1;
+  link->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK_MSG(link->listen_fd >= 0, "socket failed: %s\n", strerror(errno));
+  unlink(link->path);
+  CHECK_MSG(bind(link->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0,
+            "bind \"%s\" failed: %s\n", link->path, strerror(errno));
+  CHECK_MSG(listen(link->listen_fd, 1) == 0, "listen failed: %s\n",
+            strerror(errno));
+  CHECK(SUCCESS(set_nonblocking(link->listen_fd)));
+  printf("waiting for link on \"%s\"...\n", link->path);
+  fflush(stdout);
+  return OK;
+error:
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (link->listen_fd >= 0) {
+    stop_listening(link);
+  }
+  return ERROR;
+}
+
+/* Accepts the other end if it connects within |timeout_ms|. */
+static void accept_peer(SocketLink* link, int timeout_ms) {
+  struct pollfd pfd = {link->listen_fd, POLLIN, 0};
+  if (timeout_ms > 0 && poll(&pfd, 1, timeout_ms) <= 0) {
+    return;
+  }
+  int fd = accept(link->listen_fd, NULL, NULL);
+  if (fd < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      PRINT_ERROR("accept failed: %s\n", strerror(errno));
+      stop_listening(link);
+    }
+    return;
+  }
+  stop_listening(link);
+  if (!SUCCESS(set_nonblocking(fd))) {
+    close(fd);
+    return;
+  }
+  connect_peer(link, fd);
+  printf("link connected.\n");
+  fflush(stdout);
+}
+
+#else
+
+static void accept_peer(SocketLink* link, int timeout_ms) {}
+
+#endif
+
+SocketLink* socket_link_new(Emulator* e, JoypadBuffer* joypad_buffer,
+                            const char* path) {
+#ifdef _WIN32
+  PRINT_ERROR("socket links aren't supported on this platform.\n");
+  return NULL;
+#else
+  SocketLink* link = xcalloc(1, sizeof(SocketLink));
+  link->e = e;
+  link->joypad_buffer = joypad_buffer;
+  link->fd = -1;
+  link->listen_fd = -1;
+  link->path = xstrdup(path);
+  link->rollback_ticks = INVALID_TICKS;
+  link->predicted = 0xff;
+  size_t i;
+  for (i = 0; i < SOCKET_LINK_SNAPSHOT_COUNT; ++i) {
+    emulator_init_state_file_data(e, &link->snapshots[i].file_data);
+  }
+  CHECK(SUCCESS(open_socket(link)));
+  emulator_set_serial_callback(e, serial_callback, link);
+  return link;
+error:
+  socket_link_delete(link);
+  return NULL;
+#endif
+}
+
+void socket_link_delete(SocketLink* link) {
+  if (!link) {
+    return;
+  }
+  emulator_set_serial_callback(link->e, NULL, NULL);
+#ifndef _WIN32
+  if (link->fd >= 0) {
+    close(link->fd);
+  }
+  if (link->listen_fd >= 0) {
+    stop_listening(link);
+  }
+#endif
+  size_t i;
+  for (i = 0; i < SOCKET_LINK_SNAPSHOT_COUNT; ++i) {
+    file_data_delete(&link->snapshots[i].file_data);
+  }
+  xfree(link->path);
+  xfree(link);
+}
+
+Bool socket_link_wait_for_peer(SocketLink* link, int timeout_ms) {
+  if (link->listen_fd >= 0) {
+    accept_peer(link, timeout_ms);
+  }
+  return link->connected;
+}
+
+Bool socket_link_is_connected(SocketLink* link) {
+  return link->connected;
+}
+
+SocketLinkStats socket_link_get_stats(SocketLink* link) {
+  return link->stats;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef BINJGB_SOCKET_LINK_H_
+#define BINJGB_SOCKET_LINK_H_
+
+#include "common.h"
+#include "emulator.h"
+#include "joypad.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Connects an emulator to one in another process with a link cable, over a
+ * Unix domain socket. Neither side waits for the other's bytes; the incoming
+ * byte is predicted (the last byte received, initially 0xff), and when the
+ * prediction turns out to be wrong the emulator is rolled back to a recent
+ * snapshot and replayed with the inputs recorded in the JoypadBuffer. */
+typedef struct SocketLink SocketLink;
+
+typedef struct SocketLinkStats {
+  u32 rollbacks;
+  Ticks rollback_ticks; /* Total ticks replayed. */
+} SocketLinkStats;
+
+/* Connects to the other end at |path|. If nobody is listening there yet,
+ * listens at |path| without waiting; the emulator runs unlinked until the
+ * other end connects, and the link starts from that point. |joypad_buffer|
+ * may be NULL if the emulator has no input. Replaces the emulator's serial
+ * callback. */
+SocketLink* socket_link_new(Emulator*, JoypadBuffer* joypad_buffer,
+                            const char* path);
+void socket_link_delete(SocketLink*);
+/* Waits up to |timeout_ms| for the other end to connect, if it hasn't yet.
+ * Returns whether the link is connected. */
+Bool socket_link_wait_for_peer(SocketLink*, int timeout_ms);
+
+/* Like emulator_run_until, but exchanges link cable bytes with the other end
+ * and rolls back as needed. Won't run too far ahead of the other end, so this
+ * may block until the other end catches up. */
+EmulatorEvent socket_link_run_until(SocketLink*, Ticks until_ticks);
+
+Bool socket_link_is_connected(SocketLink*);
+SocketLinkStats socket_link_get_stats(SocketLink*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BINJGB_SOCKET_LINK_H_ */
@@ -21,18 +21,34 @@
 
 #include "joypad.h"
 #include "options.h"
+#include "replay.h"
+#include "rewind.h"
+#include "rom-cache.h"
+#include "serial-link.h"
+#include "socket-link.h"
+#include "vgm.h"
 
 #define AUDIO_FREQUENCY 44100
 /* This value is arbitrary. Why not 1/10th of a second? */
 #define AUDIO_FRAMES ((AUDIO_FREQUENCY / 10) * SOUND_OUTPUT_COUNT)
 #define DEFAULT_FRAMES 60
+#define TEST_RESULT_EXTRA_FRAMES 10
 #define MAX_PRINT_OPS_LIMIT 512
 #define MAX_PROFILE_LIMIT 1000
+#define LINK_SOCKET_TIMEOUT_MS 10000
+#define REWIND_CHECK_CAPACITY (256 * 1024 * 1024)
+#define REWIND_CHECK_FRAMES_PER_BASE_STATE 45
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
 
 static const char* s_joypad_filename;
+static const char* s_replay_filename;
+static u32 s_replay_keyframe;
 static int s_frames = DEFAULT_FRAMES;
+static u32 s_hash_every;
 static const char* s_output_ppm;
 static Bool s_animate;
+static Bool s_no_early_exit;
 static Bool s_print_ops;
 static u32 s_print_ops_limit = MAX_PRINT_OPS_LIMIT;
 static Bool s_profile;
@@ -42,7 +58,31 @@ static u32 s_random_seed = 0xcabba6e5;
 static u32 s_builtin_palette;
 static Bool s_force_dmg;
 static Bool s_use_sgb_border;
+static Bool s_rewind_check;
+static Bool s_apu_player_check;
+static const char* s_output_vgm;
+static const char* s_link_rom_filename;
+static const char* s_link_socket_path;
 
+static void vgm_callback(const ApuEvent* events, size_t count,
+                         void* user_data) {
+  vgm_writer_append(user_data, events, count);
+}
+
+Result write_vgm(Emulator* e, VgmWriter* writer, const char* filename) {
+  Result result = ERROR;
+  FileData file_data;
+  ZERO_MEMORY(file_data);
+  emulator_flush_apu_events(e);
+  vgm_writer_finish(writer, emulator_get_ticks(e));
+  vgm_init_file_data(writer, &file_data);
+  CHECK(SUCCESS(vgm_write(writer, &file_data)));
+  CHECK(SUCCESS(file_write(filename, &file_data)));
+  result = OK;
+error:
+  file_data_delete(&file_data);
+  return result;
+}
 
 Result write_frame_ppm(Emulator* e, const char* filename) {
   FILE* f = fopen(filename, "wb");
@@ -100,9 +140,20 @@ void usage(int argc, char** argv) {
       "  -l,--log S=N         set log level for system S to N\n"
 #endif
       "  -j,--joypad FILE     read joypad input from FILE\n"
+      "  -r,--replay FILE     play back the replay in FILE\n"
+      "     --replay-keyframe N  start the replay from keyframe N\n"
       "  -f,--frames N        run for N frames (default: %u)\n"
       "  -o,--output FILE     output PPM file to FILE\n"
       "  -a,--animate         output an image every frame\n"
+      "     --hash-every N    print a hash of the emulator state every N\n"
+      "                       frames\n"
+      "     --vgm FILE        write APU register writes to VGM FILE\n"
+      "     --no-early-exit   run all frames, even if the ROM reports a test\n"
+      "                       result first\n"
+      "     --link FILE       connect a second emulator running FILE over the\n"
+      "                       link cable\n"
+      "     --link-socket PATH  connect the link cable to another process over\n"
+      "                       the Unix domain socket at PATH\n"
 #ifdef TESTER_DEBUGGER
       "     --print-ops       print execution count of each opcode\n"
       "     --print-ops-limit max opcodes to print\n"
@@ -112,7 +163,14 @@ void usage(int argc, char** argv) {
       "  -s,--seed SEED       random seed used for initializing RAM\n"
       "  -P,--palette PAL     use a builtin palette for DMG\n"
       "     --force-dmg       force running as a DMG (original gameboy)\n"
-      "     --sgb-border         draw the super gameboy border\n";
+      "     --sgb-border         draw the super gameboy border\n"
+      "     --rewind-check    store every frame in a rewind buffer with each\n"
+      "                       codec, check that each decodes to the same\n"
+      "                       state, and print how long it took\n"
+      "     --apu-player-check  play the APU register writes through an\n"
+      "                       ApuPlayer, and check that it generates the\n"
+      "                       same audio as the emulator, and that a VGM\n"
+      "                       of them reads back the same\n";
 
   PRINT_ERROR(usage, argv[0], DEFAULT_FRAMES);
 
@@ -140,9 +198,16 @@ void parse_options(int argc, char**argv) {
     {'l', "log", 1},
 #endif
     {'j', "joypad", 1},
+    {0, "replay-keyframe", 1},
+    {'r', "replay", 1},
     {'f', "frames", 1},
     {'o', "output", 1},
     {'a', "animate", 0},
+    {0, "hash-every", 1},
+    {0, "vgm", 1},
+    {0, "no-early-exit", 0},
+    {0, "link-socket", 1},
+    {0, "link", 1},
 #ifdef TESTER_DEBUGGER
     {0, "print-ops-limit", 1},
     {0, "print-ops", 0},
@@ -153,6 +218,8 @@ void parse_options(int argc, char**argv) {
     {'P', "palette", 1},
     {0, "force-dmg", 0},
     {0, "sgb-border", 0},
+    {0, "rewind-check", 0},
+    {0, "apu-player-check", 0},
   };
 
   struct OptionParser* parser = option_parser_new(
@@ -211,6 +278,10 @@ void parse_options(int argc, char**argv) {
             s_joypad_filename = result.value;
             break;
 
+          case 'r':
+            s_replay_filename = result.value;
+            break;
+
           case 'f':
             s_frames = atoi(result.value);
             break;
@@ -253,10 +324,28 @@ void parse_options(int argc, char**argv) {
 #else
             if (FALSE) {
 #endif
+            } else if (strcmp(result.option->long_name, "replay-keyframe") ==
+                       0) {
+              s_replay_keyframe = atoi(result.value);
+            } else if (strcmp(result.option->long_name, "hash-every") == 0) {
+              s_hash_every = atoi(result.value);
+            } else if (strcmp(result.option->long_name, "vgm") == 0) {
+              s_output_vgm = result.value;
+            } else if (strcmp(result.option->long_name, "no-early-exit") == 0) {
+              s_no_early_exit = TRUE;
+            } else if (strcmp(result.option->long_name, "link") == 0) {
+              s_link_rom_filename = result.value;
+            } else if (strcmp(result.option->long_name, "link-socket") == 0) {
+              s_link_socket_path = result.value;
             } else if (strcmp(result.option->long_name, "force-dmg") == 0) {
               s_force_dmg = TRUE;
             } else if (strcmp(result.option->long_name, "sgb-border") == 0) {
               s_use_sgb_border = TRUE;
+            } else if (strcmp(result.option->long_name, "rewind-check") == 0) {
+              s_rewind_check = TRUE;
+            } else if (strcmp(result.option->long_name, "apu-player-check") ==
+                       0) {
+              s_apu_player_check = TRUE;
             } else {
               abort();
             }
@@ -427,27 +516,347 @@ void print_profile(Emulator* e) {
 }
 #endif
 
+/* Every frame is stored with each codec, along with a hash of the state, so
+ * the states can be decoded and checked after the run. */
+typedef struct {
+  RewindBuffer* buffers[RewindCodec_Count];
+  FileData state;
+  u32* dirty_pages;
+  size_t dirty_pages_size;
+  Ticks* ticks;
+  u64* hashes;
+  size_t count;
+  size_t capacity;
+} RewindCheck;
+
+static u64 hash_file_data(const FileData* file_data) {
+  u64 hash = FNV_OFFSET_BASIS;
+  size_t i;
+  for (i = 0; i < file_data->size; ++i) {
+    hash = (hash ^ file_data->data[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static RewindCheck* rewind_check_new(Emulator* e, size_t capacity) {
+  RewindCheck* check = xcalloc(1, sizeof(RewindCheck));
+  RewindInit init;
+  ZERO_MEMORY(init);
+  init.buffer_capacity = REWIND_CHECK_CAPACITY;
+  init.frames_per_base_state = REWIND_CHECK_FRAMES_PER_BASE_STATE;
+  int i;
+  for (i = 0; i < RewindCodec_Count; ++i) {
+    init.codec = i;
+    check->buffers[i] = rewind_new(&init, e);
+  }
+  emulator_init_state_file_data(e, &check->state);
+  (void)emulator_write_state(e, &check->state);
+  check->dirty_pages_size =
+      DIV_CEIL(emulator_get_state_page_count(e), 32) * sizeof(u32);
+  check->dirty_pages = xmalloc(check->dirty_pages_size);
+  check->ticks = xcalloc(capacity, sizeof(Ticks));
+  check->hashes = xcalloc(capacity, sizeof(u64));
+  check->capacity = capacity;
+  return check;
+}
+
+static void rewind_check_delete(RewindCheck* check) {
+  if (!check) {
+    return;
+  }
+  int i;
+  for (i = 0; i < RewindCodec_Count; ++i) {
+    rewind_delete(check->buffers[i]);
+  }
+  file_data_delete(&check->state);
+  xfree(check->dirty_pages);
+  xfree(check->ticks);
+  xfree(check->hashes);
+  xfree(check);
+}
+
+static void rewind_check_append(RewindCheck* check, Emulator* e) {
+  if (check->count == check->capacity) {
+    return;
+  }
+  memset(check->dirty_pages, 0, check->dirty_pages_size);
+  (void)emulator_update_state(e, &check->state, check->dirty_pages);
+  Ticks ticks = emulator_get_ticks(e);
+  int i;
+  for (i = 0; i < RewindCodec_Count; ++i) {
+    rewind_append_state(check->buffers[i], ticks, &check->state,
+                        check->dirty_pages);
+  }
+  check->ticks[check->count] = ticks;
+  check->hashes[check->count] = hash_file_data(&check->state);
+  check->count++;
+}
+
+/* Fails if any stored state doesn't decode to the state that was stored. */
+static Result rewind_check_finish(RewindCheck* check) {
+  Bool ok = TRUE;
+  int i;
+  for (i = 0; i < RewindCodec_Count; ++i) {
+    RewindBuffer* buffer = check->buffers[i];
+    const char* name = rewind_get_codec_name(i);
+    Ticks oldest = rewind_get_oldest_ticks(buffer);
+    size_t checked = 0;
+    size_t failed = 0;
+    size_t j;
+    for (j = 0; j < check->count; ++j) {
+      if (oldest == INVALID_TICKS || check->ticks[j] < oldest) {
+        continue; /* Overwritten. */
+      }
+      RewindResult result;
+      if (!SUCCESS(rewind_to_ticks(buffer, check->ticks[j], &result)) ||
+          result.info->ticks != check->ticks[j] ||
+          hash_file_data(&result.file_data) != check->hashes[j]) {
+        if (failed == 0) {
+          PRINT_ERROR("rewind %s: state at ticks %" PRIu64
+                      " doesn't match.\n",
+                      name, check->ticks[j]);
+        }
+        failed++;
+      }
+      checked++;
+    }
+
+    RewindStats stats = rewind_get_stats(buffer);
+    RewindCodecStats* cs = &stats.codecs[i];
+    printf("rewind %s: %zu/%zu states ok, %.2f%% encode %.0f ns/frame "
+           "decode %.0f ns/frame\n",
+           name, checked - failed, checked,
+           cs->uncompressed_bytes
+               ? (f64)cs->compressed_bytes * 100 / cs->uncompressed_bytes
+               : 0,
+           cs->encoded_frames ? (f64)cs->encode_ns / cs->encoded_frames : 0,
+           cs->decoded_frames ? (f64)cs->decode_ns / cs->decoded_frames : 0);
+    if (failed) {
+      ok = FALSE;
+    }
+  }
+  return ok ? OK : ERROR;
+}
+
+/* The emulator's APU events are played through an ApuPlayer as they are
+ * logged, and the samples from both are compared. The player runs ahead of
+ * the emulator's APU, so its extra samples wait in |pending|. The events are
+ * also written as a VGM, which must read back the same. */
+typedef struct {
+  ApuPlayer* player;
+  u8* pending;
+  size_t pending_size;
+  size_t pending_capacity;
+  size_t player_read;   /* Bytes of the player's buffer already taken. */
+  size_t emulator_read; /* Bytes of the emulator's buffer already compared. */
+  u64 compared;
+  Bool failed;
+  VgmWriter* vgm_writer;
+  ApuEvent* events;
+  size_t event_count;
+  size_t event_capacity;
+} ApuPlayerCheck;
+
+static ApuPlayerCheck* apu_player_check_new(Emulator* e) {
+  ApuPlayerCheck* check = xcalloc(1, sizeof(ApuPlayerCheck));
+  ApuPlayerInit init;
+  ZERO_MEMORY(init);
+  init.audio_frequency = AUDIO_FREQUENCY;
+  init.audio_frames = AUDIO_FRAMES;
+  init.is_cgb = emulator_is_cgb(e);
+  check->player = apu_player_new(&init);
+  if (!check->player) {
+    xfree(check);
+    return NULL;
+  }
+  check->vgm_writer = vgm_writer_new();
+  return check;
+}
+
+static void apu_player_check_delete(ApuPlayerCheck* check) {
+  if (!check) {
+    return;
+  }
+  apu_player_delete(check->player);
+  xfree(check->pending);
+  vgm_writer_delete(check->vgm_writer);
+  xfree(check->events);
+  xfree(check);
+}
+
+static void apu_player_check_run(ApuPlayerCheck* check, Ticks ticks) {
+  AudioBuffer* ab = apu_player_get_audio_buffer(check->player);
+  while (apu_player_get_ticks(check->player) < ticks) {
+    EmulatorEvent event = apu_player_run_until(check->player, ticks);
+    size_t size = ab->position - ab->data - check->player_read;
+    if (check->pending_size + size > check->pending_capacity) {
+      check->pending_capacity = (check->pending_size + size) * 2;
+      check->pending = xrealloc(check->pending, check->pending_capacity);
+    }
+    memcpy(check->pending + check->pending_size,
+           ab->data + check->player_read, size);
+    check->pending_size += size;
+    check->player_read =
+        event & EMULATOR_EVENT_AUDIO_BUFFER_FULL ? 0 : check->player_read + size;
+  }
+}
+
+static void apu_player_check_callback(const ApuEvent* events, size_t count,
+                                      void* user_data) {
+  ApuPlayerCheck* check = user_data;
+  vgm_writer_append(check->vgm_writer, events, count);
+  if (check->event_count + count > check->event_capacity) {
+    check->event_capacity = (check->event_count + count) * 2;
+    check->events =
+        xrealloc(check->events, check->event_capacity * sizeof(ApuEvent));
+  }
+  memcpy(check->events + check->event_count, events, count * sizeof(ApuEvent));
+  check->event_count += count;
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    if (!events[i].boot) {
+      apu_player_check_run(check, events[i].ticks);
+      apu_player_write(check->player, events[i].addr, events[i].value);
+    }
+  }
+}
+
+/* Called after each emulator_run_until, with the events it returned. */
+static void apu_player_check_update(ApuPlayerCheck* check, Emulator* e,
+                                    EmulatorEvent event) {
+  emulator_flush_apu_events(e);
+  apu_player_check_run(check, emulator_get_ticks(e));
+  AudioBuffer* ab = emulator_get_audio_buffer(e);
+  const u8* data = ab->data + check->emulator_read;
+  size_t size = ab->position - data;
+  if (!check->failed) {
+    size_t i;
+    for (i = 0; i < size; ++i) {
+      if (i == check->pending_size) {
+        PRINT_ERROR("apu player: fell behind the emulator at byte %" PRIu64
+                    ".\n",
+                    check->compared);
+        check->failed = TRUE;
+        break;
+      }
+      if (data[i] != check->pending[i]) {
+        PRINT_ERROR("apu player: byte %" PRIu64
+                    " is %u, but the emulator's is %u.\n",
+                    check->compared, check->pending[i], data[i]);
+        check->failed = TRUE;
+        break;
+      }
+      check->compared++;
+    }
+    memmove(check->pending, check->pending + i, check->pending_size - i);
+    check->pending_size -= i;
+  }
+  check->emulator_read =
+      event & EMULATOR_EVENT_AUDIO_BUFFER_FULL ? 0 : check->emulator_read + size;
+}
+
+/* The VGM keeps the events' order, address, value and boot flag, but
+ * rounds their ticks down to a VGM sample. */
+static Result apu_player_check_vgm(ApuPlayerCheck* check, Emulator* e) {
+  Result result = ERROR;
+  FileData file_data;
+  ZERO_MEMORY(file_data);
+  vgm_writer_finish(check->vgm_writer, emulator_get_ticks(e));
+  vgm_init_file_data(check->vgm_writer, &file_data);
+  CHECK(SUCCESS(vgm_write(check->vgm_writer, &file_data)));
+  VgmReader reader;
+  CHECK(SUCCESS(vgm_reader_init(&reader, &file_data)));
+  size_t i;
+  ApuEvent event;
+  for (i = 0; vgm_reader_next(&reader, &event); ++i) {
+    CHECK_MSG(i < check->event_count,
+              "apu player: the VGM has more than %zu events.\n",
+              check->event_count);
+    const ApuEvent* expected = &check->events[i];
+    Ticks ticks = expected->ticks * VGM_SAMPLE_RATE / CPU_TICKS_PER_SECOND *
+                  CPU_TICKS_PER_SECOND / VGM_SAMPLE_RATE;
+    CHECK_MSG(event.ticks == ticks && event.addr == expected->addr &&
+                  event.value == expected->value &&
+                  event.boot == expected->boot,
+              "apu player: VGM event %zu is %02x=%02x%s at ticks %" PRIu64
+              ", expected %02x=%02x%s at ticks %" PRIu64 ".\n",
+              i, event.addr, event.value, event.boot ? " (boot)" : "",
+              event.ticks, expected->addr, expected->value,
+              expected->boot ? " (boot)" : "", ticks);
+  }
+  CHECK_MSG(i == check->event_count,
+            "apu player: the VGM has %zu of %zu events.\n", i,
+            check->event_count);
+  printf("apu player: %zu VGM events ok\n", i);
+  result = OK;
+error:
+  file_data_delete(&file_data);
+  return result;
+}
+
+static Result apu_player_check_finish(ApuPlayerCheck* check, Emulator* e) {
+  printf("apu player: %" PRIu64 " bytes %s\n", check->compared,
+         check->failed ? "matched before a difference" : "ok");
+  Result vgm_result = apu_player_check_vgm(check, e);
+  return check->failed || !SUCCESS(vgm_result) ? ERROR : OK;
+}
+
 int main(int argc, char** argv) {
   int result = 1;
   Emulator* e = NULL;
+  Emulator* link_e = NULL;
+  SerialLink* link = NULL;
+  SocketLink* socket_link = NULL;
   JoypadBuffer* joypad_buffer = NULL;
+  VgmWriter* vgm_writer = NULL;
+  RewindCheck* rewind_check = NULL;
+  ApuPlayerCheck* apu_player_check = NULL;
 
   parse_options(argc, argv);
+  /* Linked emulators may run several times per call, and there is only one
+   * APU event callback. */
+  CHECK_MSG(!s_apu_player_check ||
+                (!s_link_rom_filename && !s_link_socket_path && !s_output_vgm),
+            "--apu-player-check can't be used with --link, --link-socket or "
+            "--vgm.\n");
 
-  FileData rom;
-  CHECK(SUCCESS(file_read_aligned(s_rom_filename, MINIMUM_ROM_SIZE, &rom)));
+  /* Test ROMs don't change while running. */
+  EmulatorRom* rom = rom_cache_load(s_rom_filename, TRUE);
+  CHECK(rom != NULL);
 
   EmulatorInit emulator_init;
   ZERO_MEMORY(emulator_init);
-  emulator_init.rom = rom;
+  emulator_init.shared_rom = rom;
   emulator_init.audio_frequency = AUDIO_FREQUENCY;
   emulator_init.audio_frames = AUDIO_FRAMES;
   emulator_init.random_seed = s_random_seed;
   emulator_init.builtin_palette = s_builtin_palette;
   emulator_init.force_dmg = s_force_dmg;
   e = emulator_new(&emulator_init);
+  emulator_rom_unref(rom);
   CHECK(e != NULL);
 
+  /* Nothing reads the audio buffer, so don't bother generating samples,
+   * unless they are checked. */
+  EmulatorConfig emu_config = emulator_get_config(e);
+  emu_config.disable_audio = !s_apu_player_check;
+  /* Stop early when a test ROM reports its result, unless every frame is
+   * wanted. */
+  emu_config.detect_test_result = !s_no_early_exit && !s_animate;
+  emulator_set_config(e, &emu_config);
+
+  if (s_link_rom_filename) {
+    /* Shares the ROM with the first emulator if it is the same file. */
+    EmulatorRom* link_rom = rom_cache_load(s_link_rom_filename, TRUE);
+    CHECK(link_rom != NULL);
+    emulator_init.shared_rom = link_rom;
+    link_e = emulator_new(&emulator_init);
+    emulator_rom_unref(link_rom);
+    CHECK(link_e != NULL);
+    emulator_set_config(link_e, &emu_config);
+    link = serial_link_new(e, link_e);
+  }
+
   JoypadPlayback joypad_playback;
   if (s_joypad_filename) {
     FileData file_data;
@@ -455,6 +864,44 @@ int main(int argc, char** argv) {
     CHECK(SUCCESS(joypad_read(&file_data, &joypad_buffer)));
     file_data_delete(&file_data);
     emulator_set_joypad_playback_callback(e, joypad_buffer, &joypad_playback);
+  } else if (s_replay_filename) {
+    Replay* replay;
+    CHECK(SUCCESS(
+        replay_read_from_file(s_replay_filename, &replay, &joypad_buffer)));
+    Result seek_result = ERROR;
+    if (SUCCESS(replay_check_rom(replay, e))) {
+      seek_result = replay_seek_to_keyframe(replay, e, s_replay_keyframe);
+    }
+    replay_delete(replay);
+    CHECK(SUCCESS(seek_result));
+    emulator_set_joypad_playback_callback(e, joypad_buffer, &joypad_playback);
+  }
+
+  if (s_link_socket_path) {
+    socket_link = socket_link_new(e, joypad_buffer, s_link_socket_path);
+    CHECK(socket_link != NULL);
+    /* Start linked, so every run is the same. */
+    CHECK_MSG(socket_link_wait_for_peer(socket_link, LINK_SOCKET_TIMEOUT_MS),
+              "Nothing connected to the link at \"%s\".\n",
+              s_link_socket_path);
+  }
+
+  if (s_rewind_check) {
+    /* A few spare frames, for the ones run after a test result. */
+    rewind_check =
+        rewind_check_new(e, s_frames + TEST_RESULT_EXTRA_FRAMES + 2);
+  }
+
+  if (s_output_vgm) {
+    vgm_writer = vgm_writer_new();
+    emulator_set_apu_event_callback(e, vgm_callback, vgm_writer);
+  }
+
+  if (s_apu_player_check) {
+    apu_player_check = apu_player_check_new(e);
+    CHECK(apu_player_check != NULL);
+    emulator_set_apu_event_callback(e, apu_player_check_callback,
+                                    apu_player_check);
   }
 
 #ifdef TESTER_DEBUGGER
@@ -469,9 +916,22 @@ int main(int argc, char** argv) {
   u32 animation_frame = 0; /* Will likely differ from PPU frame. */
   u32 next_input_frame = 0;
   u32 next_input_frame_buttons = 0;
+  u32 hash_frame = 0;
   f64 start_time = get_time_sec();
   while (TRUE) {
-    EmulatorEvent event = emulator_run_until(e, until_ticks);
+    EmulatorEvent event;
+    if (link) {
+      EmulatorEvent events[SERIAL_LINK_EMULATOR_COUNT];
+      serial_link_run_until(link, until_ticks, events);
+      event = events[0];
+    } else if (socket_link) {
+      event = socket_link_run_until(socket_link, until_ticks);
+    } else {
+      event = emulator_run_until(e, until_ticks);
+    }
+    if (apu_player_check) {
+      apu_player_check_update(apu_player_check, e, event);
+    }
     if (event & EMULATOR_EVENT_NEW_FRAME) {
       if (s_output_ppm && s_animate) {
         char buffer[32];
@@ -481,10 +941,29 @@ int main(int argc, char** argv) {
         xfree((char*)result);
       }
 
+      if (rewind_check) {
+        rewind_check_append(rewind_check, e);
+      }
+
+      if (s_hash_every && hash_frame++ % s_hash_every == 0) {
+        printf("frame %u: %016" PRIx64 "\n", hash_frame - 1,
+               emulator_hash_state(e));
+      }
+
       if (finish_at_next_frame) {
         break;
       }
     }
+    if (event & EMULATOR_EVENT_TEST_FINISHED) {
+      printf("test %s\n", emulator_get_test_result(e) == TEST_RESULT_PASSED
+                              ? "passed"
+                              : "failed");
+      /* Give the ROM time to draw its result too, so the final frame matches
+       * the one from a full run. */
+      until_ticks = MIN(until_ticks, emulator_get_ticks(e) +
+                                         TEST_RESULT_EXTRA_FRAMES *
+                                             PPU_FRAME_TICKS);
+    }
     if (event & EMULATOR_EVENT_UNTIL_TICKS) {
       finish_at_next_frame = TRUE;
       until_ticks += PPU_FRAME_TICKS;
@@ -509,6 +988,18 @@ int main(int argc, char** argv) {
     CHECK(SUCCESS(write_frame_ppm(e, s_output_ppm)));
   }
 
+  if (s_output_vgm) {
+    CHECK(SUCCESS(write_vgm(e, vgm_writer, s_output_vgm)));
+  }
+
+  if (rewind_check) {
+    CHECK(SUCCESS(rewind_check_finish(rewind_check)));
+  }
+
+  if (apu_player_check) {
+    CHECK(SUCCESS(apu_player_check_finish(apu_player_check, e)));
+  }
+
 #ifdef TESTER_DEBUGGER
   if (s_print_ops) {
     print_ops();
@@ -521,6 +1012,14 @@ int main(int argc, char** argv) {
 
   result = 0;
 error:
+  vgm_writer_delete(vgm_writer);
+  rewind_check_delete(rewind_check);
+  apu_player_check_delete(apu_player_check);
+  serial_link_delete(link);
+  socket_link_delete(socket_link);
+  if (link_e) {
+    emulator_delete(link_e);
+  }
   if (joypad_buffer) {
     joypad_delete(joypad_buffer);
   }
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "vgm.h"
+
+#include <assert.h>
+
+#define VGM_HEADER_SIZE 0x100
+#define VGM_VERSION 0x161
+#define VGM_DEFAULT_CAPACITY 65536
+
+#define VGM_IDENT_OFFSET 0x00
+#define VGM_EOF_OFFSET 0x04
+#define VGM_VERSION_OFFSET 0x08
+#define VGM_TOTAL_SAMPLES_OFFSET 0x18
+#define VGM_DATA_OFFSET 0x34
+#define VGM_DMG_CLOCK_OFFSET 0x80
+#define VGM_MIN_DMG_VERSION 0x161
+#define VGM_DEFAULT_DATA_OFFSET 0x40 /* Used before version 1.50. */
+
+#define VGM_CMD_WAIT 0x61
+#define VGM_CMD_WAIT_735 0x62
+#define VGM_CMD_WAIT_882 0x63
+#define VGM_CMD_END 0x66
+#define VGM_CMD_WAIT_SHORT 0x70 /* 0x70..0x7f wait 1..16 samples. */
+#define VGM_CMD_DMG_WRITE 0xb3
+#define VGM_CMD_DATA_BLOCK 0x67
+#define VGM_DMG_SECOND_CHIP 0x80
+#define VGM_DMG_WRITE_SIZE 3
+#define VGM_WAIT_SIZE 3
+
+/* The boot ROM's APU writes (ApuEvents with boot set) are written first and
+ * followed by a zero-sample wait, which players ignore, so the reader can
+ * mark them as boot writes again. */
+
+struct VgmWriter {
+  u8* data; /* Command stream, not including the header. */
+  size_t size;
+  size_t capacity;
+  u64 samples; /* Samples waited so far. */
+  Bool in_boot; /* The last write was a boot write. */
+};
+
+static u64 ticks_to_samples(Ticks ticks) {
+  return ticks * VGM_SAMPLE_RATE / CPU_TICKS_PER_SECOND;
+}
+
+static Ticks samples_to_ticks(u64 samples) {
+  return samples * CPU_TICKS_PER_SECOND / VGM_SAMPLE_RATE;
+}
+
+static u32 read_u32_le(const u8* src) {
+  return src[0] | (src[1] << 8) | (src[2] << 16) | ((u32)src[3] << 24);
+}
+
+static void write_u32_le(u8* dst, u32 value) {
+  dst[0] = value & 0xff;
+  dst[1] = (value >> 8) & 0xff;
+  dst[2] = (value >> 16) & 0xff;
+  dst[3] = (value >> 24) & 0xff;
+}
+
+VgmWriter* vgm_writer_new(void) {
+  VgmWriter* writer = xcalloc(1, sizeof(VgmWriter));
+  writer->capacity = VGM_DEFAULT_CAPACITY;
+  writer->data = xmalloc(writer->capacity);
+  return writer;
+}
+
+void vgm_writer_delete(VgmWriter* writer) {
+  if (!writer) {
+    return;
+  }
+  xfree(writer->data);
+  xfree(writer);
+}
+
+static void emit_u8(VgmWriter* writer, u8 value) {
+  if (writer->size == writer->capacity) {
+    writer->capacity *= 2;
+    writer->data = xrealloc(writer->data, writer->capacity);
+  }
+  writer->data[writer->size++] = value;
+}
+
+static void emit_boot_end(VgmWriter* writer) {
+  if (writer->in_boot) {
+    emit_u8(writer, VGM_CMD_WAIT);
+    emit_u8(writer, 0);
+    emit_u8(writer, 0);
+    writer->in_boot = FALSE;
+  }
+}
+
+static void emit_wait_until(VgmWriter* writer, Ticks ticks) {
+  u64 target = ticks_to_samples(ticks);
+  while (writer->samples < target) {
+    u64 delta = MIN(target - writer->samples, 0xffff);
+    if (delta == 735) {
+      emit_u8(writer, VGM_CMD_WAIT_735);
+    } else if (delta == 882) {
+      emit_u8(writer, VGM_CMD_WAIT_882);
+    } else if (delta <= 16) {
+      emit_u8(writer, VGM_CMD_WAIT_SHORT + (u8)(delta - 1));
+    } else {
+      emit_u8(writer, VGM_CMD_WAIT);
+      emit_u8(writer, delta & 0xff);
+      emit_u8(writer, delta >> 8);
+    }
+    writer->samples += delta;
+  }
+}
+
+void vgm_writer_append(VgmWriter* writer, const ApuEvent* events,
+                       size_t count) {
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    if (!events[i].boot) {
+      emit_boot_end(writer);
+    }
+    writer->in_boot = events[i].boot;
+    emit_wait_until(writer, events[i].ticks);
+    emit_u8(writer, VGM_CMD_DMG_WRITE);
+    emit_u8(writer, events[i].addr);
+    emit_u8(writer, events[i].value);
+  }
+}
+
+void vgm_writer_finish(VgmWriter* writer, Ticks end_ticks) {
+  emit_boot_end(writer);
+  emit_wait_until(writer, end_ticks);
+  emit_u8(writer, VGM_CMD_END);
+}
+
+void vgm_init_file_data(VgmWriter* writer, FileData* file_data) {
+  file_data->size = VGM_HEADER_SIZE + writer->size;
+  file_data->data = xmalloc(file_data->size);
+}
+
+Result vgm_write(VgmWriter* writer, FileData* file_data) {
+  CHECK_MSG(file_data->size == VGM_HEADER_SIZE + writer->size,
+            "Expected file size of %zu, got %zu\n",
+            VGM_HEADER_SIZE + writer->size, file_data->size);
+  CHECK_MSG(writer->samples <= 0xffffffffu, "Too many samples for VGM.\n");
+  u8* header = file_data->data;
+  memset(header, 0, VGM_HEADER_SIZE);
+  memcpy(header + VGM_IDENT_OFFSET, "Vgm ", 4);
+  write_u32_le(header + VGM_EOF_OFFSET, file_data->size - VGM_EOF_OFFSET);
+  write_u32_le(header + VGM_VERSION_OFFSET, VGM_VERSION);
+  write_u32_le(header + VGM_TOTAL_SAMPLES_OFFSET, (u32)writer->samples);
+  write_u32_le(header + VGM_DATA_OFFSET, VGM_HEADER_SIZE - VGM_DATA_OFFSET);
+  write_u32_le(header + VGM_DMG_CLOCK_OFFSET, CPU_TICKS_PER_SECOND);
+  memcpy(header + VGM_HEADER_SIZE, writer->data, writer->size);
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+Result vgm_reader_init(VgmReader* reader, const FileData* file_data) {
+  const u8* data = file_data->data;
+  CHECK_MSG(file_data->size >= VGM_HEADER_SIZE &&
+                memcmp(data + VGM_IDENT_OFFSET, "Vgm ", 4) == 0,
+            "Not a VGM file.\n");
+  u32 version = read_u32_le(data + VGM_VERSION_OFFSET);
+  CHECK_MSG(version >= VGM_MIN_DMG_VERSION &&
+                read_u32_le(data + VGM_DMG_CLOCK_OFFSET) != 0,
+            "VGM file has no GameBoy DMG data.\n");
+  u32 data_offset = read_u32_le(data + VGM_DATA_OFFSET);
+  data_offset = data_offset ? VGM_DATA_OFFSET + data_offset
+                            : VGM_DEFAULT_DATA_OFFSET;
+  CHECK_MSG(data_offset <= file_data->size, "Bad VGM data offset: %u\n",
+            data_offset);
+  reader->data = data + data_offset;
+  reader->end = data + file_data->size;
+  reader->samples = 0;
+  reader->boot_end = NULL;
+  const u8* p = reader->data;
+  while (reader->end - p >= VGM_DMG_WRITE_SIZE && p[0] == VGM_CMD_DMG_WRITE) {
+    p += VGM_DMG_WRITE_SIZE;
+  }
+  if (p > reader->data && reader->end - p >= VGM_WAIT_SIZE &&
+      p[0] == VGM_CMD_WAIT && p[1] == 0 && p[2] == 0) {
+    reader->boot_end = p;
+  }
+  return OK;
+  ON_ERROR_RETURN;
+}
+
+/* Number of operand bytes for commands that don't affect the DMG. */
+static size_t get_skipped_command_size(u8 cmd) {
+  switch (cmd) {
+    case 0x4f: case 0x50: case 0x94: return 1;
+    case 0x90: case 0x91: case 0x95: return 4;
+    case 0x92: return 5;
+    case 0x93: return 10;
+    default:
+      if (cmd >= 0x30 && cmd <= 0x3f) return 1;
+      if (cmd >= 0x40 && cmd <= 0x5f) return 2;
+      if (cmd >= 0xa0 && cmd <= 0xbf) return 2;
+      if (cmd >= 0xc0 && cmd <= 0xdf) return 3;
+      if (cmd >= 0xe0) return 4;
+      return 0;
+  }
+}
+
+Bool vgm_reader_next(VgmReader* reader, ApuEvent* event) {
+  while (reader->data < reader->end) {
+    const u8* p = reader->data;
+    u8 cmd = *p++;
+    size_t avail = reader->end - p;
+    switch (cmd) {
+      case VGM_CMD_END:
+        reader->data = reader->end;
+        return FALSE;
+
+      case VGM_CMD_WAIT:
+        if (avail < 2) goto end;
+        reader->samples += p[0] | (p[1] << 8);
+        p += 2;
+        break;
+
+      case VGM_CMD_WAIT_735: reader->samples += 735; break;
+      case VGM_CMD_WAIT_882: reader->samples += 882; break;
+
+      case VGM_CMD_DATA_BLOCK: {
+        /* 0x67 0x66 tt ss ss ss ss, then ss bytes of data. */
+        if (avail < 6) goto end;
+        u32 size = read_u32_le(p + 2);
+        if (avail - 6 < size) goto end;
+        p += 6 + size;
+        break;
+      }
+
+      case VGM_CMD_DMG_WRITE:
+        if (avail < 2) goto end;
+        reader->data = p + 2;
+        if (!(p[0] & VGM_DMG_SECOND_CHIP)) {
+          event->ticks = samples_to_ticks(reader->samples);
+          event->addr = p[0];
+          event->value = p[1];
+          event->boot = reader->boot_end && p - 1 < reader->boot_end;
+          return TRUE;
+        }
+        continue;
+
+      default:
+        if (cmd >= VGM_CMD_WAIT_SHORT && cmd <= VGM_CMD_WAIT_SHORT + 15) {
+          reader->samples += cmd - VGM_CMD_WAIT_SHORT + 1;
+        } else if (cmd >= 0x80 && cmd <= 0x8f) {
+          /* YM2612 DAC write, then wait 0..15 samples. */
+          reader->samples += cmd - 0x80;
+        } else {
+          size_t size = get_skipped_command_size(cmd);
+          if (avail < size) goto end;
+          p += size;
+        }
+        break;
+    }
+    reader->data = p;
+  }
+end:
+  reader->data = reader->end;
+  return FALSE;
+}
+
+Ticks vgm_reader_get_ticks(VgmReader* reader) {
+  return samples_to_ticks(reader->samples);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2018 Ben Smith
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef BINJGB_VGM_H_
+#define BINJGB_VGM_H_
+
+#include "common.h"
+#include "emulator.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* VGM 1.61 files, using the GameBoy DMG chip. Register numbers are relative to
+ * 0xff10, the same as ApuEvent addresses. See https://vgmrips.net/wiki/VGM_Specification */
+#define VGM_SAMPLE_RATE 44100
+
+typedef struct VgmWriter VgmWriter;
+
+typedef struct VgmReader {
+  const u8* data; /* Next command. */
+  const u8* end;
+  u64 samples; /* Samples waited so far. */
+  const u8* boot_end; /* Writes before this are boot writes, or NULL. */
+} VgmReader;
+
+VgmWriter* vgm_writer_new(void);
+void vgm_writer_delete(VgmWriter*);
+/* Boot writes (see ApuEvent) are kept, since VGM players start the DMG from
+ * power-on, and vgm_reader_next marks them as boot writes again. */
+void vgm_writer_append(VgmWriter*, const ApuEvent* events, size_t count);
+/* Wait until end_ticks, then end the command stream. */
+void vgm_writer_finish(VgmWriter*, Ticks end_ticks);
+void vgm_init_file_data(VgmWriter*, FileData*);
+Result vgm_write(VgmWriter*, FileData*);
+
+/* The reader refers to file_data, so it must outlive the reader. */
+Result vgm_reader_init(VgmReader*, const FileData*);
+/* Returns FALSE at the end of the command stream. Commands for other chips
+ * are skipped. */
+Bool vgm_reader_next(VgmReader*, ApuEvent*);
+Ticks vgm_reader_get_ticks(VgmReader*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BINJGB_VGM_H_ */